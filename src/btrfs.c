@@ -55,6 +55,8 @@ UINT32 mount_flush_interval = 30;
 UINT32 mount_max_inline = 2048;
 UINT32 mount_raid5_recalculation = 1;
 UINT32 mount_raid6_recalculation = 1;
+UINT32 mount_no_trim = 0;
+UINT32 mount_trim_on_mount = 0;
 BOOL log_started = FALSE;
 UNICODE_STRING log_device, log_file, registry_path;
 
@@ -448,11 +450,73 @@ exit:
     return Status;
 }
 
+static BOOL is_metadata_dirty(device_extension* Vcb, fcb* fcb, file_ref* fileref) {
+    if (fcb == Vcb->volume_fcb || fcb->dirty || (fileref && fileref->dirty))
+        return TRUE;
+    
+    // writes to a stream dirty the fcb of the file it belongs to, rather than its own
+    if (fcb->ads && fileref && fileref->parent)
+        return fileref->parent->fcb->dirty;
+    
+    return FALSE;
+}
+
+// Makes sure that the metadata for a file has reached the disk. If it isn't dirty and no commit
+// is still writing, it's already durable, which we can check with the tree lock shared. Otherwise
+// getting the lock exclusively means waiting for any commit which is still writing, and if the
+// file's still dirty once we have it we commit there and then - any other threads flushing at
+// the same time will then find nothing left to do.
+static NTSTATUS flush_metadata(device_extension* Vcb, fcb* fcb, file_ref* fileref, PIRP Irp) {
+    LIST_ENTRY rollback;
+    NTSTATUS Status = STATUS_SUCCESS;
+    
+    // If a commit has failed, nothing since the last good one is on the disk.
+    if (Vcb->readonly)
+        return Vcb->commit_failed ? STATUS_UNEXPECTED_IO_ERROR : STATUS_SUCCESS;
+    
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    
+    if (!is_metadata_dirty(Vcb, fcb, fileref) && !Vcb->commit_writing) {
+        ExReleaseResourceLite(&Vcb->tree_lock);
+        return STATUS_SUCCESS;
+    }
+    
+    ExReleaseResourceLite(&Vcb->tree_lock);
+    
+    InitializeListHead(&rollback);
+    
+    ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+    
+    if (Vcb->need_write && !Vcb->readonly && is_metadata_dirty(Vcb, fcb, fileref)) {
+        Status = do_write(Vcb, Irp, &rollback);
+        if (!NT_SUCCESS(Status))
+            ERR("do_write returned %08x\n", Status);
+        
+        free_trees(Vcb);
+        
+        clear_rollback(Vcb, &rollback);
+    }
+    
+    if (NT_SUCCESS(Status)) {
+        if (Vcb->commit_failed)
+            Status = STATUS_UNEXPECTED_IO_ERROR;
+        else if (!IsListEmpty(&fcb->delalloc) && !NT_SUCCESS(fcb->delalloc_status)) {
+            // some of the file's data couldn't be written - it's still queued, but isn't on the disk
+            Status = fcb->delalloc_status;
+        }
+    }
+    
+    ExReleaseResourceLite(&Vcb->tree_lock);
+    
+    return Status;
+}
+
 static NTSTATUS STDCALL drv_flush_buffers(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
     NTSTATUS Status;
     PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation( Irp );
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     fcb* fcb = FileObject->FsContext;
+    ccb* ccb = FileObject->FsContext2;
     device_extension* Vcb = DeviceObject->DeviceExtension;
     BOOL top_level;
 
@@ -482,6 +546,11 @@ static NTSTATUS STDCALL drv_flush_buffers(IN PDEVICE_OBJECT DeviceObject, IN PIR
         Status = Irp->IoStatus.Status;
     }
     
+    if (NT_SUCCESS(Status)) {
+        Status = flush_metadata(Vcb, fcb, ccb ? ccb->fileref : NULL, Irp);
+        Irp->IoStatus.Status = Status;
+    }
+    
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
     
 exit:
@@ -493,7 +562,7 @@ exit:
     return Status;
 }
 
-static void calculate_total_space(device_extension* Vcb, LONGLONG* totalsize, LONGLONG* freespace) {
+void calculate_total_space(device_extension* Vcb, LONGLONG* totalsize, LONGLONG* freespace) {
     UINT16 nfactor, dfactor;
     UINT64 sectors_used;
     
@@ -890,6 +959,9 @@ NTSTATUS create_root(device_extension* Vcb, UINT64 id, root** rootptr, BOOL no_t
     RtlZeroMemory(&r->root_item, sizeof(ROOT_ITEM));
     r->root_item.num_references = 1;
     InitializeListHead(&r->fcbs);
+    r->fcbs_hash = NULL;
+    r->fcbs_hash_size = 0;
+    r->num_fcbs = 0;
     
     RtlCopyMemory(ri, &r->root_item, sizeof(ROOT_ITEM));
     
@@ -1467,25 +1539,17 @@ void send_notification_fcb(file_ref* fileref, ULONG filter_match, ULONG action)
         if (!NT_SUCCESS(Status)) {
             ERR("open_fileref_by_inode returned %08x\n", Status);
         } else if (!parfr->deleted) {
-            LIST_ENTRY* le2;
+            file_ref* fr2;
             BOOL found = FALSE, deleted = FALSE;
             UNICODE_STRING* fn;
             
-            le2 = parfr->children.Flink;
-            while (le2 != &parfr->children) {
-                file_ref* fr2 = CONTAINING_RECORD(le2, file_ref, list_entry);
-                
-                if (fr2->index == hl->index) {
-                    found = TRUE;
-                    deleted = fr2->deleted;
-                    
-                    if (!deleted)
-                        fn = &fr2->filepart;
-                    
-                    break;
-                }
+            fr2 = find_fileref_child_by_index(parfr, hl->index);
+            if (fr2) {
+                found = TRUE;
+                deleted = fr2->deleted;
                 
-                le2 = le2->Flink;
+                if (!deleted)
+                    fn = &fr2->filepart;
             }
             
             if (!found)
@@ -1554,6 +1618,9 @@ void mark_fcb_dirty(fcb* fcb) {
         dirt->fcb = fcb;
         
         ExInterlockedInsertTailList(&fcb->Vcb->dirty_fcbs, &dirt->list_entry, &fcb->Vcb->dirty_fcbs_lock);
+        
+        InterlockedIncrement(&fcb->Vcb->dirty_fcb_count);
+        check_dirty_limits(fcb->Vcb);
     }
     
     fcb->Vcb->need_write = TRUE;
@@ -1606,7 +1673,7 @@ void _free_fcb(fcb* fcb, const char* func, const char* file, unsigned int line)
 //     ExAcquireResourceExclusiveLite(&fcb->Vcb->fcb_lock, TRUE);
     
     if (fcb->list_entry.Flink)
-        RemoveEntryList(&fcb->list_entry);
+        remove_fcb_from_subvol(fcb->subvol, fcb);
     
     if (fcb->list_entry_all.Flink)
         RemoveEntryList(&fcb->list_entry_all);
@@ -1647,17 +1714,9 @@ void _free_fcb(fcb* fcb, const char* func, const char* file, unsigned int line)
         ExFreePool(ext);
     }
     
-    while (!IsListEmpty(&fcb->index_list)) {
-        LIST_ENTRY* le = RemoveHeadList(&fcb->index_list);
-        index_entry* ie = CONTAINING_RECORD(le, index_entry, list_entry);
-
-        if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-        if (ie->filepart_uc.Buffer) ExFreePool(ie->filepart_uc.Buffer);
-        ExFreePool(ie);
-    }
+    free_fcb_delalloc(fcb);
     
-    if (fcb->index_ptrs)
-        ExFreePool(fcb->index_ptrs);
+    free_dir_index(fcb);
     
     while (!IsListEmpty(&fcb->hardlinks)) {
         LIST_ENTRY* le = RemoveHeadList(&fcb->hardlinks);
@@ -1742,8 +1801,13 @@ void _free_fileref(file_ref* fr, const char* func, const char* file, unsigned in
     if (fr->fcb->fileref == fr)
         fr->fcb->fileref = NULL;
     
-    if (fr->list_entry.Flink)
-        RemoveEntryList(&fr->list_entry);
+    if (fr->parent && fr->list_entry.Flink)
+        remove_fileref_child(fr->parent, fr);
+    
+    if (fr->children_hash)
+        ExFreePool(fr->children_hash);
+    
+    free_negative_cache(fr);
     
     if (fr->parent) {
         ExReleaseResourceLite(&fr->parent->nonpaged->children_lock);
@@ -1827,6 +1891,13 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     
     RemoveEntryList(&Vcb->list_entry);
     
+    ExAcquireResourceExclusiveLite(&Vcb->fcb_lock, TRUE);
+    flush_path_cache(Vcb);
+    ExReleaseResourceLite(&Vcb->fcb_lock);
+    
+    // readahead jobs from directory queries take tree_lock, so they have to be gone before the trees are
+    ExWaitForRundownProtectionRelease(&Vcb->readahead_rundown);
+    
     Status = registry_mark_volume_unmounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status) && Status != STATUS_TOO_LATE)
         WARN("registry_mark_volume_unmounted returned %08x\n", Status);
@@ -1864,6 +1935,8 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     KeSetTimer(&Vcb->flush_thread_timer, time, NULL); // trigger the timer early
     KeWaitForSingleObject(&Vcb->flush_thread_finished, Executive, KernelMode, FALSE, NULL);
     
+    stop_discard_thread(Vcb);
+    
     free_fcb(Vcb->volume_fcb);
     
     if (Vcb->root_file)
@@ -1887,6 +1960,10 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
 
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
         ExFreePool(r->nonpaged);
+        
+        if (r->fcbs_hash)
+            ExFreePool(r->fcbs_hash);
+        
         ExFreePool(r);
     }
     
@@ -1903,6 +1980,8 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
             ExFreePool(s);
         }
         
+        free_space_bitmap(c);
+        
         while (!IsListEmpty(&c->deleting)) {
             LIST_ENTRY* le2 = RemoveHeadList(&c->deleting);
             s = CONTAINING_RECORD(le2, space, list_entry);
@@ -1910,6 +1989,13 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
             ExFreePool(s);
         }
         
+        while (!IsListEmpty(&c->freed)) {
+            LIST_ENTRY* le2 = RemoveHeadList(&c->freed);
+            s = CONTAINING_RECORD(le2, space, list_entry);
+            
+            ExFreePool(s);
+        }
+        
         if (c->devices)
             ExFreePool(c->devices);
         
@@ -1943,15 +2029,28 @@ void STDCALL uninit(device_extension* Vcb, BOOL flush) {
     
     ExFreePool(Vcb->devices);
     
+    while (!IsListEmpty(&Vcb->chunk_gaps)) {
+        LIST_ENTRY* le = RemoveHeadList(&Vcb->chunk_gaps);
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+        
+        ExFreePool(s);
+    }
+    
+    if (Vcb->attr_cache)
+        ExFreePool(Vcb->attr_cache);
+    
     ExDeleteResourceLite(&Vcb->fcb_lock);
+    ExDeleteResourceLite(&Vcb->attr_cache_lock);
+    ExDeleteResourceLite(&Vcb->path_cache_lock);
     ExDeleteResourceLite(&Vcb->load_lock);
     ExDeleteResourceLite(&Vcb->tree_lock);
+    ExDeleteResourceLite(&Vcb->trees_list_lock);
     ExDeleteResourceLite(&Vcb->checksum_lock);
     ExDeleteResourceLite(&Vcb->chunk_lock);
     
     ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
     ExDeletePagedLookasideList(&Vcb->traverse_ptr_lookaside);
-    ExDeletePagedLookasideList(&Vcb->rollback_item_lookaside);
+    ExDeletePagedLookasideList(&Vcb->rollback_block_lookaside);
     ExDeletePagedLookasideList(&Vcb->batch_item_lookaside);
     ExDeleteNPagedLookasideList(&Vcb->range_lock_lookaside);
     
@@ -2506,6 +2605,9 @@ static NTSTATUS STDCALL add_root(device_extension* Vcb, UINT64 id, UINT64 addr,
     r->treeholder.address = addr;
     r->treeholder.tree = NULL;
     InitializeListHead(&r->fcbs);
+    r->fcbs_hash = NULL;
+    r->fcbs_hash_size = 0;
+    r->num_fcbs = 0;
 
     r->nonpaged = ExAllocatePoolWithTag(NonPagedPool, sizeof(root_nonpaged), ALLOC_TAG);
     if (!r->nonpaged) {
@@ -2691,6 +2793,7 @@ static NTSTATUS find_disk_holes(device_extension* Vcb, device* dev, PIRP Irp) {
     NTSTATUS Status;
     
     InitializeListHead(&dev->space);
+    InitializeListHead(&dev->space_size);
     
     searchkey.obj_id = dev->devitem.dev_id;
     searchkey.obj_type = TYPE_DEV_EXTENT;
@@ -2710,7 +2813,7 @@ static NTSTATUS find_disk_holes(device_extension* Vcb, device* dev, PIRP Irp) {
                 DEV_EXTENT* de = (DEV_EXTENT*)tp.item->data;
                 
                 if (tp.item->key.offset > lastaddr) {
-                    Status = add_space_entry(&dev->space, NULL, lastaddr, tp.item->key.offset - lastaddr);
+                    Status = add_space_entry(&dev->space, &dev->space_size, lastaddr, tp.item->key.offset - lastaddr);
                     if (!NT_SUCCESS(Status)) {
                         ERR("add_space_entry returned %08x\n", Status);
                         return Status;
@@ -2733,7 +2836,7 @@ static NTSTATUS find_disk_holes(device_extension* Vcb, device* dev, PIRP Irp) {
     } while (b);
     
     if (lastaddr < dev->devitem.num_bytes) {
-        Status = add_space_entry(&dev->space, NULL, lastaddr, dev->devitem.num_bytes - lastaddr);
+        Status = add_space_entry(&dev->space, &dev->space_size, lastaddr, dev->devitem.num_bytes - lastaddr);
         if (!NT_SUCCESS(Status)) {
             ERR("add_space_entry returned %08x\n", Status);
             return Status;
@@ -2742,7 +2845,42 @@ static NTSTATUS find_disk_holes(device_extension* Vcb, device* dev, PIRP Irp) {
     
     // The Linux driver doesn't like to allocate chunks within the first megabyte of a device.
     
-    space_list_subtract2(Vcb, &dev->space, NULL, 0, 0x100000, NULL);
+    space_list_subtract2(Vcb, &dev->space, &dev->space_size, 0, 0x100000, NULL);
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS find_chunk_gaps(device_extension* Vcb) {
+    UINT64 lastaddr = 0;
+    LIST_ENTRY* le;
+    NTSTATUS Status;
+    
+    InitializeListHead(&Vcb->chunk_gaps);
+    
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+        
+        if (c->offset > lastaddr) {
+            Status = add_space_entry(&Vcb->chunk_gaps, NULL, lastaddr, c->offset - lastaddr);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_space_entry returned %08x\n", Status);
+                return Status;
+            }
+        }
+        
+        lastaddr = c->offset + c->chunk_item->size;
+        
+        le = le->Flink;
+    }
+    
+    // everything after the last chunk is free too
+    
+    Status = add_space_entry(&Vcb->chunk_gaps, NULL, lastaddr, 0xffffffffffffffff - lastaddr);
+    if (!NT_SUCCESS(Status)) {
+        ERR("add_space_entry returned %08x\n", Status);
+        return Status;
+    }
     
     return STATUS_SUCCESS;
 }
@@ -3069,8 +3207,11 @@ static NTSTATUS STDCALL load_chunk_root(device_extension* Vcb, PIRP Irp) {
                 
                 InitializeListHead(&c->space);
                 InitializeListHead(&c->space_size);
+                c->space_bitmap_buf = NULL;
                 InitializeListHead(&c->deleting);
+                InitializeListHead(&c->freed);
                 InitializeListHead(&c->changed_extents);
+                c->discarding = 0;
                 
                 InitializeListHead(&c->range_locks);
                 KeInitializeSpinLock(&c->range_locks_spinlock);
@@ -3568,10 +3709,14 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     Vcb->type = VCB_TYPE_VOLUME;
     
     ExInitializeResourceLite(&Vcb->tree_lock);
+    ExInitializeResourceLite(&Vcb->trees_list_lock);
     Vcb->open_trees = 0;
     Vcb->need_write = FALSE;
 
     ExInitializeResourceLite(&Vcb->fcb_lock);
+    ExInitializeResourceLite(&Vcb->attr_cache_lock);
+    ExInitializeResourceLite(&Vcb->path_cache_lock);
+    ExInitializeRundownProtection(&Vcb->readahead_rundown);
     ExInitializeResourceLite(&Vcb->DirResource);
     ExInitializeResourceLite(&Vcb->checksum_lock);
     ExInitializeResourceLite(&Vcb->chunk_lock);
@@ -3722,6 +3867,7 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     InitializeListHead(&Vcb->sector_checksums);
     
     KeInitializeSpinLock(&Vcb->dirty_fcbs_lock);
+    KeInitializeSpinLock(&Vcb->commit_stats_lock);
     KeInitializeSpinLock(&Vcb->dirty_filerefs_lock);
     
     InitializeListHead(&Vcb->DirNotifyList);
@@ -3730,7 +3876,7 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     
     ExInitializePagedLookasideList(&Vcb->tree_data_lookaside, NULL, NULL, 0, sizeof(tree_data), ALLOC_TAG, 0);
     ExInitializePagedLookasideList(&Vcb->traverse_ptr_lookaside, NULL, NULL, 0, sizeof(traverse_ptr), ALLOC_TAG, 0);
-    ExInitializePagedLookasideList(&Vcb->rollback_item_lookaside, NULL, NULL, 0, sizeof(rollback_item), ALLOC_TAG, 0);
+    ExInitializePagedLookasideList(&Vcb->rollback_block_lookaside, NULL, NULL, 0, sizeof(rollback_block), ALLOC_TAG, 0);
     ExInitializePagedLookasideList(&Vcb->batch_item_lookaside, NULL, NULL, 0, sizeof(batch_item), ALLOC_TAG, 0);
     ExInitializeNPagedLookasideList(&Vcb->range_lock_lookaside, NULL, NULL, 0, sizeof(range_lock), ALLOC_TAG, 0);
     init_lookaside = TRUE;
@@ -3885,7 +4031,7 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     }
     
     Vcb->root_fileref->fcb = root_fcb;
-    InsertTailList(&root_fcb->subvol->fcbs, &root_fcb->list_entry);
+    add_fcb_to_subvol(root_fcb);
     InsertTailList(&Vcb->all_fcbs, &root_fcb->list_entry_all);
     
     root_fcb->fileref = Vcb->root_fileref;
@@ -3923,6 +4069,12 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         }
     }
     
+    Status = find_chunk_gaps(Vcb);
+    if (!NT_SUCCESS(Status)) {
+        ERR("find_chunk_gaps returned %08x\n", Status);
+        goto exit;
+    }
+    
 //     root_test(Vcb);
     
     KeInitializeSpinLock(&Vcb->FcbListLock);
@@ -3936,6 +4088,7 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     NewDeviceObject->Vpb->ReferenceCount++; // FIXME - should we deref this at any point?
     Vcb->Vpb = NewDeviceObject->Vpb;
     
+    KeInitializeEvent(&Vcb->flush_thread_wake, SynchronizationEvent, FALSE);
     KeInitializeEvent(&Vcb->flush_thread_finished, NotificationEvent, FALSE);
     
     Status = PsCreateSystemThread(&Vcb->flush_thread_handle, 0, NULL, NULL, NULL, flush_thread, NewDeviceObject);
@@ -3950,6 +4103,8 @@ static NTSTATUS STDCALL mount_vol(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         goto exit;
     }
     
+    start_discard_thread(Vcb);
+    
     Status = registry_mark_volume_mounted(&Vcb->superblock.uuid);
     if (!NT_SUCCESS(Status))
         WARN("registry_mark_volume_mounted returned %08x\n", Status);
@@ -3966,7 +4121,7 @@ exit:
             if (init_lookaside) {
                 ExDeletePagedLookasideList(&Vcb->tree_data_lookaside);
                 ExDeletePagedLookasideList(&Vcb->traverse_ptr_lookaside);
-                ExDeletePagedLookasideList(&Vcb->rollback_item_lookaside);
+                ExDeletePagedLookasideList(&Vcb->rollback_block_lookaside);
                 ExDeletePagedLookasideList(&Vcb->batch_item_lookaside);
                 ExDeleteNPagedLookasideList(&Vcb->range_lock_lookaside);
             }
@@ -3982,8 +4137,11 @@ exit:
                 free_fcb(Vcb->volume_fcb);
 
             ExDeleteResourceLite(&Vcb->tree_lock);
+            ExDeleteResourceLite(&Vcb->trees_list_lock);
             ExDeleteResourceLite(&Vcb->load_lock);
             ExDeleteResourceLite(&Vcb->fcb_lock);
+            ExDeleteResourceLite(&Vcb->attr_cache_lock);
+            ExDeleteResourceLite(&Vcb->path_cache_lock);
             ExDeleteResourceLite(&Vcb->DirResource);
             ExDeleteResourceLite(&Vcb->checksum_lock);
             ExDeleteResourceLite(&Vcb->chunk_lock);
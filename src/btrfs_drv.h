@@ -36,6 +36,7 @@
 #include <stddef.h>
 #include <emmintrin.h>
 #include "btrfs.h"
+#include "btrfsioctl.h"
 
 #ifdef _DEBUG
 // #define DEBUG_FCB_REFCOUNTS
@@ -73,6 +74,12 @@
 
 #define READ_AHEAD_GRANULARITY COMPRESSED_EXTENT_SIZE // really ought to be a multiple of COMPRESSED_EXTENT_SIZE
 
+#define DELALLOC_FCB_LIMIT 0x2000000 // 32 MB
+#define DELALLOC_VCB_LIMIT 0x8000000 // 128 MB
+#define DELALLOC_SPACE_MARGIN 0x1000000 // 16 MB - free space kept back from queued data, for metadata
+
+#define IDLE_TREE_CACHE_LIMIT 8192 // loaded trees kept when the flush thread has nothing to write
+
 #define IO_REPARSE_TAG_LXSS_SYMLINK 0xa000001d // undocumented?
 
 #ifdef _MSC_VER
@@ -122,6 +129,15 @@ typedef struct {
     LIST_ENTRY list_entry;
 } extent;
 
+typedef struct {
+    UINT64 start;
+    UINT64 length;
+    ULONG alloc;
+    UINT8* data;
+    
+    LIST_ENTRY list_entry;
+} delalloc_range;
+
 typedef struct {
     UINT32 hash;
     KEY key;
@@ -129,10 +145,13 @@ typedef struct {
     UINT64 index;
     ANSI_STRING utf8;
     UNICODE_STRING filepart_uc;
-
-    LIST_ENTRY list_entry;
 } index_entry;
 
+typedef struct {
+    UINT32 hash;
+    index_entry* ie;
+} index_slot;
+
 typedef struct {
     UINT64 parent;
     UINT64 index;
@@ -160,6 +179,10 @@ typedef struct _fcb {
     SHARE_ACCESS share_access;
     WCHAR* debug_desc;
     LIST_ENTRY extents;
+    LIST_ENTRY delalloc;
+    UINT64 delalloc_size;
+    NTSTATUS delalloc_status;
+    UINT64 alloc_hint;
     UINT64 last_dir_index;
     ANSI_STRING reparse_xattr;
     ANSI_STRING ea_xattr;
@@ -169,8 +192,11 @@ typedef struct _fcb {
     BOOL inode_item_changed;
     
     BOOL index_loaded;
-    LIST_ENTRY** index_ptrs;
-    LIST_ENTRY index_list;
+    index_slot* index_hash;
+    ULONG index_hash_size;
+    ULONG index_hash_count;
+    UINT64 index_next;
+    LIST_ENTRY index_arena;
     
     BOOL dirty;
     BOOL sd_dirty;
@@ -187,6 +213,7 @@ typedef struct _fcb {
     ANSI_STRING adsdata;
     
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
     LIST_ENTRY list_entry_all;
 } fcb;
 
@@ -199,6 +226,12 @@ typedef struct {
     ERESOURCE children_lock;
 } file_ref_nonpaged;
 
+// a name recently looked up in a directory and not found
+typedef struct {
+    UINT32 hash;
+    UNICODE_STRING name_uc;
+} negative_entry;
+
 typedef struct _file_ref {
     fcb* fcb;
     UNICODE_STRING filepart;
@@ -211,6 +244,13 @@ typedef struct _file_ref {
     BOOL created;
     file_ref_nonpaged* nonpaged;
     LIST_ENTRY children;
+    LIST_ENTRY* children_hash; // children_hash_size buckets by name hash, followed by children_hash_size by index
+    ULONG children_hash_size;
+    ULONG num_children;
+    UINT32 hash;
+    negative_entry* negative_cache; // ring of recent misses, protected by children_lock
+    ULONG negative_cache_next;
+    ULONG children_gen;
     LONG refcount;
     LONG open_count;
     struct _file_ref* parent;
@@ -219,6 +259,8 @@ typedef struct _file_ref {
     BOOL dirty;
     
     LIST_ENTRY list_entry;
+    LIST_ENTRY list_entry_hash;
+    LIST_ENTRY list_entry_index;
 } file_ref;
 
 typedef struct {
@@ -232,6 +274,10 @@ typedef struct _ccb {
     ULONG disposition;
     ULONG options;
     UINT64 query_dir_offset;
+    struct _file_ref* query_dir_child; // first open child at or after query_dir_child_offset, while children_gen is unchanged
+    UINT64 query_dir_child_offset;
+    ULONG query_dir_children_gen;
+    BOOL query_dir_child_valid;
 //     char* query_string;
     UNICODE_STRING query_string;
     BOOL has_wildcard;
@@ -330,6 +376,9 @@ typedef struct _root {
     ROOT_ITEM root_item;
     UNICODE_STRING path;
     LIST_ENTRY fcbs;
+    LIST_ENTRY* fcbs_hash; // fcbs_hash_size buckets, keyed by inode
+    ULONG fcbs_hash_size;
+    ULONG num_fcbs;
     LIST_ENTRY list_entry;
 } root;
 
@@ -388,6 +437,7 @@ typedef struct {
     ULONG change_count;
     UINT64 length;
     LIST_ENTRY space;
+    LIST_ENTRY space_size;
 } device;
 
 typedef struct {
@@ -407,7 +457,10 @@ typedef struct {
     fcb* cache;
     LIST_ENTRY space;
     LIST_ENTRY space_size;
+    RTL_BITMAP space_bitmap;
+    ULONG* space_bitmap_buf;
     LIST_ENTRY deleting;
+    LIST_ENTRY freed;
     LIST_ENTRY changed_extents;
     LIST_ENTRY range_locks;
     KSPIN_LOCK range_locks_spinlock;
@@ -417,6 +470,7 @@ typedef struct {
     BOOL created;
     BOOL readonly;
     BOOL reloc;
+    ULONG discarding;
     
     LIST_ENTRY list_entry;
     LIST_ENTRY list_entry_changed;
@@ -457,6 +511,7 @@ typedef struct {
 typedef struct {
     UINT8* data;
     UINT32* csum;
+    UINT8** trees;
     UINT32 sectors;
     LONG pos, done;
     KEVENT event;
@@ -491,6 +546,8 @@ typedef struct {
     UINT64 subvol_id;
     UINT32 raid5_recalculation;
     UINT32 raid6_recalculation;
+    BOOL no_trim;
+    BOOL trim_on_mount;
 } mount_options;
 
 #define VCB_TYPE_VOLUME     1
@@ -510,6 +567,11 @@ typedef struct {
     UINT64 overwrite_total_time;
     UINT64 num_creates;
     UINT64 create_total_time;
+    
+    UINT64 num_fcb_flushes;
+    UINT64 fcbs_flushed;
+    UINT64 fcb_flush_jobs;
+    UINT64 fcb_flush_time;
 } debug_stats;
 #endif
 
@@ -517,6 +579,35 @@ typedef struct {
     HANDLE thread;
 } balance_info;
 
+typedef struct {
+    HANDLE thread;
+    KEVENT event;
+    KEVENT finished;
+    ERESOURCE lock;
+    LIST_ENTRY queue;
+    BOOL quit;
+} discard_info;
+
+// What a directory listing needs to know about an inode that isn't open. inode is 0 for an empty slot.
+typedef struct {
+    UINT64 subvol;
+    UINT64 inode;
+    INODE_ITEM inode_item;
+    BOOL has_dosattrib;
+    ULONG dosattrib;
+    ULONG ealen;
+} attr_cache_entry;
+
+// an absolute path which open_fileref has resolved, holding a reference to the result
+typedef struct {
+    UNICODE_STRING path;
+    ULONG hash;
+    BOOL case_sensitive;
+    BOOL parent;
+    ULONG fn_offset;
+    struct _file_ref* fileref;
+} path_cache_entry;
+
 typedef struct _device_extension {
     UINT32 type;
     mount_options options;
@@ -547,6 +638,8 @@ typedef struct _device_extension {
     LIST_ENTRY DirNotifyList;
     LONG open_trees;
     BOOL need_write;
+    BOOL commit_writing;
+    BOOL commit_failed;
 //     ERESOURCE LogToPhysLock;
 //     UINT64 chunk_root_phys_addr;
     UINT64 root_tree_phys_addr;
@@ -565,7 +658,9 @@ typedef struct _device_extension {
     LIST_ENTRY sys_chunks;
     LIST_ENTRY chunks;
     LIST_ENTRY chunks_changed;
+    LIST_ENTRY chunk_gaps;
     LIST_ENTRY trees;
+    ERESOURCE trees_list_lock;
     LIST_ENTRY all_fcbs;
     LIST_ENTRY dirty_fcbs;
     KSPIN_LOCK dirty_fcbs_lock;
@@ -574,15 +669,30 @@ typedef struct _device_extension {
     ERESOURCE checksum_lock;
     ERESOURCE chunk_lock;
     LIST_ENTRY sector_checksums;
+    LONGLONG delalloc_size;
+    LONG dirty_fcb_count;
+    LONG dirty_tree_count;
+    LONG dirty_csum_count;
     HANDLE flush_thread_handle;
     KTIMER flush_thread_timer;
+    KEVENT flush_thread_wake;
     KEVENT flush_thread_finished;
+    btrfs_commit_stats commit_stats;
+    KSPIN_LOCK commit_stats_lock;
+    btrfs_lookup_stats lookup_stats;
+    attr_cache_entry* attr_cache;
+    ERESOURCE attr_cache_lock;
+    path_cache_entry* path_cache;
+    ERESOURCE path_cache_lock;
+    EX_RUNDOWN_REF readahead_rundown;
+    LONG readahead_jobs;
     drv_calc_threads calcthreads;
     balance_info balance;
+    discard_info discard;
     PFILE_OBJECT root_file;
     PAGED_LOOKASIDE_LIST tree_data_lookaside;
     PAGED_LOOKASIDE_LIST traverse_ptr_lookaside;
-    PAGED_LOOKASIDE_LIST rollback_item_lookaside;
+    PAGED_LOOKASIDE_LIST rollback_block_lookaside;
     PAGED_LOOKASIDE_LIST batch_item_lookaside;
     NPAGED_LOOKASIDE_LIST range_lock_lookaside;
     LIST_ENTRY list_entry;
@@ -723,6 +833,7 @@ static UINT64 __inline make_file_id(root* r, UINT64 inode) {
 // in btrfs.c
 device* find_device_from_uuid(device_extension* Vcb, BTRFS_UUID* uuid);
 UINT64 sector_align( UINT64 NumberToBeAligned, UINT64 Alignment );
+void calculate_total_space(device_extension* Vcb, LONGLONG* totalsize, LONGLONG* freespace);
 BOOL get_file_attributes_from_xattr(char* val, UINT16 len, ULONG* atts);
 ULONG STDCALL get_file_attributes(device_extension* Vcb, INODE_ITEM* ii, root* r, UINT64 inode, UINT8 type, BOOL dotfile, BOOL ignore_xa, PIRP Irp);
 BOOL extract_xattr(void* item, USHORT size, char* name, UINT8** data, UINT16* datalen);
@@ -770,6 +881,8 @@ extern UINT32 mount_flush_interval;
 extern UINT32 mount_max_inline;
 extern UINT32 mount_raid5_recalculation;
 extern UINT32 mount_raid6_recalculation;
+extern UINT32 mount_no_trim;
+extern UINT32 mount_trim_on_mount;
 
 #ifdef _DEBUG
 
@@ -840,15 +953,29 @@ enum rollback_type {
     ROLLBACK_INSERT_EXTENT,
     ROLLBACK_DELETE_EXTENT,
     ROLLBACK_ADD_SPACE,
-    ROLLBACK_SUBTRACT_SPACE
+    ROLLBACK_SUBTRACT_SPACE,
+    ROLLBACK_NONE
 };
 
 typedef struct {
     enum rollback_type type;
-    void* ptr;
-    LIST_ENTRY list_entry;
+    
+    union {
+        traverse_ptr tp;
+        rollback_extent re;
+        rollback_space rs;
+    };
 } rollback_item;
 
+#define ROLLBACK_BLOCK_ITEMS 256
+
+// The rollback list is a chain of these, which add_rollback appends to.
+typedef struct {
+    LIST_ENTRY list_entry;
+    ULONG count;
+    rollback_item items[ROLLBACK_BLOCK_ITEMS];
+} rollback_block;
+
 // in treefuncs.c
 NTSTATUS STDCALL _find_item(device_extension* Vcb, root* r, traverse_ptr* tp, const KEY* searchkey, BOOL ignore, PIRP Irp, const char* func, const char* file, unsigned int line);
 NTSTATUS STDCALL _find_item_to_level(device_extension* Vcb, root* r, traverse_ptr* tp, const KEY* searchkey, BOOL ignore, UINT8 level,
@@ -856,6 +983,7 @@ NTSTATUS STDCALL _find_item_to_level(device_extension* Vcb, root* r, traverse_pt
 BOOL STDCALL _find_next_item(device_extension* Vcb, const traverse_ptr* tp, traverse_ptr* next_tp, BOOL ignore, PIRP Irp, const char* func, const char* file, unsigned int line);
 BOOL STDCALL _find_prev_item(device_extension* Vcb, const traverse_ptr* tp, traverse_ptr* prev_tp, BOOL ignore, PIRP Irp, const char* func, const char* file, unsigned int line);
 void STDCALL free_trees(device_extension* Vcb);
+void free_clean_trees(device_extension* Vcb);
 BOOL STDCALL insert_tree_item(device_extension* Vcb, root* r, UINT64 obj_id, UINT8 obj_type, UINT64 offset, void* data, UINT32 size, traverse_ptr* ptp, PIRP Irp, LIST_ENTRY* rollback);
 void STDCALL delete_tree_item(device_extension* Vcb, traverse_ptr* tp, LIST_ENTRY* rollback);
 tree* STDCALL _free_tree(tree* t, const char* func, const char* file, unsigned int line);
@@ -906,10 +1034,14 @@ NTSTATUS do_write_file(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data,
 NTSTATUS write_compressed(fcb* fcb, UINT64 start_data, UINT64 end_data, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback);
 BOOL find_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address);
 void get_raid56_lock_range(chunk* c, UINT64 address, UINT64 length, UINT64* lockaddr, UINT64* locklen);
+NTSTATUS flush_fcb_delalloc(fcb* fcb, PIRP Irp, LIST_ENTRY* rollback);
+void free_fcb_delalloc(fcb* fcb);
+void read_delalloc(fcb* fcb, UINT8* data, UINT64 start, UINT64 length);
 
 // in dirctrl.c
 NTSTATUS STDCALL drv_directory_control(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
 ULONG STDCALL get_reparse_tag(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type, ULONG atts, PIRP Irp);
+void invalidate_attr_cache(device_extension* Vcb, root* subvol, UINT64 inode);
 
 // in security.c
 NTSTATUS STDCALL drv_query_security(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
@@ -946,6 +1078,15 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
 NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type, PANSI_STRING utf8, fcb* parent, fcb** pfcb, POOL_TYPE pooltype, PIRP Irp);
 NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI_STRING* xattr, UINT32 streamhash, fcb* parent, fcb** pfcb, PIRP Irp);
 void insert_fileref_child(file_ref* parent, file_ref* child, BOOL do_lock);
+void remove_fileref_child(file_ref* parent, file_ref* child);
+void free_negative_cache(file_ref* fr);
+void flush_path_cache(device_extension* Vcb);
+void remove_path_cache_fileref(device_extension* Vcb, file_ref* fr);
+file_ref* find_fileref_child_by_index(file_ref* parent, UINT64 index);
+void add_fcb_to_subvol(fcb* fcb);
+void remove_fcb_from_subvol(root* r, fcb* fcb);
+fcb* find_fcb_in_subvol(root* r, UINT64 inode, PANSI_STRING xattr);
+void free_dir_index(fcb* fcb);
 NTSTATUS fcb_get_last_dir_index(fcb* fcb, UINT64* index, PIRP Irp);
 NTSTATUS verify_vcb(device_extension* Vcb, PIRP Irp);
 
@@ -956,11 +1097,14 @@ void do_unlock_volume(device_extension* Vcb);
 // in flushthread.c
 void STDCALL flush_thread(void* context);
 NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback);
+NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback, BOOL pipelined);
 NTSTATUS get_tree_new_address(device_extension* Vcb, tree* t, PIRP Irp, LIST_ENTRY* rollback);
 void flush_fcb(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback);
 NTSTATUS STDCALL write_data_phys(PDEVICE_OBJECT device, UINT64 address, void* data, UINT32 length);
 BOOL is_tree_unique(device_extension* Vcb, tree* t, PIRP Irp);
 NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, PIRP Irp);
+void check_dirty_limits(device_extension* Vcb);
+void throttle_writes(device_extension* Vcb);
 
 // in read.c
 NTSTATUS STDCALL drv_read(PDEVICE_OBJECT DeviceObject, PIRP Irp);
@@ -982,6 +1126,9 @@ void _space_list_add(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 addr
 void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
 void _space_list_subtract(device_extension* Vcb, chunk* c, BOOL deleting, UINT64 address, UINT64 length, LIST_ENTRY* rollback, const char* func);
 void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func);
+void free_space_bitmap(chunk* c);
+BOOL find_space_bitmap_run(device_extension* Vcb, chunk* c, UINT64 start, UINT64* address, UINT64* length);
+BOOL find_space_bitmap_address(device_extension* Vcb, chunk* c, UINT64 length, UINT64 hint, UINT64* address);
 
 #define space_list_add(Vcb, c, deleting, address, length, rollback) _space_list_add(Vcb, c, deleting, address, length, rollback, funcname)
 #define space_list_add2(Vcb, list, list_size, address, length, rollback) _space_list_add2(Vcb, list, list_size, address, length, NULL, rollback, funcname)
@@ -1034,11 +1181,17 @@ NTSTATUS STDCALL drv_device_control(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 // in calcthread.c
 void calc_thread(void* context);
 NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj);
+NTSTATUS add_calc_tree_job(device_extension* Vcb, UINT8** trees, UINT32 num_trees, calc_job** pcj);
 void free_calc_job(calc_job* cj);
 
 // in balance.c
 NTSTATUS start_balance(device_extension* Vcb);
 
+// in discard.c
+void start_discard_thread(device_extension* Vcb);
+void stop_discard_thread(device_extension* Vcb);
+void queue_discard(device_extension* Vcb, LIST_ENTRY* list);
+
 #define fast_io_possible(fcb) (!FsRtlAreThereCurrentFileLocks(&fcb->lock) && !fcb->Vcb->readonly ? FastIoIsPossible : FastIoIsQuestionable)
 
 static __inline void print_open_trees(device_extension* Vcb) {
@@ -11,6 +11,8 @@
 #define FSCTL_BTRFS_GET_DEVICES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82e, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_GET_USAGE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82f, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSCTL_BTRFS_START_BALANCE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x830, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_COMMIT_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x831, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSCTL_BTRFS_GET_LOOKUP_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x832, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 
 typedef struct {
     UINT64 subvol;
@@ -71,4 +73,52 @@ typedef struct {
     btrfs_usage_device devices[1];
 } btrfs_usage;
 
+#define BTRFS_COMMIT_PHASE_FILEREFS     0
+#define BTRFS_COMMIT_PHASE_FCBS         1
+#define BTRFS_COMMIT_PHASE_BATCH        2
+#define BTRFS_COMMIT_PHASE_CHECKSUMS    3
+#define BTRFS_COMMIT_PHASE_EXTENTS      4
+#define BTRFS_COMMIT_PHASE_CHUNKS       5
+#define BTRFS_COMMIT_PHASE_ROOTS        6
+#define BTRFS_COMMIT_PHASE_TREES        7
+#define BTRFS_COMMIT_PHASE_SUPERBLOCKS  8
+#define BTRFS_COMMIT_PHASES             9
+
+#define BTRFS_COMMIT_HISTOGRAM_BUCKETS 24
+
+// Times are in microseconds. histogram[0] counts times under 1us, histogram[i] times
+// of at least 2^(i-1)us and under 2^i us, and the last bucket everything above that.
+typedef struct {
+    UINT64 count;
+    UINT64 total_time;
+    UINT64 max_time;
+    UINT64 histogram[BTRFS_COMMIT_HISTOGRAM_BUCKETS];
+} btrfs_commit_time;
+
+typedef struct {
+    UINT64 num_commits;
+    UINT64 failed_commits;
+    UINT64 filerefs_flushed;
+    UINT64 fcbs_flushed;
+    UINT64 trees_written;
+    btrfs_commit_time commit;
+    btrfs_commit_time phases[BTRFS_COMMIT_PHASES];
+} btrfs_commit_stats;
+
+// The hit rate of the negative lookup cache is negative_hits / (negative_hits + negative_misses),
+// and that of the path cache path_hits / (path_hits + path_misses). readahead_skipped counts directory
+// queries which didn't read ahead because too many jobs were outstanding or the tree cache was full.
+typedef struct {
+    UINT64 negative_hits;
+    UINT64 negative_misses;
+    UINT64 negative_added;
+    UINT64 negative_invalidated;
+    UINT64 path_hits;
+    UINT64 path_misses;
+    UINT64 path_flushes;
+    UINT64 readahead_jobs;
+    UINT64 readahead_inodes;
+    UINT64 readahead_skipped;
+} btrfs_lookup_stats;
+
 #endif
@@ -19,7 +19,7 @@
 
 #define SECTOR_BLOCK 16
 
-NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj) {
+static NTSTATUS queue_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, UINT8** trees, calc_job** pcj) {
     calc_job* cj;
     KIRQL irql;
     
@@ -32,6 +32,7 @@ NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32
     cj->data = data;
     cj->sectors = sectors;
     cj->csum = csum;
+    cj->trees = trees;
     cj->pos = 0;
     cj->done = 0;
     cj->refcount = 1;
@@ -49,6 +50,15 @@ NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32
     return STATUS_SUCCESS;
 }
 
+NTSTATUS add_calc_job(device_extension* Vcb, UINT8* data, UINT32 sectors, UINT32* csum, calc_job** pcj) {
+    return queue_calc_job(Vcb, data, sectors, csum, NULL, pcj);
+}
+
+// Checksums whole tree nodes in place, rather than sectors of data.
+NTSTATUS add_calc_tree_job(device_extension* Vcb, UINT8** trees, UINT32 num_trees, calc_job** pcj) {
+    return queue_calc_job(Vcb, NULL, num_trees, NULL, trees, pcj);
+}
+
 void free_calc_job(calc_job* cj) {
     LONG rc = InterlockedDecrement(&cj->refcount);
     
@@ -66,15 +76,24 @@ static BOOL do_calc(device_extension* Vcb, calc_job* cj) {
     
     if (pos * SECTOR_BLOCK >= cj->sectors)
         return FALSE;
-
-    csum = &cj->csum[pos * SECTOR_BLOCK];
-    data = cj->data + (pos * SECTOR_BLOCK * Vcb->superblock.sector_size);
     
     blocksize = min(SECTOR_BLOCK, cj->sectors - (pos * SECTOR_BLOCK));
-    for (i = 0; i < blocksize; i++) {
-        *csum = ~calc_crc32c(0xffffffff, data, Vcb->superblock.sector_size);
-        csum++;
-        data += Vcb->superblock.sector_size;
+    
+    if (cj->trees) {
+        for (i = 0; i < blocksize; i++) {
+            tree_header* th = (tree_header*)cj->trees[(pos * SECTOR_BLOCK) + i];
+            
+            *((UINT32*)th) = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
+        }
+    } else {
+        csum = &cj->csum[pos * SECTOR_BLOCK];
+        data = cj->data + (pos * SECTOR_BLOCK * Vcb->superblock.sector_size);
+        
+        for (i = 0; i < blocksize; i++) {
+            *csum = ~calc_crc32c(0xffffffff, data, Vcb->superblock.sector_size);
+            csum++;
+            data += Vcb->superblock.sector_size;
+        }
     }
     
     done = InterlockedIncrement(&cj->done);
@@ -23,6 +23,30 @@ extern PDEVICE_OBJECT devobj;
 
 static WCHAR datastring[] = L"::$DATA";
 
+// starting size of a directory's index hash table - must be a power of two
+#define INDEX_HASH_INITIAL_SIZE 256
+
+// Arena blocks start off sized for the directory, and double each time one fills up, between these limits.
+#define INDEX_ARENA_MIN_BLOCK_SIZE 0x400
+#define INDEX_ARENA_MAX_BLOCK_SIZE 0x10000
+
+#define CHILDREN_HASH_INITIAL_SIZE 16
+
+#define FCBS_HASH_INITIAL_SIZE 64
+
+#define NEGATIVE_CACHE_ENTRIES 16
+
+// must be a power of two
+#define PATH_CACHE_ENTRIES 256
+
+// A directory's index entries and their names are carved out of these, and freed all at once.
+typedef struct {
+    LIST_ENTRY list_entry;
+    ULONG used;
+    ULONG size;
+    UINT64 data[1];
+} index_arena_block;
+
 static NTSTATUS find_file_dir_index(device_extension* Vcb, root* r, UINT64 inode, UINT64 parinode, PANSI_STRING utf8, UINT64* pindex, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp;
@@ -179,15 +203,133 @@ static NTSTATUS find_subvol_dir_index(device_extension* Vcb, root* r, UINT64 sub
         return STATUS_NOT_FOUND;
 }
 
-static NTSTATUS load_index_list(fcb* fcb, PIRP Irp) {
+// Adds ie to the directory's open-addressed hash table, which is keyed on the
+// CRC32C of the upcased name. The table is doubled when it gets three-quarters
+// full, so loading is linear in the number of entries.
+static NTSTATUS add_to_index_hash(fcb* fcb, index_entry* ie) {
+    ULONG i, mask;
+    
+    if (!fcb->index_hash || (fcb->index_hash_count + 1) * 4 > fcb->index_hash_size * 3) {
+        ULONG newsize = fcb->index_hash ? (fcb->index_hash_size * 2) : INDEX_HASH_INITIAL_SIZE;
+        index_slot* newhash;
+        
+        newhash = ExAllocatePoolWithTag(PagedPool, sizeof(index_slot) * newsize, ALLOC_TAG);
+        if (!newhash) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        RtlZeroMemory(newhash, sizeof(index_slot) * newsize);
+        
+        if (fcb->index_hash) {
+            for (i = 0; i < fcb->index_hash_size; i++) {
+                if (fcb->index_hash[i].ie) {
+                    ULONG j = fcb->index_hash[i].hash & (newsize - 1);
+                    
+                    while (newhash[j].ie) {
+                        j = (j + 1) & (newsize - 1);
+                    }
+                    
+                    newhash[j] = fcb->index_hash[i];
+                }
+            }
+            
+            ExFreePool(fcb->index_hash);
+        }
+        
+        fcb->index_hash = newhash;
+        fcb->index_hash_size = newsize;
+    }
+    
+    mask = fcb->index_hash_size - 1;
+    i = ie->hash & mask;
+    
+    while (fcb->index_hash[i].ie) {
+        i = (i + 1) & mask;
+    }
+    
+    fcb->index_hash[i].hash = ie->hash;
+    fcb->index_hash[i].ie = ie;
+    fcb->index_hash_count++;
+    
+    return STATUS_SUCCESS;
+}
+
+static void* index_arena_alloc(fcb* fcb, ULONG size) {
+    index_arena_block* iab = NULL;
+    void* ptr;
+    
+    size = (size + sizeof(UINT64) - 1) & ~(sizeof(UINT64) - 1);
+    
+    if (!IsListEmpty(&fcb->index_arena)) {
+        iab = CONTAINING_RECORD(fcb->index_arena.Blink, index_arena_block, list_entry);
+        
+        if (iab->used + size > iab->size)
+            iab = NULL;
+    }
+    
+    if (!iab) {
+        ULONG blocksize;
+        
+        if (IsListEmpty(&fcb->index_arena)) {
+            // st_size is twice the length of all the names, and each entry holds its name in both UTF-8 and UTF-16
+            if (fcb->inode_item.st_size * 2 > INDEX_ARENA_MAX_BLOCK_SIZE)
+                blocksize = INDEX_ARENA_MAX_BLOCK_SIZE;
+            else
+                blocksize = max(INDEX_ARENA_MIN_BLOCK_SIZE, (ULONG)fcb->inode_item.st_size * 2);
+        } else
+            blocksize = min(CONTAINING_RECORD(fcb->index_arena.Blink, index_arena_block, list_entry)->size * 2, INDEX_ARENA_MAX_BLOCK_SIZE);
+        
+        blocksize = max(blocksize, size);
+        
+        iab = ExAllocatePoolWithTag(PagedPool, offsetof(index_arena_block, data[0]) + blocksize, ALLOC_TAG);
+        if (!iab) {
+            ERR("out of memory\n");
+            return NULL;
+        }
+        
+        iab->used = 0;
+        iab->size = blocksize;
+        InsertTailList(&fcb->index_arena, &iab->list_entry);
+    }
+    
+    ptr = (UINT8*)iab->data + iab->used;
+    iab->used += size;
+    
+    return ptr;
+}
+
+void free_dir_index(fcb* fcb) {
+    while (!IsListEmpty(&fcb->index_arena)) {
+        index_arena_block* iab = CONTAINING_RECORD(RemoveHeadList(&fcb->index_arena), index_arena_block, list_entry);
+        
+        ExFreePool(iab);
+    }
+    
+    if (fcb->index_hash) {
+        ExFreePool(fcb->index_hash);
+        fcb->index_hash = NULL;
+    }
+    
+    fcb->index_hash_size = 0;
+    fcb->index_hash_count = 0;
+    fcb->index_next = 0;
+    fcb->index_loaded = FALSE;
+}
+
+// Reads the directory's DIR_INDEX items into its index, carrying on from where the last
+// call stopped. We return as soon as we've added an entry whose hash is stophash, so that
+// finding a name doesn't mean having to read in the whole of a huge directory first.
+static NTSTATUS load_index_list(fcb* fcb, UINT32 stophash, PIRP Irp) {
     KEY searchkey;
     traverse_ptr tp, next_tp;
     NTSTATUS Status;
     BOOL b;
+    WCHAR name[256];
     
     searchkey.obj_id = fcb->inode;
     searchkey.obj_type = TYPE_DIR_INDEX;
-    searchkey.offset = 2;
+    searchkey.offset = fcb->index_next < 2 ? 2 : fcb->index_next;
     
     Status = find_item(fcb->Vcb, fcb->subvol, &tp, &searchkey, FALSE, Irp);
     if (!NT_SUCCESS(Status)) {
@@ -203,24 +345,15 @@ static NTSTATUS load_index_list(fcb* fcb, PIRP Irp) {
         }
     }
     
-    if (tp.item->key.obj_id != fcb->inode || tp.item->key.obj_type != TYPE_DIR_INDEX) {
+    if (tp.item->key.obj_id != fcb->inode || tp.item->key.obj_type != TYPE_DIR_INDEX || keycmp(tp.item->key, searchkey) == -1) {
+        fcb->index_loaded = TRUE;
         Status = STATUS_SUCCESS;
         goto end;
     }
     
-    if (!fcb->index_ptrs) {
-        fcb->index_ptrs = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY*) * 256, ALLOC_TAG);
-        if (!fcb->index_ptrs) {
-            ERR("out of memory\n");
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
-        }
-        
-        RtlZeroMemory(fcb->index_ptrs, sizeof(LIST_ENTRY*) * 256);
-    }
-    
     do {
         DIR_ITEM* di;
+        BOOL found = FALSE;
         
         TRACE("key: %llx,%x,%llx\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
         di = (DIR_ITEM*)tp.item->data;
@@ -231,120 +364,58 @@ static NTSTATUS load_index_list(fcb* fcb, PIRP Irp) {
             index_entry* ie;
             ULONG stringlen;
             UNICODE_STRING us;
-            LIST_ENTRY* le;
-            BOOL inserted;
-            UINT8 h;
             
-            ie = ExAllocatePoolWithTag(PagedPool, sizeof(index_entry), ALLOC_TAG);
-            if (!ie) {
-                ERR("out of memory\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
-            }
-            
-            ie->utf8.Length = ie->utf8.MaximumLength = di->n;
-            
-            if (di->n > 0) {
-                ie->utf8.Buffer = ExAllocatePoolWithTag(PagedPool, ie->utf8.MaximumLength, ALLOC_TAG);
-                if (!ie->utf8.Buffer) {
-                    ERR("out of memory\n");
-                    ExFreePool(ie);
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
-                }
-                
-                RtlCopyMemory(ie->utf8.Buffer, di->name, di->n);
-            } else
-                ie->utf8.Buffer = NULL;
+            // A UTF-8 name never has more UTF-16 characters than it has bytes, and btrfs
+            // names are at most 255 bytes, so we can convert on the stack in one go.
             
-            Status = RtlUTF8ToUnicodeN(NULL, 0, &stringlen, di->name, di->n);
+            Status = RtlUTF8ToUnicodeN(name, sizeof(name), &stringlen, di->name, di->n);
             if (!NT_SUCCESS(Status)) {
-                ERR("RtlUTF8ToUnicodeN 1 returned %08x\n", Status);
-                if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-                ExFreePool(ie);
+                ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
                 goto nextitem;
             }
             
             if (stringlen == 0) {
                 ERR("UTF8 length was 0\n");
-                if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-                ExFreePool(ie);
                 goto nextitem;
             }
             
-            us.Length = us.MaximumLength = stringlen;
-            us.Buffer = ExAllocatePoolWithTag(PagedPool, us.MaximumLength, ALLOC_TAG);
+            us.Buffer = name;
+            us.Length = us.MaximumLength = (USHORT)stringlen;
             
-            if (!us.Buffer) {
+            // the entry and both copies of its name go into the directory's arena
+            ie = index_arena_alloc(fcb, sizeof(index_entry) + di->n + stringlen);
+            if (!ie) {
                 ERR("out of memory\n");
-                if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-                ExFreePool(ie);
-                return STATUS_INSUFFICIENT_RESOURCES;
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
             }
             
-            Status = RtlUTF8ToUnicodeN(us.Buffer, stringlen, &stringlen, di->name, di->n);
-            if (!NT_SUCCESS(Status)) {
-                ERR("RtlUTF8ToUnicodeN 2 returned %08x\n", Status);
-                ExFreePool(us.Buffer);
-                if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-                ExFreePool(ie);
-                goto nextitem;
-            }
+            ie->filepart_uc.Buffer = (WCHAR*)&ie[1];
+            ie->filepart_uc.Length = ie->filepart_uc.MaximumLength = (USHORT)stringlen;
             
-            Status = RtlUpcaseUnicodeString(&ie->filepart_uc, &us, TRUE);
+            Status = RtlUpcaseUnicodeString(&ie->filepart_uc, &us, FALSE);
             if (!NT_SUCCESS(Status)) {
                 ERR("RtlUpcaseUnicodeString returned %08x\n", Status);
-                ExFreePool(us.Buffer);
-                if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-                ExFreePool(ie);
                 goto nextitem;
             }
             
+            ie->utf8.Length = ie->utf8.MaximumLength = di->n;
+            ie->utf8.Buffer = (char*)ie->filepart_uc.Buffer + stringlen;
+            RtlCopyMemory(ie->utf8.Buffer, di->name, di->n);
+            
             ie->key = di->key;
             ie->type = di->type;
             ie->index = tp.item->key.offset;
             
             ie->hash = calc_crc32c(0xfffffffe, (UINT8*)ie->filepart_uc.Buffer, (ULONG)ie->filepart_uc.Length);
-            inserted = FALSE;
-            
-            h = (ie->hash & 0xff000000) >> 24;
             
-            if (!fcb->index_ptrs[h]) {
-                UINT8 c = h;
-                
-                le = fcb->index_list.Flink;
-                
-                if (c > 0) {
-                    c--;
-                    do {
-                        if (fcb->index_ptrs[c]) {
-                            le = fcb->index_ptrs[c];
-                            break;
-                        }
-                            
-                        c--;
-                    } while (c > 0);
-                }
-            } else
-                le = fcb->index_ptrs[h];
-            
-            while (le != &fcb->index_list) {
-                index_entry* ie2 = CONTAINING_RECORD(le, index_entry, list_entry);
-                
-                if (ie2->hash >= ie->hash) {
-                    InsertHeadList(le->Blink, &ie->list_entry);
-                    inserted = TRUE;
-                    break;
-                }
-                
-                le = le->Flink;
+            Status = add_to_index_hash(fcb, ie);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_to_index_hash returned %08x\n", Status);
+                goto end;
             }
-        
-            if (!inserted)
-                InsertTailList(&fcb->index_list, &ie->list_entry);
             
-            if (!fcb->index_ptrs[h] || ie->list_entry.Flink == fcb->index_ptrs[h])
-                fcb->index_ptrs[h] = &ie->list_entry;
+            found = ie->hash == stophash;
         }
         
 nextitem:
@@ -355,38 +426,186 @@ nextitem:
             
             b = tp.item->key.obj_id == fcb->inode && tp.item->key.obj_type == TYPE_DIR_INDEX;
         }
+        
+        if (found && b) {
+            fcb->index_next = tp.item->key.offset;
+            Status = STATUS_SUCCESS;
+            goto end;
+        }
     } while (b);
     
+    fcb->index_loaded = TRUE;
     Status = STATUS_SUCCESS;
     
 end:
-    if (!NT_SUCCESS(Status)) {
-        while (!IsListEmpty(&fcb->index_list)) {
-            LIST_ENTRY* le = RemoveHeadList(&fcb->index_list);
-            index_entry* ie = CONTAINING_RECORD(le, index_entry, list_entry);
+    if (!NT_SUCCESS(Status))
+        free_dir_index(fcb);
+    else
+        mark_fcb_dirty(fcb); // It's not necessarily dirty, but this is an easy way of making sure
+                             // the list remains in memory until the next flush.
+    
+    return Status;
+}
 
-            if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-            if (ie->filepart_uc.Buffer) ExFreePool(ie->filepart_uc.Buffer);
-            ExFreePool(ie);
+static void link_fileref_child_hash(file_ref* parent, file_ref* child) {
+    ULONG mask = parent->children_hash_size - 1;
+    
+    InsertTailList(&parent->children_hash[child->hash & mask], &child->list_entry_hash);
+    InsertTailList(&parent->children_hash[parent->children_hash_size + (child->index & mask)], &child->list_entry_index);
+}
+
+static BOOL rehash_fileref_children(file_ref* parent, ULONG size) {
+    LIST_ENTRY* buckets;
+    LIST_ENTRY* le;
+    ULONG i;
+    
+    buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * size * 2, ALLOC_TAG);
+    if (!buckets) {
+        ERR("out of memory\n");
+        return FALSE;
+    }
+    
+    for (i = 0; i < size * 2; i++) {
+        InitializeListHead(&buckets[i]);
+    }
+    
+    if (parent->children_hash)
+        ExFreePool(parent->children_hash);
+    
+    parent->children_hash = buckets;
+    parent->children_hash_size = size;
+    
+    le = parent->children.Flink;
+    while (le != &parent->children) {
+        file_ref* fr = CONTAINING_RECORD(le, file_ref, list_entry);
+        
+        link_fileref_child_hash(parent, fr);
+        
+        le = le->Flink;
+    }
+    
+    return TRUE;
+}
+
+void remove_fileref_child(file_ref* parent, file_ref* child) {
+    RemoveEntryList(&child->list_entry);
+    
+    if (parent->children_hash) {
+        RemoveEntryList(&child->list_entry_hash);
+        RemoveEntryList(&child->list_entry_index);
+    }
+    
+    parent->num_children--;
+    parent->children_gen++;
+}
+
+// Returns the child after prev whose name hashes to hash, or NULL. Callers still have to compare the names.
+static file_ref* next_fileref_child_by_hash(file_ref* parent, UINT32 hash, file_ref* prev) {
+    LIST_ENTRY *le, *head;
+    
+    if (parent->children_hash) {
+        head = &parent->children_hash[hash & (parent->children_hash_size - 1)];
+        le = prev ? prev->list_entry_hash.Flink : head->Flink;
+        
+        while (le != head) {
+            file_ref* fr = CONTAINING_RECORD(le, file_ref, list_entry_hash);
+            
+            if (fr->hash == hash)
+                return fr;
+            
+            le = le->Flink;
         }
+    } else {
+        le = prev ? prev->list_entry.Flink : parent->children.Flink;
         
-        if (fcb->index_ptrs) {
-            ExFreePool(fcb->index_ptrs);
-            fcb->index_ptrs = NULL;
+        while (le != &parent->children) {
+            file_ref* fr = CONTAINING_RECORD(le, file_ref, list_entry);
+            
+            if (fr->hash == hash)
+                return fr;
+            
+            le = le->Flink;
         }
-    } else
-        mark_fcb_dirty(fcb); // It's not necessarily dirty, but this is an easy way of making sure
-                             // the list remains in memory until the next flush.
+    }
     
-    return Status;
+    return NULL;
+}
+
+file_ref* find_fileref_child_by_index(file_ref* parent, UINT64 index) {
+    LIST_ENTRY *le, *head;
+    
+    if (parent->children_hash) {
+        head = &parent->children_hash[parent->children_hash_size + (index & (parent->children_hash_size - 1))];
+        
+        le = head->Flink;
+        while (le != head) {
+            file_ref* fr = CONTAINING_RECORD(le, file_ref, list_entry_index);
+            
+            if (fr->index == index)
+                return fr;
+            
+            le = le->Flink;
+        }
+    } else {
+        le = parent->children.Flink;
+        while (le != &parent->children) {
+            file_ref* fr = CONTAINING_RECORD(le, file_ref, list_entry);
+            
+            if (fr->index == index)
+                return fr;
+            else if (fr->index > index)
+                break;
+            
+            le = le->Flink;
+        }
+    }
+    
+    return NULL;
+}
+
+static index_entry* find_in_index_hash(file_ref* fr, PUNICODE_STRING us, UINT32 hash) {
+    ULONG mask, i;
+    
+    if (!fr->fcb->index_hash)
+        return NULL;
+    
+    mask = fr->fcb->index_hash_size - 1;
+    i = hash & mask;
+    
+    while (fr->fcb->index_hash[i].ie) {
+        index_entry* ie = fr->fcb->index_hash[i].ie;
+        
+        if (fr->fcb->index_hash[i].hash == hash && ie->filepart_uc.Length == us->Length &&
+            RtlCompareMemory(ie->filepart_uc.Buffer, us->Buffer, us->Length) == us->Length) {
+            file_ref* fr2;
+            BOOL ignore_entry = FALSE;
+            
+            ExAcquireResourceSharedLite(&fr->nonpaged->children_lock, TRUE);
+            
+            fr2 = find_fileref_child_by_index(fr, ie->index);
+            
+            if (fr2 && (fr2->deleted || fr2->filepart_uc.Length != us->Length ||
+                RtlCompareMemory(fr2->filepart_uc.Buffer, us->Buffer, us->Length) != us->Length))
+                ignore_entry = TRUE;
+            
+            ExReleaseResourceLite(&fr->nonpaged->children_lock);
+            
+            if (!ignore_entry)
+                return ie;
+        }
+        
+        i = (i + 1) & mask;
+    }
+    
+    return NULL;
 }
 
 static NTSTATUS STDCALL find_file_in_dir_index(file_ref* fr, PUNICODE_STRING filename, root** subvol, UINT64* inode, UINT8* type,
                                                UINT64* pindex, PANSI_STRING utf8, PIRP Irp) {
-    LIST_ENTRY* le;
     NTSTATUS Status;
     UNICODE_STRING us;
     UINT32 hash;
+    index_entry* ie;
         
     Status = RtlUpcaseUnicodeString(&us, filename, TRUE);
     if (!NT_SUCCESS(Status)) {
@@ -396,118 +615,85 @@ static NTSTATUS STDCALL find_file_in_dir_index(file_ref* fr, PUNICODE_STRING fil
     
     hash = calc_crc32c(0xfffffffe, (UINT8*)us.Buffer, (ULONG)us.Length);
     
-    ExAcquireResourceExclusiveLite(&fr->fcb->nonpaged->index_lock, TRUE);
+    ExAcquireResourceSharedLite(&fr->fcb->nonpaged->index_lock, TRUE);
     
-    if (!fr->fcb->index_loaded) {
-        Status = load_index_list(fr->fcb, Irp);
-        if (!NT_SUCCESS(Status)) {
-            ERR("load_index_list returned %08x\n", Status);
-            goto end;
-        }
+    ie = find_in_index_hash(fr, &us, hash);
+    
+    if (!ie && !fr->fcb->index_loaded) {
+        ExReleaseResourceLite(&fr->fcb->nonpaged->index_lock);
+        ExAcquireResourceExclusiveLite(&fr->fcb->nonpaged->index_lock, TRUE);
+        
+        // read in more of the index until we find the name or run out of entries
+        
+        ie = find_in_index_hash(fr, &us, hash);
         
-        fr->fcb->index_loaded = TRUE;
+        while (!ie && !fr->fcb->index_loaded) {
+            Status = load_index_list(fr->fcb, hash, Irp);
+            if (!NT_SUCCESS(Status)) {
+                ERR("load_index_list returned %08x\n", Status);
+                goto end;
+            }
+            
+            ie = find_in_index_hash(fr, &us, hash);
+        }
     }
     
-    ExConvertExclusiveToSharedLite(&fr->fcb->nonpaged->index_lock);
+    if (!ie) {
+        Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        goto end;
+    }
     
-    if (fr->fcb->index_ptrs && fr->fcb->index_ptrs[(hash & 0xff000000) >> 24]) {
-        le = fr->fcb->index_ptrs[(hash & 0xff000000) >> 24];
-        
-        while (le != &fr->fcb->index_list) {
-            index_entry* ie = CONTAINING_RECORD(le, index_entry, list_entry);
+    if (ie->key.obj_type == TYPE_ROOT_ITEM) {
+        if (subvol) {
+            LIST_ENTRY* le;
             
-            if (ie->hash == hash && ie->filepart_uc.Length == us.Length && RtlCompareMemory(ie->filepart_uc.Buffer, us.Buffer, us.Length) == us.Length) {
-                LIST_ENTRY* le;
-                BOOL ignore_entry = FALSE;
-                
-                ExAcquireResourceSharedLite(&fr->nonpaged->children_lock, TRUE);
-
-                le = fr->children.Flink;
-                while (le != &fr->children) {
-                    file_ref* fr2 = CONTAINING_RECORD(le, file_ref, list_entry);
-                    
-                    if (fr2->index == ie->index) {
-                        if (fr2->deleted || fr2->filepart_uc.Length != us.Length ||
-                            RtlCompareMemory(fr2->filepart_uc.Buffer, us.Buffer, us.Length) != us.Length) {
-                            ignore_entry = TRUE;
-                            break;
-                        }
-                        break;
-                    } else if (fr2->index > ie->index)
-                        break;
-                    
-                    le = le->Flink;
-                }
-                
-                ExReleaseResourceLite(&fr->nonpaged->children_lock);
-                
-                if (ignore_entry)
-                    goto nextitem;
-                
-                if (ie->key.obj_type == TYPE_ROOT_ITEM) {
-                    if (subvol) {
-                        *subvol = NULL;
-                        
-                        le = fr->fcb->Vcb->roots.Flink;
-                        while (le != &fr->fcb->Vcb->roots) {
-                            root* r2 = CONTAINING_RECORD(le, root, list_entry);
-                            
-                            if (r2->id == ie->key.obj_id) {
-                                *subvol = r2;
-                                break;
-                            }
-                            
-                            le = le->Flink;
-                        }
-                    }
-                    
-                    if (inode)
-                        *inode = SUBVOL_ROOT_INODE;
-                    
-                    if (type)
-                        *type = BTRFS_TYPE_DIRECTORY;
-                } else {
-                    if (subvol)
-                        *subvol = fr->fcb->subvol;
-                    
-                    if (inode)
-                        *inode = ie->key.obj_id;
-                    
-                    if (type)
-                        *type = ie->type;
-                }
+            *subvol = NULL;
+            
+            le = fr->fcb->Vcb->roots.Flink;
+            while (le != &fr->fcb->Vcb->roots) {
+                root* r2 = CONTAINING_RECORD(le, root, list_entry);
                 
-                if (utf8) {
-                    utf8->MaximumLength = utf8->Length = ie->utf8.Length;
-                    utf8->Buffer = ExAllocatePoolWithTag(PagedPool, utf8->MaximumLength, ALLOC_TAG);
-                    if (!utf8->Buffer) {
-                        ERR("out of memory\n");
-                        Status = STATUS_INSUFFICIENT_RESOURCES;
-                        goto end;
-                    }
-                    
-                    RtlCopyMemory(utf8->Buffer, ie->utf8.Buffer, ie->utf8.Length);
+                if (r2->id == ie->key.obj_id) {
+                    *subvol = r2;
+                    break;
                 }
                 
-                if (pindex)
-                    *pindex = ie->index;
-                
-                Status = STATUS_SUCCESS;
-                goto end;
-            } else if ((!(hash & 0x80000000) && ie->hash > hash) || ((hash & 0x80000000) && ie->hash < hash)) {
-                Status = STATUS_OBJECT_NAME_NOT_FOUND;
-                goto end;
-            }
-            
-nextitem:
-            if (hash & 0x80000000)
-                le = le->Blink;
-            else
                 le = le->Flink;
+            }
+        }
+        
+        if (inode)
+            *inode = SUBVOL_ROOT_INODE;
+        
+        if (type)
+            *type = BTRFS_TYPE_DIRECTORY;
+    } else {
+        if (subvol)
+            *subvol = fr->fcb->subvol;
+        
+        if (inode)
+            *inode = ie->key.obj_id;
+        
+        if (type)
+            *type = ie->type;
+    }
+    
+    if (utf8) {
+        utf8->MaximumLength = utf8->Length = ie->utf8.Length;
+        utf8->Buffer = ExAllocatePoolWithTag(PagedPool, utf8->MaximumLength, ALLOC_TAG);
+        if (!utf8->Buffer) {
+            ERR("out of memory\n");
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            goto end;
         }
+        
+        RtlCopyMemory(utf8->Buffer, ie->utf8.Buffer, ie->utf8.Length);
     }
     
-    Status = STATUS_OBJECT_NAME_NOT_FOUND;
+    if (pindex)
+        *pindex = ie->index;
+    
+    Status = STATUS_SUCCESS;
     
 end:
     ExReleaseResourceLite(&fr->fcb->nonpaged->index_lock);
@@ -667,21 +853,10 @@ static NTSTATUS STDCALL find_file_in_dir_with_crc32(device_extension* Vcb, PUNIC
                             }
                             
                             if (index != 0) {
-                                LIST_ENTRY* le = fr->children.Flink;
+                                file_ref* fr2 = find_fileref_child_by_index(fr, index);
                                 
-                                while (le != &fr->children) {
-                                    file_ref* fr2 = CONTAINING_RECORD(le, file_ref, list_entry);
-                                    
-                                    if (fr2->index == index) {
-                                        if (fr2->deleted || !FsRtlAreNamesEqual(&fr2->filepart, filename, !case_sensitive, NULL)) {
-                                            goto byindex;
-                                        }
-                                        break;
-                                    } else if (fr2->index > index)
-                                        break;
-                                    
-                                    le = le->Flink;
-                                }
+                                if (fr2 && (fr2->deleted || !FsRtlAreNamesEqual(&fr2->filepart, filename, !case_sensitive, NULL)))
+                                    goto byindex;
                             }
                             
 //                             TRACE("found %.*S by hash at (%llx,%llx)\n", filename->Length / sizeof(WCHAR), filename->Buffer, (*subvol)->id, *inode);
@@ -758,7 +933,8 @@ fcb* create_fcb(POOL_TYPE pool_type) {
     FsRtlInitializeFileLock(&fcb->lock, NULL, NULL);
     
     InitializeListHead(&fcb->extents);
-    InitializeListHead(&fcb->index_list);
+    InitializeListHead(&fcb->delalloc);
+    InitializeListHead(&fcb->index_arena);
     InitializeListHead(&fcb->hardlinks);
     
     return fcb;
@@ -795,6 +971,111 @@ file_ref* create_fileref() {
     return fr;
 }
 
+// The fcbs hash is keyed on the low bits of the inode number, as inodes are
+// allocated sequentially. All of these need fcb_lock to be held.
+
+static BOOL rehash_subvol_fcbs(root* r, ULONG size) {
+    LIST_ENTRY* buckets;
+    LIST_ENTRY* le;
+    ULONG i;
+    
+    buckets = ExAllocatePoolWithTag(PagedPool, sizeof(LIST_ENTRY) * size, ALLOC_TAG);
+    if (!buckets) {
+        ERR("out of memory\n");
+        return FALSE;
+    }
+    
+    for (i = 0; i < size; i++) {
+        InitializeListHead(&buckets[i]);
+    }
+    
+    if (r->fcbs_hash)
+        ExFreePool(r->fcbs_hash);
+    
+    r->fcbs_hash = buckets;
+    r->fcbs_hash_size = size;
+    
+    le = r->fcbs.Flink;
+    while (le != &r->fcbs) {
+        fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
+        
+        InsertTailList(&buckets[fcb->inode & (size - 1)], &fcb->list_entry_hash);
+        
+        le = le->Flink;
+    }
+    
+    return TRUE;
+}
+
+void add_fcb_to_subvol(fcb* fcb) {
+    root* r = fcb->subvol;
+    
+    InsertTailList(&r->fcbs, &fcb->list_entry);
+    r->num_fcbs++;
+    
+    // If we can't allocate the table, lookups fall back to walking the fcbs list.
+    
+    if (!r->fcbs_hash) {
+        if (r->num_fcbs == 1)
+            rehash_subvol_fcbs(r, FCBS_HASH_INITIAL_SIZE);
+    } else if (r->num_fcbs <= r->fcbs_hash_size * 2 || !rehash_subvol_fcbs(r, r->fcbs_hash_size * 2))
+        InsertTailList(&r->fcbs_hash[fcb->inode & (r->fcbs_hash_size - 1)], &fcb->list_entry_hash);
+}
+
+void remove_fcb_from_subvol(root* r, fcb* fcb) {
+    RemoveEntryList(&fcb->list_entry);
+    
+    if (r->fcbs_hash)
+        RemoveEntryList(&fcb->list_entry_hash);
+    
+    r->num_fcbs--;
+    
+    // anything a directory listing cached about the inode while this was open may be out of date now
+    invalidate_attr_cache(fcb->Vcb, r, fcb->inode);
+}
+
+static BOOL fcb_matches(fcb* fcb, UINT64 inode, PANSI_STRING xattr) {
+    if (fcb->inode != inode)
+        return FALSE;
+    
+    if (!xattr)
+        return !fcb->ads;
+    
+    return fcb->ads && fcb->adsxattr.Length == xattr->Length &&
+           RtlCompareMemory(fcb->adsxattr.Buffer, xattr->Buffer, fcb->adsxattr.Length) == fcb->adsxattr.Length;
+}
+
+// Returns the fcb for inode in r, or the fcb for its stream xattr if that's not NULL. Doesn't increase the refcount.
+fcb* find_fcb_in_subvol(root* r, UINT64 inode, PANSI_STRING xattr) {
+    LIST_ENTRY *le, *head;
+    
+    if (r->fcbs_hash) {
+        head = &r->fcbs_hash[inode & (r->fcbs_hash_size - 1)];
+        
+        le = head->Flink;
+        while (le != head) {
+            fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry_hash);
+            
+            if (fcb_matches(fcb, inode, xattr))
+                return fcb;
+            
+            le = le->Flink;
+        }
+    } else {
+        le = r->fcbs.Flink;
+        while (le != &r->fcbs) {
+            fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
+            
+            if (fcb_matches(fcb, inode, xattr))
+                return fcb;
+            
+            le = le->Flink;
+        }
+    }
+    
+    return NULL;
+}
+
 NTSTATUS STDCALL find_file_in_dir(device_extension* Vcb, PUNICODE_STRING filename, file_ref* fr,
                                   root** subvol, UINT64* inode, UINT8* type, UINT64* index, PANSI_STRING utf8,
                                   BOOL case_sensitive, PIRP Irp) {
@@ -1147,52 +1428,33 @@ static NTSTATUS split_path(PUNICODE_STRING path, UNICODE_STRING** parts, ULONG*
 // #endif
 
 static file_ref* search_fileref_children(file_ref* dir, PUNICODE_STRING name, BOOL case_sensitive) {
-    LIST_ENTRY* le;
     file_ref *c, *deleted = NULL;
     NTSTATUS Status;
     UNICODE_STRING ucus;
+    UINT32 hash;
 #ifdef DEBUG_FCB_REFCOUNTS
     ULONG rc;
 #endif
     
-    if (case_sensitive) {
-        le = dir->children.Flink;
-        while (le != &dir->children) {
-            c = CONTAINING_RECORD(le, file_ref, list_entry);
-            
-            if (c->refcount > 0 && c->filepart.Length == name->Length &&
-                RtlCompareMemory(c->filepart.Buffer, name->Buffer, name->Length) == name->Length) {
-                if (c->deleted) {
-                    deleted = c;
-                } else {
-#ifdef DEBUG_FCB_REFCOUNTS
-                    rc = InterlockedIncrement(&c->refcount);
-                    WARN("fileref %p: refcount now %i (%S)\n", c, rc, file_desc_fileref(c));
-#else
-                    InterlockedIncrement(&c->refcount);
-#endif
-                    return c;
-                }
-            }
-            
-            le = le->Flink;
-        }
-        
-        goto end;
-    }
-
+    // children are hashed by their upcased name, so we need this even for case-sensitive lookups
     Status = RtlUpcaseUnicodeString(&ucus, name, TRUE);
     if (!NT_SUCCESS(Status)) {
         ERR("RtlUpcaseUnicodeString returned %08x\n", Status);
         return NULL;
     }
+    
+    hash = calc_crc32c(0xfffffffe, (UINT8*)ucus.Buffer, (ULONG)ucus.Length);
+    
+    c = next_fileref_child_by_hash(dir, hash, NULL);
+    while (c) {
+        BOOL match;
         
-    le = dir->children.Flink;
-    while (le != &dir->children) {
-        c = CONTAINING_RECORD(le, file_ref, list_entry);
+        if (case_sensitive)
+            match = c->filepart.Length == name->Length && RtlCompareMemory(c->filepart.Buffer, name->Buffer, name->Length) == name->Length;
+        else
+            match = c->filepart_uc.Length == ucus.Length && RtlCompareMemory(c->filepart_uc.Buffer, ucus.Buffer, ucus.Length) == ucus.Length;
         
-        if (c->refcount > 0 && c->filepart_uc.Length == ucus.Length &&
-            RtlCompareMemory(c->filepart_uc.Buffer, ucus.Buffer, ucus.Length) == ucus.Length) {
+        if (c->refcount > 0 && match) {
             if (c->deleted) {
                 deleted = c;
             } else {
@@ -1208,12 +1470,11 @@ static file_ref* search_fileref_children(file_ref* dir, PUNICODE_STRING name, BO
             }
         }
         
-        le = le->Flink;
+        c = next_fileref_child_by_hash(dir, hash, c);
     }
     
     ExFreePool(ucus.Buffer);
     
-end:
     if (deleted)
         increase_fileref_refcount(deleted);
     
@@ -1226,35 +1487,20 @@ NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type,
     NTSTATUS Status;
     fcb* fcb;
     BOOL atts_set = FALSE, sd_set = FALSE, no_data;
-    LIST_ENTRY* lastle = NULL;
     EXTENT_DATA* ed = NULL;
     
-    if (!IsListEmpty(&subvol->fcbs)) {
-        LIST_ENTRY* le = subvol->fcbs.Flink;
-                                
-        while (le != &subvol->fcbs) {
-            fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
-            
-            if (fcb->inode == inode) {
-                if (!fcb->ads) {
+    fcb = find_fcb_in_subvol(subvol, inode, NULL);
+    if (fcb) {
 #ifdef DEBUG_FCB_REFCOUNTS
-                    LONG rc = InterlockedIncrement(&fcb->refcount);
+        LONG rc = InterlockedIncrement(&fcb->refcount);
 
-                    WARN("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol->id, fcb->inode);
+        WARN("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol->id, fcb->inode);
 #else
-                    InterlockedIncrement(&fcb->refcount);
+        InterlockedIncrement(&fcb->refcount);
 #endif
 
-                    *pfcb = fcb;
-                    return STATUS_SUCCESS;
-                }
-            } else if (fcb->inode > inode) {
-                lastle = le->Blink;
-                break;
-            }
-            
-            le = le->Flink;
-        }
+        *pfcb = fcb;
+        return STATUS_SUCCESS;
     }
     
     fcb = create_fcb(pooltype);
@@ -1621,10 +1867,7 @@ NTSTATUS open_fcb(device_extension* Vcb, root* subvol, UINT64 inode, UINT8 type,
         }
     }
     
-    if (lastle)
-        InsertHeadList(lastle, &fcb->list_entry);
-    else
-        InsertTailList(&subvol->fcbs, &fcb->list_entry);
+    add_fcb_to_subvol(fcb);
     
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
     
@@ -1642,35 +1885,19 @@ NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI
     NTSTATUS Status;
     KEY searchkey;
     traverse_ptr tp;
-    LIST_ENTRY* lastle = NULL;
     
-    if (!IsListEmpty(&subvol->fcbs)) {
-        LIST_ENTRY* le = subvol->fcbs.Flink;
-                                
-        while (le != &subvol->fcbs) {
-            fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
-            
-            if (fcb->inode == inode) {
-                if (fcb->ads && fcb->adsxattr.Length == xattr->Length &&
-                    RtlCompareMemory(fcb->adsxattr.Buffer, xattr->Buffer, fcb->adsxattr.Length) == fcb->adsxattr.Length) {
+    fcb = find_fcb_in_subvol(subvol, inode, xattr);
+    if (fcb) {
 #ifdef DEBUG_FCB_REFCOUNTS
-                    LONG rc = InterlockedIncrement(&fcb->refcount);
+        LONG rc = InterlockedIncrement(&fcb->refcount);
 
-                    WARN("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol->id, fcb->inode);
+        WARN("fcb %p: refcount now %i (subvol %llx, inode %llx)\n", fcb, rc, fcb->subvol->id, fcb->inode);
 #else
-                    InterlockedIncrement(&fcb->refcount);
+        InterlockedIncrement(&fcb->refcount);
 #endif
 
-                    *pfcb = fcb;
-                    return STATUS_SUCCESS;
-                }
-            } else if (fcb->inode > inode) {
-                lastle = le->Blink;
-                break;
-            }
-                            
-            le = le->Flink;
-        }
+        *pfcb = fcb;
+        return STATUS_SUCCESS;
     }
     
     fcb = create_fcb(PagedPool);
@@ -1733,10 +1960,7 @@ NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI
     
     TRACE("stream found: size = %x, hash = %08x\n", xattrlen, fcb->adshash);
     
-    if (lastle)
-        InsertHeadList(lastle, &fcb->list_entry);
-    else
-        InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
+    add_fcb_to_subvol(fcb);
     
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
     
@@ -1745,11 +1969,155 @@ NTSTATUS open_fcb_stream(device_extension* Vcb, root* subvol, UINT64 inode, ANSI
     return STATUS_SUCCESS;
 }
 
+static void clear_negative_entry(negative_entry* ne) {
+    if (ne->name_uc.Buffer) {
+        ExFreePool(ne->name_uc.Buffer);
+        ne->name_uc.Buffer = NULL;
+        ne->name_uc.Length = ne->name_uc.MaximumLength = 0;
+    }
+}
+
+void free_negative_cache(file_ref* fr) {
+    ULONG i;
+    
+    if (!fr->negative_cache)
+        return;
+    
+    for (i = 0; i < NEGATIVE_CACHE_ENTRIES; i++) {
+        clear_negative_entry(&fr->negative_cache[i]);
+    }
+    
+    ExFreePool(fr->negative_cache);
+    fr->negative_cache = NULL;
+}
+
+static negative_entry* find_negative_entry(file_ref* dir, PUNICODE_STRING name_uc, UINT32 hash) {
+    ULONG i;
+    
+    if (!dir->negative_cache)
+        return NULL;
+    
+    for (i = 0; i < NEGATIVE_CACHE_ENTRIES; i++) {
+        negative_entry* ne = &dir->negative_cache[i];
+        
+        if (ne->name_uc.Buffer && ne->hash == hash && ne->name_uc.Length == name_uc->Length &&
+            RtlCompareMemory(ne->name_uc.Buffer, name_uc->Buffer, name_uc->Length) == name_uc->Length)
+            return ne;
+    }
+    
+    return NULL;
+}
+
+// Returns TRUE if name was recently looked up in dir and not found. gen is set to the
+// children generation, which has to be passed to add_negative_entry if the lookup fails.
+static BOOL check_negative_cache(file_ref* dir, PUNICODE_STRING name, ULONG* gen) {
+    WCHAR buf[256];
+    UNICODE_STRING us;
+    UINT32 hash;
+    BOOL found;
+    NTSTATUS Status;
+    
+    ExAcquireResourceSharedLite(&dir->nonpaged->children_lock, TRUE);
+    *gen = dir->children_gen;
+    
+    if (!dir->negative_cache || name->Length > sizeof(buf)) {
+        ExReleaseResourceLite(&dir->nonpaged->children_lock);
+        return FALSE;
+    }
+    
+    us.Buffer = buf;
+    us.MaximumLength = sizeof(buf);
+    
+    Status = RtlUpcaseUnicodeString(&us, name, FALSE);
+    if (!NT_SUCCESS(Status)) {
+        ERR("RtlUpcaseUnicodeString returned %08x\n", Status);
+        ExReleaseResourceLite(&dir->nonpaged->children_lock);
+        return FALSE;
+    }
+    
+    hash = calc_crc32c(0xfffffffe, (UINT8*)us.Buffer, (ULONG)us.Length);
+    found = find_negative_entry(dir, &us, hash) ? TRUE : FALSE;
+    
+    ExReleaseResourceLite(&dir->nonpaged->children_lock);
+    
+    if (found)
+        InterlockedIncrement64((LONG64*)&dir->fcb->Vcb->lookup_stats.negative_hits);
+    else
+        InterlockedIncrement64((LONG64*)&dir->fcb->Vcb->lookup_stats.negative_misses);
+    
+    return found;
+}
+
+// Only case-insensitive misses should be added, as they also answer case-sensitive lookups.
+static void add_negative_entry(file_ref* dir, PUNICODE_STRING name, ULONG gen) {
+    UNICODE_STRING us;
+    UINT32 hash;
+    negative_entry* ne;
+    NTSTATUS Status;
+    
+    if (name->Length > 255 * sizeof(WCHAR))
+        return;
+    
+    Status = RtlUpcaseUnicodeString(&us, name, TRUE);
+    if (!NT_SUCCESS(Status)) {
+        ERR("RtlUpcaseUnicodeString returned %08x\n", Status);
+        return;
+    }
+    
+    hash = calc_crc32c(0xfffffffe, (UINT8*)us.Buffer, (ULONG)us.Length);
+    
+    ExAcquireResourceExclusiveLite(&dir->nonpaged->children_lock, TRUE);
+    
+    // don't add anything if a child was inserted since we started looking
+    if (dir->children_gen != gen || find_negative_entry(dir, &us, hash)) {
+        ExReleaseResourceLite(&dir->nonpaged->children_lock);
+        ExFreePool(us.Buffer);
+        return;
+    }
+    
+    if (!dir->negative_cache) {
+        dir->negative_cache = ExAllocatePoolWithTag(PagedPool, sizeof(negative_entry) * NEGATIVE_CACHE_ENTRIES, ALLOC_TAG);
+        if (!dir->negative_cache) {
+            ERR("out of memory\n");
+            ExReleaseResourceLite(&dir->nonpaged->children_lock);
+            ExFreePool(us.Buffer);
+            return;
+        }
+        
+        RtlZeroMemory(dir->negative_cache, sizeof(negative_entry) * NEGATIVE_CACHE_ENTRIES);
+        dir->negative_cache_next = 0;
+    }
+    
+    ne = &dir->negative_cache[dir->negative_cache_next];
+    dir->negative_cache_next = (dir->negative_cache_next + 1) % NEGATIVE_CACHE_ENTRIES;
+    
+    clear_negative_entry(ne);
+    ne->hash = hash;
+    ne->name_uc = us;
+    
+    ExReleaseResourceLite(&dir->nonpaged->children_lock);
+    
+    InterlockedIncrement64((LONG64*)&dir->fcb->Vcb->lookup_stats.negative_added);
+}
+
 void insert_fileref_child(file_ref* parent, file_ref* child, BOOL do_lock) {
     if (do_lock)
         ExAcquireResourceExclusiveLite(&parent->nonpaged->children_lock, TRUE);
     
-    if (IsListEmpty(&parent->children))
+    child->hash = calc_crc32c(0xfffffffe, (UINT8*)child->filepart_uc.Buffer, (ULONG)child->filepart_uc.Length);
+    
+    parent->children_gen++;
+    
+    if (parent->negative_cache) {
+        negative_entry* ne = find_negative_entry(parent, &child->filepart_uc, child->hash);
+        
+        if (ne) {
+            clear_negative_entry(ne);
+            InterlockedIncrement64((LONG64*)&parent->fcb->Vcb->lookup_stats.negative_invalidated);
+        }
+    }
+    
+    if (IsListEmpty(&parent->children) || CONTAINING_RECORD(parent->children.Blink, file_ref, list_entry)->index <= child->index)
         InsertTailList(&parent->children, &child->list_entry);
     else {
         LIST_ENTRY* le = parent->children.Flink;
@@ -1772,10 +2140,165 @@ void insert_fileref_child(file_ref* parent, file_ref* child, BOOL do_lock) {
         }
     }
     
+    parent->num_children++;
+    
+    // If we can't allocate the table, lookups fall back to walking the children list.
+    
+    if (!parent->children_hash) {
+        if (parent->num_children == 1)
+            rehash_fileref_children(parent, CHILDREN_HASH_INITIAL_SIZE);
+    } else if (parent->num_children <= parent->children_hash_size * 2 || !rehash_fileref_children(parent, parent->children_hash_size * 2))
+        link_fileref_child_hash(parent, child);
+    
     if (do_lock)
         ExReleaseResourceLite(&parent->nonpaged->children_lock);
 }
 
+// Throws away the whole path cache - called when anything might have changed what a path resolves to.
+// The caller has to hold fcb_lock exclusively, as this may free filerefs.
+void flush_path_cache(device_extension* Vcb) {
+    path_cache_entry* cache;
+    ULONG i;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->path_cache_lock, TRUE);
+    cache = Vcb->path_cache;
+    Vcb->path_cache = NULL;
+    ExReleaseResourceLite(&Vcb->path_cache_lock);
+    
+    if (!cache)
+        return;
+    
+    for (i = 0; i < PATH_CACHE_ENTRIES; i++) {
+        if (cache[i].fileref) {
+            free_fileref(cache[i].fileref);
+            ExFreePool(cache[i].path.Buffer);
+        }
+    }
+    
+    ExFreePool(cache);
+    
+    InterlockedIncrement64((LONG64*)&Vcb->lookup_stats.path_flushes);
+}
+
+// Drops the cached paths which resolve to fr or to one of its streams, e.g. because it's been renamed. The caller
+// has to hold fcb_lock exclusively, and a reference to fr.
+void remove_path_cache_fileref(device_extension* Vcb, file_ref* fr) {
+    ULONG i;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->path_cache_lock, TRUE);
+    
+    if (Vcb->path_cache) {
+        for (i = 0; i < PATH_CACHE_ENTRIES; i++) {
+            file_ref* fr2 = Vcb->path_cache[i].fileref;
+            
+            // fcb_lock stops fr2->parent from changing, and free_fileref doesn't take path_cache_lock
+            if (fr2 && (fr2 == fr || fr2->parent == fr)) {
+                ExFreePool(Vcb->path_cache[i].path.Buffer);
+                Vcb->path_cache[i].fileref = NULL;
+                free_fileref(fr2);
+            }
+        }
+    }
+    
+    ExReleaseResourceLite(&Vcb->path_cache_lock);
+}
+
+static file_ref* find_in_path_cache(device_extension* Vcb, PUNICODE_STRING path, BOOL parent, BOOL case_sensitive, ULONG* fn_offset) {
+    path_cache_entry* pce;
+    file_ref* fr = NULL;
+    file_ref* oldfr = NULL;
+    ULONG hash;
+    
+    if (!NT_SUCCESS(RtlHashUnicodeString(path, !case_sensitive, HASH_STRING_ALGORITHM_DEFAULT, &hash)))
+        return NULL;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->path_cache_lock, TRUE);
+    
+    if (Vcb->path_cache) {
+        pce = &Vcb->path_cache[hash & (PATH_CACHE_ENTRIES - 1)];
+        
+        if (pce->fileref && pce->hash == hash && pce->parent == parent && pce->case_sensitive == case_sensitive &&
+            RtlEqualUnicodeString(&pce->path, path, !case_sensitive)) {
+            if (pce->fileref->deleted) {
+                oldfr = pce->fileref;
+                ExFreePool(pce->path.Buffer);
+                pce->fileref = NULL;
+            } else {
+                fr = pce->fileref;
+                increase_fileref_refcount(fr);
+                
+                if (fn_offset)
+                    *fn_offset = pce->fn_offset;
+            }
+        }
+    }
+    
+    ExReleaseResourceLite(&Vcb->path_cache_lock);
+    
+    if (oldfr)
+        free_fileref(oldfr);
+    
+    if (fr)
+        InterlockedIncrement64((LONG64*)&Vcb->lookup_stats.path_hits);
+    else
+        InterlockedIncrement64((LONG64*)&Vcb->lookup_stats.path_misses);
+    
+    return fr;
+}
+
+static void add_to_path_cache(device_extension* Vcb, PUNICODE_STRING path, BOOL parent, BOOL case_sensitive, file_ref* fr, ULONG fn_offset) {
+    path_cache_entry* pce;
+    file_ref* oldfr = NULL;
+    ULONG hash;
+    WCHAR* buf;
+    
+    if (!NT_SUCCESS(RtlHashUnicodeString(path, !case_sensitive, HASH_STRING_ALGORITHM_DEFAULT, &hash)))
+        return;
+    
+    buf = ExAllocatePoolWithTag(PagedPool, path->Length, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return;
+    }
+    
+    RtlCopyMemory(buf, path->Buffer, path->Length);
+    
+    ExAcquireResourceExclusiveLite(&Vcb->path_cache_lock, TRUE);
+    
+    if (!Vcb->path_cache) {
+        Vcb->path_cache = ExAllocatePoolWithTag(PagedPool, sizeof(path_cache_entry) * PATH_CACHE_ENTRIES, ALLOC_TAG);
+        if (!Vcb->path_cache) {
+            ERR("out of memory\n");
+            ExReleaseResourceLite(&Vcb->path_cache_lock);
+            ExFreePool(buf);
+            return;
+        }
+        
+        RtlZeroMemory(Vcb->path_cache, sizeof(path_cache_entry) * PATH_CACHE_ENTRIES);
+    }
+    
+    pce = &Vcb->path_cache[hash & (PATH_CACHE_ENTRIES - 1)];
+    
+    if (pce->fileref) {
+        oldfr = pce->fileref;
+        ExFreePool(pce->path.Buffer);
+    }
+    
+    pce->path.Buffer = buf;
+    pce->path.Length = pce->path.MaximumLength = path->Length;
+    pce->hash = hash;
+    pce->parent = parent;
+    pce->case_sensitive = case_sensitive;
+    pce->fn_offset = fn_offset;
+    pce->fileref = fr;
+    increase_fileref_refcount(fr);
+    
+    ExReleaseResourceLite(&Vcb->path_cache_lock);
+    
+    if (oldfr)
+        free_fileref(oldfr);
+}
+
 NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnus, file_ref* related, BOOL parent, USHORT* parsed, ULONG* fn_offset,
                       POOL_TYPE pooltype, BOOL case_sensitive, PIRP Irp) {
     UNICODE_STRING fnus2;
@@ -1783,6 +2306,7 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
     ULONG i, num_parts;
     UNICODE_STRING* parts = NULL;
     BOOL has_stream;
+    ULONG lastoffset = 0;
     NTSTATUS Status;
     
     TRACE("(%p, %p, %p, %u, %p)\n", Vcb, pfr, related, parent, parsed);
@@ -1839,6 +2363,12 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
             return STATUS_SUCCESS;
         }
         
+        sf2 = find_in_path_cache(Vcb, fnus, parent, case_sensitive, fn_offset);
+        if (sf2) {
+            *pfr = sf2;
+            return STATUS_SUCCESS;
+        }
+        
         dir = Vcb->root_fileref;
         
         fnus2.Buffer++;
@@ -1889,6 +2419,15 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
     
     for (i = 0; i < num_parts; i++) {
         BOOL lastpart = (i == num_parts-1) || (i == num_parts-2 && has_stream);
+        BOOL is_stream = has_stream && i == num_parts - 1;
+        ULONG gen;
+        
+        if (!is_stream && check_negative_cache(sf, &parts[i], &gen)) {
+            TRACE("could not find %.*S (cached)\n", parts[i].Length / sizeof(WCHAR), parts[i].Buffer);
+            
+            Status = lastpart ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_OBJECT_PATH_NOT_FOUND;
+            goto end;
+        }
         
         sf2 = search_fileref_children(sf, &parts[i], case_sensitive);
         
@@ -1908,7 +2447,7 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
         }
         
         if (!sf2) {
-            if (has_stream && i == num_parts - 1) {
+            if (is_stream) {
                 UNICODE_STRING streamname;
                 ANSI_STRING xattr;
                 UINT32 streamhash;
@@ -1990,6 +2529,9 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
                 Status = find_file_in_dir(Vcb, &parts[i], sf, &subvol, &inode, &type, &index, &utf8, case_sensitive, Irp);
                 if (Status == STATUS_OBJECT_NAME_NOT_FOUND) {
                     TRACE("could not find %.*S\n", parts[i].Length / sizeof(WCHAR), parts[i].Buffer);
+                    
+                    if (!case_sensitive)
+                        add_negative_entry(sf, &parts[i], gen);
 
                     Status = lastpart ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_OBJECT_PATH_NOT_FOUND;
                     goto end;
@@ -2069,8 +2611,10 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
         }
         
         if (i == num_parts - 1) {
+            lastoffset = (ULONG)(parts[has_stream ? (num_parts - 2) : (num_parts - 1)].Buffer - fnus->Buffer);
+            
             if (fn_offset)
-                *fn_offset = parts[has_stream ? (num_parts - 2) : (num_parts - 1)].Buffer - fnus->Buffer;
+                *fn_offset = lastoffset;
             
             break;
         }
@@ -2088,8 +2632,13 @@ NTSTATUS open_fileref(device_extension* Vcb, file_ref** pfr, PUNICODE_STRING fnu
         sf = sf2;
     }
     
-    if (Status != STATUS_REPARSE)
+    if (Status != STATUS_REPARSE) {
         Status = STATUS_SUCCESS;
+        
+        if (!related)
+            add_to_path_cache(Vcb, fnus, parent, case_sensitive, sf2, lastoffset);
+    }
+    
     *pfr = sf2;
     
 end:
@@ -2414,7 +2963,7 @@ static NTSTATUS STDCALL file_create2(PIRP Irp, device_extension* Vcb, PUNICODE_S
     
     increase_fileref_refcount(parfileref);
  
-    InsertTailList(&fcb->subvol->fcbs, &fcb->list_entry);
+    add_fcb_to_subvol(fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
     
     *pfr = fileref;
@@ -2614,7 +3163,7 @@ static NTSTATUS create_stream(device_extension* Vcb, file_ref** pfileref, file_r
     mark_fcb_dirty(fcb);
     mark_fileref_dirty(fileref);
     
-    InsertHeadList(&parfileref->fcb->list_entry, &fcb->list_entry); // insert in list after parent fcb
+    add_fcb_to_subvol(fcb);
     InsertTailList(&Vcb->all_fcbs, &fcb->list_entry_all);
     
     KeQuerySystemTime(&time);
@@ -3809,6 +4358,9 @@ NTSTATUS STDCALL drv_create(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
         goto exit;
     }
     
+    if (top_level)
+        throttle_writes(Vcb);
+    
     ExAcquireResourceSharedLite(&Vcb->load_lock, TRUE);
     locked = TRUE;
     
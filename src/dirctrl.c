@@ -23,6 +23,49 @@ enum DirEntryType {
     DirEntryType_Parent
 };
 
+// must be a power of two
+#define ATTR_CACHE_ENTRIES 4096
+
+// how many inodes following one we've had to look up to cache from the same leaf
+#define ATTR_PREFETCH_INODES 32
+
+// most inodes a single directory query will queue for readahead
+#define READAHEAD_MAX_INODES 256
+
+// most readahead jobs outstanding on a volume at once
+#define READAHEAD_MAX_JOBS 4
+
+// most leaves to load for the items of any one inode
+#define READAHEAD_MAX_LEAVES 4
+
+// how many inodes to read ahead between dropping tree_lock
+#define READAHEAD_LOCK_INODES 16
+
+// longest literal part of a query expression we'll match ourselves
+#define QUERY_PATTERN_MAX_LEN 255
+
+enum QueryPatternType {
+    QueryPatternType_Complex,
+    QueryPatternType_Exact,
+    QueryPatternType_Prefix,
+    QueryPatternType_Suffix,
+    QueryPatternType_Contains
+};
+
+typedef struct {
+    device_extension* Vcb;
+    UINT64 subvol_id;
+    ULONG num_inodes;
+    UINT64 inodes[READAHEAD_MAX_INODES];
+    WORK_QUEUE_ITEM item;
+} readahead_job;
+
+typedef struct {
+    enum QueryPatternType type;
+    USHORT len;
+    char lit[QUERY_PATTERN_MAX_LEN];
+} query_pattern;
+
 typedef struct {
     KEY key;
     BOOL name_alloc;
@@ -87,41 +130,180 @@ end:
     return tag;
 }
 
-static ULONG get_ea_len(device_extension* Vcb, root* subvol, UINT64 inode, PIRP Irp) {
-    UINT8* eadata;
-    UINT16 len;
+static ULONG get_ea_len(UINT8* eadata, UINT16 len) {
+    ULONG offset;
+    NTSTATUS Status;
+    FILE_FULL_EA_INFORMATION* eainfo;
+    ULONG ealen;
+    
+    Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+    
+    if (!NT_SUCCESS(Status)) {
+        WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
+        return 0;
+    }
+    
+    ealen = 4;
+    eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
+    do {
+        ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
+        
+        if (eainfo->NextEntryOffset == 0)
+            break;
+        
+        eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
+    } while (TRUE);
+    
+    return ealen;
+}
+
+static __inline ULONG attr_cache_slot(root* subvol, UINT64 inode) {
+    return (ULONG)((inode ^ (subvol->id << 12)) & (ATTR_CACHE_ENTRIES - 1));
+}
+
+// Called when an fcb goes away, as the inode can only have changed while it was open.
+void invalidate_attr_cache(device_extension* Vcb, root* subvol, UINT64 inode) {
+    attr_cache_entry* ace;
+    
+    if (!Vcb->attr_cache)
+        return;
+    
+    ExAcquireResourceExclusiveLite(&Vcb->attr_cache_lock, TRUE);
     
-    if (get_xattr(Vcb, subvol, inode, EA_EA, EA_EA_HASH, &eadata, &len, Irp)) {
-        ULONG offset;
-        NTSTATUS Status;
+    ace = &Vcb->attr_cache[attr_cache_slot(subvol, inode)];
+    
+    if (ace->inode == inode && ace->subvol == subvol->id)
+        ace->inode = 0;
+    
+    ExReleaseResourceLite(&Vcb->attr_cache_lock);
+}
+
+// Entries are only added while tree_lock is held, so they can't be older than the tree.
+static void add_to_attr_cache(device_extension* Vcb, root* subvol, attr_cache_entry* ace) {
+    ExAcquireResourceExclusiveLite(&Vcb->attr_cache_lock, TRUE);
+    
+    if (!Vcb->attr_cache) {
+        Vcb->attr_cache = ExAllocatePoolWithTag(PagedPool, sizeof(attr_cache_entry) * ATTR_CACHE_ENTRIES, ALLOC_TAG);
         
-        Status = IoCheckEaBufferValidity((FILE_FULL_EA_INFORMATION*)eadata, len, &offset);
+        if (!Vcb->attr_cache) {
+            ERR("out of memory\n");
+            ExReleaseResourceLite(&Vcb->attr_cache_lock);
+            return;
+        }
         
-        if (!NT_SUCCESS(Status)) {
-            WARN("IoCheckEaBufferValidity returned %08x (error at offset %u)\n", Status, offset);
-            ExFreePool(eadata);
-            return 0;
-        } else {
-            FILE_FULL_EA_INFORMATION* eainfo;
-            ULONG ealen;
+        RtlZeroMemory(Vcb->attr_cache, sizeof(attr_cache_entry) * ATTR_CACHE_ENTRIES);
+    }
+    
+    RtlCopyMemory(&Vcb->attr_cache[attr_cache_slot(subvol, ace->inode)], ace, sizeof(attr_cache_entry));
+    
+    ExReleaseResourceLite(&Vcb->attr_cache_lock);
+}
+
+static void parse_attr_item(attr_cache_entry* ace, tree_data* item) {
+    UINT8* data;
+    UINT16 datalen;
+    
+    if (item->key.obj_type == TYPE_INODE_ITEM) {
+        RtlZeroMemory(&ace->inode_item, sizeof(INODE_ITEM));
+        
+        if (item->size > 0)
+            RtlCopyMemory(&ace->inode_item, item->data, min(sizeof(INODE_ITEM), item->size));
+    } else if (item->key.obj_type == TYPE_XATTR_ITEM && item->size >= sizeof(DIR_ITEM)) {
+        if (item->key.offset == EA_DOSATTRIB_HASH && extract_xattr(item->data, item->size, EA_DOSATTRIB, &data, &datalen)) {
+            ace->has_dosattrib = get_file_attributes_from_xattr((char*)data, datalen, &ace->dosattrib);
+            ExFreePool(data);
+        } else if (item->key.offset == EA_EA_HASH && extract_xattr(item->data, item->size, EA_EA, &data, &datalen)) {
+            ace->ealen = get_ea_len(data, datalen);
+            ExFreePool(data);
+        }
+    }
+}
+
+// The INODE_ITEM and xattrs of an inode are next to each other in the tree, so
+// we get them all with one search rather than one for each. Any inodes after it in
+// the same leaf are probably the next entries in the directory, so we cache them too.
+static NTSTATUS get_inode_attributes(device_extension* Vcb, root* subvol, UINT64 inode, attr_cache_entry* ace, PIRP Irp) {
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
+    attr_cache_entry cur;
+    BOOL first = TRUE;
+    ULONG prefetched = 0;
+    NTSTATUS Status;
+    
+    if (Vcb->attr_cache) {
+        BOOL found = FALSE;
+        
+        ExAcquireResourceSharedLite(&Vcb->attr_cache_lock, TRUE);
+        
+        cur = Vcb->attr_cache[attr_cache_slot(subvol, inode)];
+        if (cur.inode == inode && cur.subvol == subvol->id) {
+            *ace = cur;
+            found = TRUE;
+        }
+        
+        ExReleaseResourceLite(&Vcb->attr_cache_lock);
+        
+        if (found)
+            return STATUS_SUCCESS;
+    }
+    
+    searchkey.obj_id = inode;
+    searchkey.obj_type = TYPE_INODE_ITEM;
+    searchkey.offset = 0xffffffffffffffff;
+    
+    Status = find_item(Vcb, subvol, &tp, &searchkey, FALSE, Irp);
+    if (!NT_SUCCESS(Status)) {
+        ERR("error - find_item returned %08x\n", Status);
+        return Status;
+    }
+    
+    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
+        ERR("could not find inode item for inode %llx in root %llx\n", inode, subvol->id);
+        return STATUS_INTERNAL_ERROR;
+    }
+    
+    RtlZeroMemory(&cur, sizeof(attr_cache_entry));
+    cur.subvol = subvol->id;
+    cur.inode = inode;
+    
+    do {
+        if (tp.item->key.obj_id != cur.inode) {
+            if (first) {
+                *ace = cur;
+                first = FALSE;
+            }
             
-            ealen = 4;
-            eainfo = (FILE_FULL_EA_INFORMATION*)eadata;
-            do {
-                ealen += 5 + eainfo->EaNameLength + eainfo->EaValueLength;
-                
-                if (eainfo->NextEntryOffset == 0)
-                    break;
-                
-                eainfo = (FILE_FULL_EA_INFORMATION*)(((UINT8*)eainfo) + eainfo->NextEntryOffset);
-            } while (TRUE);
+            add_to_attr_cache(Vcb, subvol, &cur);
             
-            ExFreePool(eadata);
+            if (tp.item->key.obj_type != TYPE_INODE_ITEM || prefetched == ATTR_PREFETCH_INODES)
+                return STATUS_SUCCESS;
             
-            return ealen;
+            prefetched++;
+            
+            RtlZeroMemory(&cur, sizeof(attr_cache_entry));
+            cur.subvol = subvol->id;
+            cur.inode = tp.item->key.obj_id;
         }
-    } else
-        return 0;
+        
+        if (tp.item->key.obj_type <= TYPE_XATTR_ITEM)
+            parse_attr_item(&cur, tp.item);
+        
+        if (!find_next_item(Vcb, &tp, &next_tp, FALSE, Irp))
+            break;
+        
+        // don't go into another leaf just for the prefetch
+        if (!first && next_tp.tree != tp.tree)
+            return STATUS_SUCCESS;
+        
+        tp = next_tp;
+    } while (TRUE);
+    
+    if (first)
+        *ace = cur;
+    
+    add_to_attr_cache(Vcb, subvol, &cur);
+    
+    return STATUS_SUCCESS;
 }
 
 static NTSTATUS STDCALL query_dir_item(fcb* fcb, file_ref* fileref, void* buf, LONG* len, PIRP Irp, dir_entry* de, root* r) {
@@ -166,69 +348,42 @@ static NTSTATUS STDCALL query_dir_item(fcb* fcb, file_ref* fileref, void* buf, L
         switch (de->dir_entry_type) {
             case DirEntryType_File:
             {
-                LIST_ENTRY* le;
+                struct _fcb* fcb2;
                 BOOL found = FALSE;
                 
                 ExAcquireResourceSharedLite(&fcb->Vcb->fcb_lock, TRUE);
-                if (!IsListEmpty(&r->fcbs)) {
-                    le = r->fcbs.Flink;
-                    while (le != &r->fcbs) {
-                        struct _fcb* fcb2 = CONTAINING_RECORD(le, struct _fcb, list_entry);
-                        
-                        if (fcb2->inode == inode && !fcb2->ads) {
-                            ii = fcb2->inode_item;
-                            atts = fcb2->atts;
-                            ealen = fcb2->ealen;
-                            found = TRUE;
-                            break;
-                        } else if (fcb2->inode > inode)
-                            break;
-                        
-                        le = le->Flink;
-                    }
+                fcb2 = find_fcb_in_subvol(r, inode, NULL);
+                if (fcb2) {
+                    ii = fcb2->inode_item;
+                    atts = fcb2->atts;
+                    ealen = fcb2->ealen;
+                    found = TRUE;
                 }
                 ExReleaseResourceLite(&fcb->Vcb->fcb_lock);
                 
                 if (!found) {
-                    KEY searchkey;
-                    traverse_ptr tp;
+                    attr_cache_entry ace;
                     
-                    searchkey.obj_id = inode;
-                    searchkey.obj_type = TYPE_INODE_ITEM;
-                    searchkey.offset = 0xffffffffffffffff;
-                    
-                    Status = find_item(fcb->Vcb, r, &tp, &searchkey, FALSE, Irp);
+                    Status = get_inode_attributes(fcb->Vcb, r, inode, &ace, Irp);
                     if (!NT_SUCCESS(Status)) {
-                        ERR("error - find_item returned %08x\n", Status);
+                        ERR("get_inode_attributes returned %08x\n", Status);
                         return Status;
                     }
                     
-                    if (tp.item->key.obj_id != searchkey.obj_id || tp.item->key.obj_type != searchkey.obj_type) {
-                        ERR("could not find inode item for inode %llx in root %llx\n", inode, r->id);
-                        return STATUS_INTERNAL_ERROR;
-                    }
-                    
-                    RtlZeroMemory(&ii, sizeof(INODE_ITEM));
-                    
-                    if (tp.item->size > 0)
-                        RtlCopyMemory(&ii, tp.item->data, min(sizeof(INODE_ITEM), tp.item->size));
+                    ii = ace.inode_item;
+                    ealen = ace.ealen;
                     
-                    if (IrpSp->Parameters.QueryDirectory.FileInformationClass == FileBothDirectoryInformation ||
-                        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileDirectoryInformation ||
-                        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileFullDirectoryInformation ||
-                        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdBothDirectoryInformation || 
-                        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdFullDirectoryInformation) {
+                    if (ace.has_dosattrib) {
+                        atts = ace.dosattrib;
                         
+                        if (de->type == BTRFS_TYPE_DIRECTORY)
+                            atts |= FILE_ATTRIBUTE_DIRECTORY;
+                        else if (de->type == BTRFS_TYPE_SYMLINK)
+                            atts |= FILE_ATTRIBUTE_REPARSE_POINT;
+                    } else {
                         BOOL dotfile = de->namelen > 1 && de->name[0] == '.';
-
-                        atts = get_file_attributes(fcb->Vcb, &ii, r, inode, de->type, dotfile, FALSE, Irp);
-                    }
-                    
-                    if (IrpSp->Parameters.QueryDirectory.FileInformationClass == FileBothDirectoryInformation || 
-                        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileFullDirectoryInformation || 
-                        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdBothDirectoryInformation || 
-                        IrpSp->Parameters.QueryDirectory.FileInformationClass == FileIdFullDirectoryInformation) {
-                        ealen = get_ea_len(fcb->Vcb, r, inode, Irp);
+                        
+                        atts = get_file_attributes(fcb->Vcb, &ii, r, inode, de->type, dotfile, TRUE, Irp);
                     }
                 }
                 
@@ -519,9 +674,59 @@ static NTSTATUS STDCALL query_dir_item(fcb* fcb, file_ref* fileref, void* buf, L
     return STATUS_NO_MORE_FILES;
 }
 
-static NTSTATUS STDCALL next_dir_entry(file_ref* fileref, UINT64* offset, dir_entry* de, PIRP Irp) {
+// Position in a directory's DIR_INDEX items. tp is the first item at or after offset, unless end is set. As
+// it points into the tree cache it's only valid while tree_lock is held, so it only lasts for one query.
+typedef struct {
+    UINT64 offset;
+    BOOL valid;
+    BOOL end;
+    traverse_ptr tp;
+} dir_index_cursor;
+
+static NTSTATUS find_dir_index(file_ref* fileref, dir_index_cursor* dic, UINT64 offset, traverse_ptr* tp, BOOL* found, PIRP Irp) {
     KEY searchkey;
-    traverse_ptr tp, next_tp;
+    traverse_ptr next_tp;
+    NTSTATUS Status;
+    
+    searchkey.obj_id = fileref->fcb->inode;
+    searchkey.obj_type = TYPE_DIR_INDEX;
+    searchkey.offset = offset;
+    
+    if (!dic->valid || offset < dic->offset) {
+        Status = find_item(fileref->fcb->Vcb, fileref->fcb->subvol, &dic->tp, &searchkey, FALSE, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("error - find_item returned %08x\n", Status);
+            dic->valid = FALSE;
+            return Status;
+        }
+        
+        dic->valid = TRUE;
+        dic->end = FALSE;
+    }
+    
+    // walk forward from the last position, which is usually in the same leaf
+    while (!dic->end && keycmp(dic->tp.item->key, searchkey) == -1) {
+        if (find_next_item(fileref->fcb->Vcb, &dic->tp, &next_tp, FALSE, Irp))
+            dic->tp = next_tp;
+        else
+            dic->end = TRUE;
+    }
+    
+    if (!dic->end && (dic->tp.item->key.obj_id != searchkey.obj_id || dic->tp.item->key.obj_type != searchkey.obj_type))
+        dic->end = TRUE;
+    
+    dic->offset = offset;
+    
+    *found = !dic->end;
+    if (*found)
+        *tp = dic->tp;
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS STDCALL next_dir_entry(file_ref* fileref, ccb* ccb, dir_index_cursor* dic, UINT64* offset, dir_entry* de, PIRP Irp) {
+    traverse_ptr tp;
+    BOOL found;
     DIR_ITEM* di;
     NTSTATUS Status;
     file_ref* fr;
@@ -563,21 +768,39 @@ static NTSTATUS STDCALL next_dir_entry(file_ref* fileref, UINT64* offset, dir_en
     
     ExAcquireResourceSharedLite(&fileref->nonpaged->children_lock, TRUE);
     
-    fr = NULL;
-    le = fileref->children.Flink;
-    
-    // skip entries before offset
-    while (le != &fileref->children) {
-        file_ref* fr2 = CONTAINING_RECORD(le, file_ref, list_entry);
+    if (ccb->query_dir_child_valid && ccb->query_dir_children_gen == fileref->children_gen && *offset >= ccb->query_dir_child_offset) {
+        // no children have been added or removed since the last call, so carry on from where it left off
+        fr = ccb->query_dir_child;
         
-        if (fr2->index >= *offset) {
-            fr = fr2;
-            break;
-        }
+        while (fr && fr->index < *offset)
+            fr = fr->list_entry.Flink == &fileref->children ? NULL : CONTAINING_RECORD(fr->list_entry.Flink, file_ref, list_entry);
+    } else {
+        // try the index hash first, and don't bother walking the list if every child is before offset
+        fr = find_fileref_child_by_index(fileref, *offset);
         
-        le = le->Flink;
+        if (fr || IsListEmpty(&fileref->children) || CONTAINING_RECORD(fileref->children.Blink, file_ref, list_entry)->index < *offset)
+            le = &fileref->children;
+        else
+            le = fileref->children.Flink;
+        
+        // skip entries before offset
+        while (le != &fileref->children) {
+            file_ref* fr2 = CONTAINING_RECORD(le, file_ref, list_entry);
+            
+            if (fr2->index >= *offset) {
+                fr = fr2;
+                break;
+            }
+            
+            le = le->Flink;
+        }
     }
     
+    ccb->query_dir_child = fr;
+    ccb->query_dir_child_offset = *offset;
+    ccb->query_dir_children_gen = fileref->children_gen;
+    ccb->query_dir_child_valid = TRUE;
+    
     do {
         if (fr && fr->index == *offset) {
             if (!fr->deleted) {
@@ -607,22 +830,13 @@ static NTSTATUS STDCALL next_dir_entry(file_ref* fileref, UINT64* offset, dir_en
             }
         }
         
-        searchkey.obj_id = fileref->fcb->inode;
-        searchkey.obj_type = TYPE_DIR_INDEX;
-        searchkey.offset = *offset;
-        
-        Status = find_item(fileref->fcb->Vcb, fileref->fcb->subvol, &tp, &searchkey, FALSE, Irp);
+        Status = find_dir_index(fileref, dic, *offset, &tp, &found, Irp);
         if (!NT_SUCCESS(Status)) {
-            ERR("error - find_item returned %08x\n", Status);
+            ERR("find_dir_index returned %08x\n", Status);
             goto end;
         }
         
-        if (keycmp(tp.item->key, searchkey) == -1) {
-            if (find_next_item(fileref->fcb->Vcb, &tp, &next_tp, FALSE, Irp))
-                tp = next_tp;
-        }
-        
-        if (keycmp(tp.item->key, searchkey) != -1 && tp.item->key.obj_id == searchkey.obj_id && tp.item->key.obj_type == searchkey.obj_type) {
+        if (found) {
             do {
                 if (fr) {
                     if (fr->index <= tp.item->key.offset && !fr->deleted) {
@@ -725,6 +939,286 @@ end:
     return Status;
 }
 
+// Loads the leaves holding an inode's items, so that opening it afterwards doesn't have to go to disk.
+// They stay loaded until the next commit - the flush thread keeps the tree cache when it has nothing
+// to write, and we stop reading ahead before the cache is big enough for it to be thrown away.
+static void readahead_inode(device_extension* Vcb, root* r, UINT64 inode) {
+    KEY searchkey;
+    traverse_ptr tp, next_tp;
+    tree* t;
+    ULONG leaves = 1;
+    NTSTATUS Status;
+    
+    searchkey.obj_id = inode;
+    searchkey.obj_type = TYPE_INODE_ITEM;
+    searchkey.offset = 0;
+    
+    Status = find_item(Vcb, r, &tp, &searchkey, FALSE, NULL);
+    if (!NT_SUCCESS(Status)) {
+        WARN("find_item returned %08x\n", Status);
+        return;
+    }
+    
+    t = tp.tree;
+    
+    while (tp.item->key.obj_id <= inode && find_next_item(Vcb, &tp, &next_tp, FALSE, NULL)) {
+        tp = next_tp;
+        
+        if (tp.tree != t) {
+            t = tp.tree;
+            leaves++;
+            
+            if (leaves > READAHEAD_MAX_LEAVES)
+                break;
+        }
+    }
+}
+
+static void readahead_worker(void* context) {
+    readahead_job* ra = context;
+    device_extension* Vcb = ra->Vcb;
+    ULONG i = 0;
+    
+    FsRtlEnterFileSystem();
+    
+    while (i < ra->num_inodes && !Vcb->removing && Vcb->open_trees < IDLE_TREE_CACHE_LIMIT) {
+        ULONG end = min(i + READAHEAD_LOCK_INODES, ra->num_inodes);
+        root* r = NULL;
+        LIST_ENTRY* le;
+        
+        // drop tree_lock every so often, so we don't hold up the flush thread
+        ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+        
+        le = Vcb->roots.Flink;
+        while (le != &Vcb->roots) {
+            root* r2 = CONTAINING_RECORD(le, root, list_entry);
+            
+            if (r2->id == ra->subvol_id) {
+                r = r2;
+                break;
+            }
+            
+            le = le->Flink;
+        }
+        
+        if (!r) {
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            break;
+        }
+        
+        for (; i < end; i++) {
+            readahead_inode(Vcb, r, ra->inodes[i]);
+        }
+        
+        ExReleaseResourceLite(&Vcb->tree_lock);
+    }
+    
+    InterlockedExchangeAdd64((LONG64*)&Vcb->lookup_stats.readahead_inodes, i);
+    
+    FsRtlExitFileSystem();
+    
+    InterlockedDecrement(&Vcb->readahead_jobs);
+    ExReleaseRundownProtection(&Vcb->readahead_rundown);
+    
+    ExFreePool(ra);
+}
+
+static readahead_job* alloc_readahead_job(fcb* fcb) {
+    readahead_job* ra;
+    
+    if (fcb->Vcb->readahead_jobs >= READAHEAD_MAX_JOBS || fcb->Vcb->open_trees >= IDLE_TREE_CACHE_LIMIT) {
+        InterlockedIncrement64((LONG64*)&fcb->Vcb->lookup_stats.readahead_skipped);
+        return NULL;
+    }
+    
+    ra = ExAllocatePoolWithTag(NonPagedPool, sizeof(readahead_job), ALLOC_TAG);
+    if (!ra) {
+        ERR("out of memory\n");
+        return NULL;
+    }
+    
+    ra->Vcb = fcb->Vcb;
+    ra->subvol_id = fcb->subvol->id;
+    ra->num_inodes = 0;
+    
+    return ra;
+}
+
+static __inline void add_readahead_inode(readahead_job* ra, dir_entry* de) {
+    // subvolumes' root directories are in other trees, and aren't worth the bother
+    if (de->dir_entry_type == DirEntryType_File && de->key.obj_type == TYPE_INODE_ITEM && ra->num_inodes < READAHEAD_MAX_INODES)
+        ra->inodes[ra->num_inodes++] = de->key.obj_id;
+}
+
+// Entries are usually returned in roughly inode order, so sort them and hand them to a worker thread.
+static void queue_readahead_job(readahead_job* ra) {
+    ULONG i, j;
+    
+    if (ra->num_inodes == 0 || !ExAcquireRundownProtection(&ra->Vcb->readahead_rundown)) {
+        ExFreePool(ra);
+        return;
+    }
+    
+    for (i = 1; i < ra->num_inodes; i++) {
+        UINT64 inode = ra->inodes[i];
+        
+        for (j = i; j > 0 && ra->inodes[j - 1] > inode; j--) {
+            ra->inodes[j] = ra->inodes[j - 1];
+        }
+        
+        ra->inodes[j] = inode;
+    }
+    
+    InterlockedIncrement(&ra->Vcb->readahead_jobs);
+    InterlockedIncrement64((LONG64*)&ra->Vcb->lookup_stats.readahead_jobs);
+    
+    ExInitializeWorkItem(&ra->item, readahead_worker, ra);
+    ExQueueWorkItem(&ra->item, DelayedWorkQueue);
+}
+
+// Recognizes expressions which are ASCII characters and ?s with an optional * at either end, which we can
+// match against the UTF-8 names directly. Anything else is left to FsRtlIsNameInExpression.
+static void compile_query_pattern(PUNICODE_STRING expr, query_pattern* qp) {
+    ULONG i, start = 0, end = expr->Length / sizeof(WCHAR);
+    BOOL star_start = FALSE, star_end = FALSE;
+    
+    qp->type = QueryPatternType_Complex;
+    
+    if (end > 0 && expr->Buffer[0] == '*') {
+        star_start = TRUE;
+        start = 1;
+    }
+    
+    if (end > start && expr->Buffer[end - 1] == '*') {
+        star_end = TRUE;
+        end--;
+    }
+    
+    if (end - start > QUERY_PATTERN_MAX_LEN)
+        return;
+    
+    for (i = start; i < end; i++) {
+        WCHAR c = expr->Buffer[i];
+        
+        if (c >= 0x80 || c == '*' || c == DOS_STAR || c == DOS_QM || c == DOS_DOT)
+            return;
+        
+        qp->lit[i - start] = (char)c;
+    }
+    
+    qp->len = (USHORT)(end - start);
+    
+    if (star_start && star_end)
+        qp->type = QueryPatternType_Contains;
+    else if (star_start)
+        qp->type = QueryPatternType_Suffix;
+    else if (star_end)
+        qp->type = QueryPatternType_Prefix;
+    else
+        qp->type = QueryPatternType_Exact;
+}
+
+static __inline BOOL query_pattern_matches_at(query_pattern* qp, char* name, BOOL ignore_case) {
+    USHORT i;
+    
+    for (i = 0; i < qp->len; i++) {
+        char c = name[i];
+        
+        // the expression has already been upcased
+        if (ignore_case && c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        
+        if (qp->lit[i] != '?' && qp->lit[i] != c)
+            return FALSE;
+    }
+    
+    return TRUE;
+}
+
+// Returns FALSE if the pattern or name can't be handled here, i.e. it's complex or the name isn't ASCII.
+static BOOL match_query_pattern(query_pattern* qp, char* name, ULONG namelen, BOOL ignore_case, BOOL* matches) {
+    ULONG i;
+    
+    if (qp->type == QueryPatternType_Complex)
+        return FALSE;
+    
+    for (i = 0; i < namelen; i++) {
+        if ((UINT8)name[i] >= 0x80)
+            return FALSE;
+    }
+    
+    *matches = FALSE;
+    
+    if (namelen < qp->len)
+        return TRUE;
+    
+    switch (qp->type) {
+        case QueryPatternType_Exact:
+            *matches = namelen == qp->len && query_pattern_matches_at(qp, name, ignore_case);
+            break;
+        
+        case QueryPatternType_Prefix:
+            *matches = query_pattern_matches_at(qp, name, ignore_case);
+            break;
+        
+        case QueryPatternType_Suffix:
+            *matches = query_pattern_matches_at(qp, name + namelen - qp->len, ignore_case);
+            break;
+        
+        case QueryPatternType_Contains:
+            for (i = 0; i <= namelen - qp->len; i++) {
+                if (query_pattern_matches_at(qp, name + i, ignore_case)) {
+                    *matches = TRUE;
+                    break;
+                }
+            }
+            break;
+        
+        default:
+            return FALSE;
+    }
+    
+    return TRUE;
+}
+
+static NTSTATUS match_dir_entry(ccb* ccb, query_pattern* qp, dir_entry* de, BOOL* matches) {
+    NTSTATUS Status;
+    WCHAR* uni_fn;
+    ULONG stringlen;
+    UNICODE_STRING di_uni_fn;
+    
+    if (match_query_pattern(qp, de->name, de->namelen, !ccb->case_sensitive, matches))
+        return STATUS_SUCCESS;
+    
+    Status = RtlUTF8ToUnicodeN(NULL, 0, &stringlen, de->name, de->namelen);
+    if (!NT_SUCCESS(Status)) {
+        ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
+        return Status;
+    }
+    
+    uni_fn = ExAllocatePoolWithTag(PagedPool, stringlen, ALLOC_TAG);
+    if (!uni_fn) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    Status = RtlUTF8ToUnicodeN(uni_fn, stringlen, &stringlen, de->name, de->namelen);
+    if (!NT_SUCCESS(Status)) {
+        ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
+        ExFreePool(uni_fn);
+        return Status;
+    }
+    
+    di_uni_fn.Length = di_uni_fn.MaximumLength = stringlen;
+    di_uni_fn.Buffer = uni_fn;
+    
+    *matches = FsRtlIsNameInExpression(&ccb->query_string, &di_uni_fn, !ccb->case_sensitive, NULL);
+    
+    ExFreePool(uni_fn);
+    
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     PIO_STACK_LOCATION IrpSp;
     NTSTATUS Status, status2;
@@ -738,6 +1232,9 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     BOOL has_wildcard = FALSE, specific_file = FALSE, initial;
 //     UINT64 num_reads_orig;
     dir_entry de;
+    dir_index_cursor dic;
+    query_pattern qp;
+    readahead_job* ra = NULL;
     UINT64 newoffset;
     ANSI_STRING utf8;
     
@@ -769,6 +1266,8 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     
     ExAcquireResourceSharedLite(&fcb->Vcb->tree_lock, TRUE);
     
+    dic.valid = FALSE;
+    
     TRACE("%S\n", file_desc(IrpSp->FileObject));
     
     if (IrpSp->Flags == 0) {
@@ -811,7 +1310,8 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
     if (IrpSp->Parameters.QueryDirectory.FileName && IrpSp->Parameters.QueryDirectory.FileName->Length > 1) {
         TRACE("QD filename: %.*S\n", IrpSp->Parameters.QueryDirectory.FileName->Length / sizeof(WCHAR), IrpSp->Parameters.QueryDirectory.FileName->Buffer);
         
-        if (IrpSp->Parameters.QueryDirectory.FileName->Buffer[0] != '*') {
+        // a lone * matches everything, so there's nothing to filter
+        if (IrpSp->Parameters.QueryDirectory.FileName->Length != sizeof(WCHAR) || IrpSp->Parameters.QueryDirectory.FileName->Buffer[0] != '*') {
             specific_file = TRUE;
             if (!ccb->case_sensitive || FsRtlDoesNameContainWildCards(IrpSp->Parameters.QueryDirectory.FileName)) {
                 has_wildcard = TRUE;
@@ -856,8 +1356,11 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
         TRACE("query string = %.*S\n", ccb->query_string.Length / sizeof(WCHAR), ccb->query_string.Buffer);
     }
     
+    if (has_wildcard)
+        compile_query_pattern(&ccb->query_string, &qp);
+    
     newoffset = ccb->query_dir_offset;
-    Status = next_dir_entry(fileref, &newoffset, &de, Irp);
+    Status = next_dir_entry(fileref, ccb, &dic, &newoffset, &de, Irp);
     
     if (!NT_SUCCESS(Status)) {
         if (Status == STATUS_NO_MORE_FILES && initial)
@@ -970,76 +1473,34 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
             de.dir_entry_type = DirEntryType_File;
         }
     } else if (has_wildcard) {
-        WCHAR* uni_fn;
-        ULONG stringlen;
-        UNICODE_STRING di_uni_fn;
-        
-        Status = RtlUTF8ToUnicodeN(NULL, 0, &stringlen, de.name, de.namelen);
-        if (!NT_SUCCESS(Status)) {
-            ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
-            goto end;
-        }
-        
-        uni_fn = ExAllocatePoolWithTag(PagedPool, stringlen, ALLOC_TAG);
-        if (!uni_fn) {
-            ERR("out of memory\n");
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            goto end;
-        }
+        BOOL matches;
         
-        Status = RtlUTF8ToUnicodeN(uni_fn, stringlen, &stringlen, de.name, de.namelen);
-        
-        if (!NT_SUCCESS(Status)) {
-            ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
-            goto end;
-        }
-        
-        di_uni_fn.Length = di_uni_fn.MaximumLength = stringlen;
-        di_uni_fn.Buffer = uni_fn;
-        
-        while (!FsRtlIsNameInExpression(&ccb->query_string, &di_uni_fn, !ccb->case_sensitive, NULL)) {
+        do {
+            Status = match_dir_entry(ccb, &qp, &de, &matches);
+            if (!NT_SUCCESS(Status)) {
+                ERR("match_dir_entry returned %08x\n", Status);
+                if (de.name_alloc) ExFreePool(de.name);
+                goto end;
+            }
+            
+            if (matches)
+                break;
+            
             if (de.name_alloc)
                 ExFreePool(de.name);
             
             newoffset = ccb->query_dir_offset;
-            Status = next_dir_entry(fileref, &newoffset, &de, Irp);
+            Status = next_dir_entry(fileref, ccb, &dic, &newoffset, &de, Irp);
             
-            ExFreePool(uni_fn);
-            if (NT_SUCCESS(Status)) {
-                ccb->query_dir_offset = newoffset;
-                
-                Status = RtlUTF8ToUnicodeN(NULL, 0, &stringlen, de.name, de.namelen);
-                if (!NT_SUCCESS(Status)) {
-                    ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
-                    goto end;
-                }
-                
-                uni_fn = ExAllocatePoolWithTag(PagedPool, stringlen, ALLOC_TAG);
-                if (!uni_fn) {
-                    ERR("out of memory\n");
-                    Status = STATUS_INSUFFICIENT_RESOURCES;
-                    goto end;
-                }
-                
-                Status = RtlUTF8ToUnicodeN(uni_fn, stringlen, &stringlen, de.name, de.namelen);
-                
-                if (!NT_SUCCESS(Status)) {
-                    ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
-                    ExFreePool(uni_fn);
-                    goto end;
-                }
-                
-                di_uni_fn.Length = di_uni_fn.MaximumLength = stringlen;
-                di_uni_fn.Buffer = uni_fn;
-            } else {
+            if (!NT_SUCCESS(Status)) {
                 if (Status == STATUS_NO_MORE_FILES && initial)
                     Status = STATUS_NO_SUCH_FILE;
                 
                 goto end;
             }
-        }
-        
-        ExFreePool(uni_fn);
+            
+            ccb->query_dir_offset = newoffset;
+        } while (TRUE);
     }
     
     TRACE("file(0) = %.*s\n", de.namelen, de.name);
@@ -1047,6 +1508,14 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
 
     Status = query_dir_item(fcb, fileref, buf, &length, Irp, &de, fcb->subvol);
     
+    // Whatever's being listed is likely to be opened next, so read ahead the inodes' items.
+    if (NT_SUCCESS(Status) && !specific_file) {
+        ra = alloc_readahead_job(fcb);
+        
+        if (ra)
+            add_readahead_inode(ra, &de);
+    }
+    
     if (de.name_alloc)
         ExFreePool(de.name);
     
@@ -1074,44 +1543,21 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
             }
             
             if (length > 0) {
-                WCHAR* uni_fn = NULL;
-                UNICODE_STRING di_uni_fn;
+                BOOL matches = TRUE;
                 
                 newoffset = ccb->query_dir_offset;
-                Status = next_dir_entry(fileref, &newoffset, &de, Irp);
+                Status = next_dir_entry(fileref, ccb, &dic, &newoffset, &de, Irp);
                 if (NT_SUCCESS(Status)) {
                     if (has_wildcard) {
-                        ULONG stringlen;
-                        
-                        Status = RtlUTF8ToUnicodeN(NULL, 0, &stringlen, de.name, de.namelen);
-                        if (!NT_SUCCESS(Status)) {
-                            ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
-                            if (de.name_alloc) ExFreePool(de.name);
-                            goto end;
-                        }
-                        
-                        uni_fn = ExAllocatePoolWithTag(PagedPool, stringlen, ALLOC_TAG);
-                        if (!uni_fn) {
-                            ERR("out of memory\n");
-                            Status = STATUS_INSUFFICIENT_RESOURCES;
-                            if (de.name_alloc) ExFreePool(de.name);
-                            goto end;
-                        }
-                        
-                        Status = RtlUTF8ToUnicodeN(uni_fn, stringlen, &stringlen, de.name, de.namelen);
-                        
+                        Status = match_dir_entry(ccb, &qp, &de, &matches);
                         if (!NT_SUCCESS(Status)) {
-                            ERR("RtlUTF8ToUnicodeN returned %08x\n", Status);
-                            ExFreePool(uni_fn);
+                            ERR("match_dir_entry returned %08x\n", Status);
                             if (de.name_alloc) ExFreePool(de.name);
                             goto end;
                         }
-                        
-                        di_uni_fn.Length = di_uni_fn.MaximumLength = stringlen;
-                        di_uni_fn.Buffer = uni_fn;
                     }
                     
-                    if (!has_wildcard || FsRtlIsNameInExpression(&ccb->query_string, &di_uni_fn, !ccb->case_sensitive, NULL)) {
+                    if (matches) {
                         curitem = (UINT8*)buf + IrpSp->Parameters.QueryDirectory.Length - length;
                         count++;
                         
@@ -1123,23 +1569,20 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
                         if (NT_SUCCESS(status2)) {
                             ULONG* lastoffset = (ULONG*)lastitem;
                             
+                            if (ra)
+                                add_readahead_inode(ra, &de);
+                            
                             *lastoffset = (ULONG)(curitem - lastitem);
                             ccb->query_dir_offset = newoffset;
                             
                             lastitem = curitem;
                         } else {
-                            if (uni_fn) ExFreePool(uni_fn);
                             if (de.name_alloc) ExFreePool(de.name);
                             break;
                         }
                     } else
                         ccb->query_dir_offset = newoffset;
                     
-                    if (uni_fn) {
-                        ExFreePool(uni_fn);
-                        uni_fn = NULL;
-                    }
-                    
                     if (de.name_alloc)
                         ExFreePool(de.name);
                 } else {
@@ -1158,6 +1601,9 @@ static NTSTATUS STDCALL query_directory(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
 end:
     ExReleaseResourceLite(&fcb->Vcb->tree_lock);
     
+    if (ra)
+        queue_readahead_job(ra);
+    
     TRACE("returning %08x\n", Status);
     
     if (utf8.Buffer)
@@ -0,0 +1,454 @@
+/* Copyright (c) Mark Harmstone 2016
+ * 
+ * This file is part of WinBtrfs.
+ * 
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ * 
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "btrfs_drv.h"
+#include <ntddstor.h>
+
+#define DISCARD_MIN_LENGTH 0x8000 // 32 KB
+#define DISCARD_BATCH_RANGES 256
+#define DISCARD_BATCH_DELAY 100 // milliseconds
+
+typedef struct {
+    DEVICE_MANAGE_DATA_SET_ATTRIBUTES* dmdsa;
+    DEVICE_DATA_SET_RANGE* ranges;
+    ULONG num_ranges;
+} trim_batch;
+
+typedef struct {
+    chunk* c;
+    UINT64 address;
+    UINT64 length;
+    LIST_ENTRY list_entry;
+} discard_range;
+
+static void issue_trim(device* dev, trim_batch* tb) {
+    NTSTATUS Status;
+    
+    if (tb->num_ranges == 0)
+        return;
+    
+    tb->dmdsa->DataSetRangesLength = tb->num_ranges * sizeof(DEVICE_DATA_SET_RANGE);
+    
+    Status = dev_ioctl(dev->devobj, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, tb->dmdsa, tb->dmdsa->DataSetRangesOffset + tb->dmdsa->DataSetRangesLength,
+                       NULL, 0, TRUE, NULL);
+    if (!NT_SUCCESS(Status))
+        WARN("IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES returned %08x\n", Status);
+    
+    tb->num_ranges = 0;
+}
+
+static void add_trim_range(device_extension* Vcb, trim_batch* tbs, device* dev, UINT64 address, UINT64 length) {
+    trim_batch* tb;
+    
+    if (!dev || !dev->devobj || !dev->trim || dev->readonly)
+        return;
+    
+    tb = &tbs[dev - Vcb->devices];
+    
+    if (tb->num_ranges > 0) {
+        DEVICE_DATA_SET_RANGE* last = &tb->ranges[tb->num_ranges - 1];
+        
+        if ((UINT64)last->StartingOffset + last->LengthInBytes == address) {
+            last->LengthInBytes += length;
+            return;
+        }
+    }
+    
+    if (tb->num_ranges == DISCARD_BATCH_RANGES)
+        issue_trim(dev, tb);
+    
+    tb->ranges[tb->num_ranges].StartingOffset = address;
+    tb->ranges[tb->num_ranges].LengthInBytes = length;
+    tb->num_ranges++;
+}
+
+static void flush_trim_batches(device_extension* Vcb, trim_batch* tbs) {
+    UINT64 i;
+    
+    for (i = 0; i < Vcb->superblock.num_devices; i++) {
+        issue_trim(&Vcb->devices[i], &tbs[i]);
+    }
+}
+
+static void add_discard_range(chunk* c, UINT64 address, UINT64 length, LIST_ENTRY* ranges) {
+    discard_range* dr = ExAllocatePoolWithTag(PagedPool, sizeof(discard_range), ALLOC_TAG);
+    
+    if (!dr) {
+        ERR("out of memory\n");
+        return;
+    }
+    
+    dr->c = c;
+    dr->address = address;
+    dr->length = length;
+    InsertTailList(ranges, &dr->list_entry);
+}
+
+static void discard_logical(device_extension* Vcb, trim_batch* tbs, chunk* c, UINT64 address, UINT64 length) {
+    CHUNK_ITEM* ci = c->chunk_item;
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&ci[1];
+    UINT64 off = address - c->offset;
+    UINT16 i;
+    
+    if (ci->type & BLOCK_FLAG_RAID0 || ci->type & BLOCK_FLAG_RAID10) {
+        UINT16 sub_stripes = ci->type & BLOCK_FLAG_RAID10 ? max(ci->sub_stripes, 1) : 1;
+        UINT64 end = off + length;
+        
+        while (off < end) {
+            UINT64 stripeoff, len;
+            UINT16 stripe;
+            
+            len = min(end - off, ci->stripe_length - (off % ci->stripe_length));
+            
+            get_raid0_offset(off, ci->stripe_length, ci->num_stripes / sub_stripes, &stripeoff, &stripe);
+            
+            for (i = 0; i < sub_stripes; i++) {
+                add_trim_range(Vcb, tbs, c->devices[(stripe * sub_stripes) + i], cis[(stripe * sub_stripes) + i].offset + stripeoff, len);
+            }
+            
+            off += len;
+        }
+    } else {
+        for (i = 0; i < ci->num_stripes; i++) {
+            add_trim_range(Vcb, tbs, c->devices[i], cis[i].offset + off, length);
+        }
+    }
+}
+
+// Finds the parts of the range which are still free and worth trimming, and takes them out of c->space
+// so that nothing can be allocated there while we're trimming. The caller has to hold c->lock exclusively.
+static void reserve_chunk_range(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length, LIST_ENTRY* ranges) {
+    LIST_ENTRY *le, *first = ranges->Blink;
+    
+    // Space freed by a commit only gets into c->space once the superblocks no longer refer to it,
+    // so anything there is free in the committed trees as well.
+    
+    if (c->space_bitmap_buf) {
+        UINT64 start = address, size;
+        
+        while (start < address + length && find_space_bitmap_run(Vcb, c, start, &start, &size) && start < address + length) {
+            UINT64 end = min(start + size, address + length);
+            
+            if (end - start >= DISCARD_MIN_LENGTH)
+                add_discard_range(c, start, end - start, ranges);
+            
+            start = end;
+        }
+    } else {
+        le = c->space.Flink;
+        while (le != &c->space) {
+            space* s = CONTAINING_RECORD(le, space, list_entry);
+            
+            if (s->address >= address + length)
+                break;
+            
+            if (s->address + s->size > address) {
+                UINT64 start = max(s->address, address);
+                UINT64 end = min(s->address + s->size, address + length);
+                
+                if (end - start >= DISCARD_MIN_LENGTH)
+                    add_discard_range(c, start, end - start, ranges);
+            }
+            
+            le = le->Flink;
+        }
+    }
+    
+    le = first->Flink;
+    while (le != ranges) {
+        discard_range* dr = CONTAINING_RECORD(le, discard_range, list_entry);
+        
+        space_list_subtract(Vcb, c, FALSE, dr->address, dr->length, NULL);
+        c->discarding++;
+        
+        le = le->Flink;
+    }
+}
+
+static void discard_batch(device_extension* Vcb, trim_batch* tbs) {
+    LIST_ENTRY batch, ranges, *le;
+    ULONG num_entries = 0;
+    chunk* locked = NULL;
+    
+    InitializeListHead(&batch);
+    InitializeListHead(&ranges);
+    
+    ExAcquireResourceExclusiveLite(&Vcb->discard.lock, TRUE);
+    
+    while (!IsListEmpty(&Vcb->discard.queue) && num_entries < DISCARD_BATCH_RANGES) {
+        InsertTailList(&batch, RemoveHeadList(&Vcb->discard.queue));
+        num_entries++;
+    }
+    
+    ExReleaseResourceLite(&Vcb->discard.lock);
+    
+    if (IsListEmpty(&batch))
+        return;
+    
+    // The locks are only held while we work out what to trim, not while the device does it. Holding
+    // tree_lock shared keeps commits out while we change c->space and chunks_changed, and any chunk
+    // with space taken out for trimming isn't dropped until it's been given back.
+    
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+    
+    while (!IsListEmpty(&batch)) {
+        space* s = CONTAINING_RECORD(RemoveHeadList(&batch), space, list_entry);
+        UINT64 addr = s->address;
+        
+        while (addr < s->address + s->size) {
+            chunk* c = get_chunk_from_address(Vcb, addr);
+            UINT64 chunk_end;
+            
+            if (!c)
+                break;
+            
+            chunk_end = c->offset + c->chunk_item->size;
+            
+            if (c != locked) {
+                if (locked)
+                    ExReleaseResourceLite(&locked->lock);
+                
+                ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+                locked = c;
+            }
+            
+            // FIXME - RAID5 and RAID6 would need the parity stripes updating too
+            if (!(c->chunk_item->type & BLOCK_FLAG_RAID5) && !(c->chunk_item->type & BLOCK_FLAG_RAID6))
+                reserve_chunk_range(Vcb, c, addr, min(s->address + s->size, chunk_end) - addr, &ranges);
+            
+            addr = chunk_end;
+        }
+        
+        ExFreePool(s);
+    }
+    
+    if (locked)
+        ExReleaseResourceLite(&locked->lock);
+    
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+    ExReleaseResourceLite(&Vcb->tree_lock);
+    
+    if (IsListEmpty(&ranges))
+        return;
+    
+    le = ranges.Flink;
+    while (le != &ranges) {
+        discard_range* dr = CONTAINING_RECORD(le, discard_range, list_entry);
+        
+        discard_logical(Vcb, tbs, dr->c, dr->address, dr->length);
+        
+        le = le->Flink;
+    }
+    
+    flush_trim_batches(Vcb, tbs);
+    
+    // give the space back
+    
+    ExAcquireResourceSharedLite(&Vcb->tree_lock, TRUE);
+    
+    while (!IsListEmpty(&ranges)) {
+        discard_range* dr = CONTAINING_RECORD(RemoveHeadList(&ranges), discard_range, list_entry);
+        
+        ExAcquireResourceExclusiveLite(&dr->c->lock, TRUE);
+        space_list_add(Vcb, dr->c, FALSE, dr->address, dr->length, NULL);
+        dr->c->discarding--;
+        ExReleaseResourceLite(&dr->c->lock);
+        
+        ExFreePool(dr);
+    }
+    
+    ExReleaseResourceLite(&Vcb->tree_lock);
+}
+
+static void trim_unallocated(device_extension* Vcb, trim_batch* tbs) {
+    UINT64 i;
+    
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+    
+    for (i = 0; i < Vcb->devices_loaded; i++) {
+        device* dev = &Vcb->devices[i];
+        LIST_ENTRY* le;
+        
+        if (!dev->devobj || !dev->trim || dev->readonly)
+            continue;
+        
+        le = dev->space.Flink;
+        while (le != &dev->space) {
+            space* s = CONTAINING_RECORD(le, space, list_entry);
+            UINT64 addr = s->address;
+            int j;
+            
+            // skip over the backup superblocks
+            
+            for (j = 0; superblock_addrs[j] != 0; j++) {
+                if (superblock_addrs[j] >= s->address + s->size)
+                    break;
+                
+                if (superblock_addrs[j] + sizeof(superblock) <= addr)
+                    continue;
+                
+                if (superblock_addrs[j] > addr)
+                    add_trim_range(Vcb, tbs, dev, addr, superblock_addrs[j] - addr);
+                
+                addr = superblock_addrs[j] + sizeof(superblock);
+            }
+            
+            if (addr < s->address + s->size)
+                add_trim_range(Vcb, tbs, dev, addr, s->address + s->size - addr);
+            
+            le = le->Flink;
+        }
+        
+        issue_trim(dev, &tbs[i]);
+    }
+    
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+}
+
+static void discard_thread(void* context) {
+    device_extension* Vcb = context;
+    trim_batch* tbs;
+    UINT8* buf;
+    ULONG offset, bufsize;
+    UINT64 i;
+    LARGE_INTEGER delay;
+    
+    offset = (ULONG)sector_align(sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES), sizeof(UINT64));
+    bufsize = offset + (DISCARD_BATCH_RANGES * sizeof(DEVICE_DATA_SET_RANGE));
+    
+    tbs = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.num_devices * sizeof(trim_batch), ALLOC_TAG);
+    if (!tbs) {
+        ERR("out of memory\n");
+        goto end;
+    }
+    
+    buf = ExAllocatePoolWithTag(PagedPool, Vcb->superblock.num_devices * bufsize, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        ExFreePool(tbs);
+        goto end;
+    }
+    
+    RtlZeroMemory(buf, Vcb->superblock.num_devices * bufsize);
+    
+    for (i = 0; i < Vcb->superblock.num_devices; i++) {
+        tbs[i].dmdsa = (DEVICE_MANAGE_DATA_SET_ATTRIBUTES*)(buf + (i * bufsize));
+        tbs[i].dmdsa->Size = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES);
+        tbs[i].dmdsa->Action = DeviceDsmAction_Trim;
+        tbs[i].dmdsa->Flags = 0;
+        tbs[i].dmdsa->ParameterBlockOffset = 0;
+        tbs[i].dmdsa->ParameterBlockLength = 0;
+        tbs[i].dmdsa->DataSetRangesOffset = offset;
+        tbs[i].ranges = (DEVICE_DATA_SET_RANGE*)((UINT8*)tbs[i].dmdsa + offset);
+        tbs[i].num_ranges = 0;
+    }
+    
+    if (Vcb->options.trim_on_mount) {
+        FsRtlEnterFileSystem();
+        trim_unallocated(Vcb, tbs);
+        FsRtlExitFileSystem();
+    }
+    
+    delay.QuadPart = DISCARD_BATCH_DELAY * -10000;
+    
+    while (!Vcb->discard.quit) {
+        BOOL empty;
+        
+        ExAcquireResourceSharedLite(&Vcb->discard.lock, TRUE);
+        empty = IsListEmpty(&Vcb->discard.queue);
+        ExReleaseResourceLite(&Vcb->discard.lock);
+        
+        // wait for the next commit if there's nothing to do, otherwise pause between batches
+        if (empty)
+            KeWaitForSingleObject(&Vcb->discard.event, Executive, KernelMode, FALSE, NULL);
+        else
+            KeDelayExecutionThread(KernelMode, FALSE, &delay);
+        
+        if (Vcb->discard.quit)
+            break;
+        
+        FsRtlEnterFileSystem();
+        discard_batch(Vcb, tbs);
+        FsRtlExitFileSystem();
+    }
+    
+    ExFreePool(buf);
+    ExFreePool(tbs);
+
+end:
+    KeSetEvent(&Vcb->discard.finished, 0, FALSE);
+    
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+void start_discard_thread(device_extension* Vcb) {
+    NTSTATUS Status;
+    
+    KeInitializeEvent(&Vcb->discard.event, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&Vcb->discard.finished, NotificationEvent, FALSE);
+    ExInitializeResourceLite(&Vcb->discard.lock);
+    InitializeListHead(&Vcb->discard.queue);
+    Vcb->discard.quit = FALSE;
+    Vcb->discard.thread = NULL;
+    
+    if (!Vcb->trim || Vcb->options.no_trim || Vcb->readonly)
+        return;
+    
+    Status = PsCreateSystemThread(&Vcb->discard.thread, 0, NULL, NULL, NULL, discard_thread, Vcb);
+    if (!NT_SUCCESS(Status)) {
+        WARN("PsCreateSystemThread returned %08x\n", Status);
+        Vcb->discard.thread = NULL;
+    }
+}
+
+void stop_discard_thread(device_extension* Vcb) {
+    if (Vcb->discard.thread) {
+        Vcb->discard.quit = TRUE;
+        KeSetEvent(&Vcb->discard.event, 0, FALSE);
+        KeWaitForSingleObject(&Vcb->discard.finished, Executive, KernelMode, FALSE, NULL);
+        
+        ZwClose(Vcb->discard.thread);
+        Vcb->discard.thread = NULL;
+    }
+    
+    while (!IsListEmpty(&Vcb->discard.queue)) {
+        space* s = CONTAINING_RECORD(RemoveHeadList(&Vcb->discard.queue), space, list_entry);
+        
+        ExFreePool(s);
+    }
+    
+    ExDeleteResourceLite(&Vcb->discard.lock);
+}
+
+void queue_discard(device_extension* Vcb, LIST_ENTRY* list) {
+    ExAcquireResourceExclusiveLite(&Vcb->discard.lock, TRUE);
+    
+    // space_list_add2 merges adjacent and overlapping entries for us
+    
+    while (!IsListEmpty(list)) {
+        space* s = CONTAINING_RECORD(RemoveHeadList(list), space, list_entry);
+        
+        space_list_add2(Vcb, &Vcb->discard.queue, NULL, s->address, s->size, NULL);
+        
+        ExFreePool(s);
+    }
+    
+    ExReleaseResourceLite(&Vcb->discard.lock);
+    
+    KeSetEvent(&Vcb->discard.event, 0, FALSE);
+}
@@ -1012,8 +1012,6 @@ static NTSTATUS move_across_subvols(file_ref* fileref, file_ref* destdir, PANSI_
         if (me->fileref->fcb->inode != SUBVOL_ROOT_INODE) {
             if (!me->dummyfcb) {
                 ULONG defda;
-                BOOL inserted = FALSE;
-                LIST_ENTRY* le;
                 
                 ExAcquireResourceExclusiveLite(me->fileref->fcb->Header.Resource, TRUE);
                 
@@ -1093,24 +1091,10 @@ static NTSTATUS move_across_subvols(file_ref* fileref, file_ref* destdir, PANSI_
                 
                 me->fileref->fcb->created = TRUE;
                 
-                InsertHeadList(&me->fileref->fcb->list_entry, &me->dummyfcb->list_entry);
-                RemoveEntryList(&me->fileref->fcb->list_entry);
-                
-                le = destdir->fcb->subvol->fcbs.Flink;
-                while (le != &destdir->fcb->subvol->fcbs) {
-                    fcb* fcb = CONTAINING_RECORD(le, struct _fcb, list_entry);
-                    
-                    if (fcb->inode > me->fileref->fcb->inode) {
-                        InsertHeadList(le->Blink, &me->fileref->fcb->list_entry);
-                        inserted = TRUE;
-                        break;
-                    }
-                    
-                    le = le->Flink;
-                }
-                
-                if (!inserted)
-                    InsertTailList(&destdir->fcb->subvol->fcbs, &me->fileref->fcb->list_entry);
+                // the fcb's subvol has already been changed, so the dummy's is the one it's currently in
+                remove_fcb_from_subvol(me->dummyfcb->subvol, me->fileref->fcb);
+                add_fcb_to_subvol(me->dummyfcb);
+                add_fcb_to_subvol(me->fileref->fcb);
                 
                 InsertTailList(&me->fileref->fcb->Vcb->all_fcbs, &me->dummyfcb->list_entry_all);
                 
@@ -1247,7 +1231,9 @@ static NTSTATUS move_across_subvols(file_ref* fileref, file_ref* destdir, PANSI_
             me->dummyfileref->fcb->fileref = me->dummyfileref;
         
         if (!me->parent) {
-            RemoveEntryList(&me->fileref->list_entry);
+            ExAcquireResourceExclusiveLite(&me->fileref->parent->nonpaged->children_lock, TRUE);
+            remove_fileref_child(me->fileref->parent, me->fileref);
+            ExReleaseResourceLite(&me->fileref->parent->nonpaged->children_lock);
             
             ExAcquireResourceExclusiveLite(&me->fileref->fcb->Vcb->fcb_lock, TRUE);
             free_fileref(me->fileref->parent);
@@ -1607,6 +1593,12 @@ static NTSTATUS STDCALL set_rename_information(device_extension* Vcb, PIRP Irp,
             goto end;
         }
         
+        // re-hash under the new name
+        ExAcquireResourceExclusiveLite(&fileref->parent->nonpaged->children_lock, TRUE);
+        remove_fileref_child(fileref->parent, fileref);
+        insert_fileref_child(fileref->parent, fileref, FALSE);
+        ExReleaseResourceLite(&fileref->parent->nonpaged->children_lock);
+        
         mark_fileref_dirty(fileref);
         
         KeQuerySystemTime(&time);
@@ -1697,10 +1689,10 @@ static NTSTATUS STDCALL set_rename_information(device_extension* Vcb, PIRP Irp,
     fileref->created = TRUE;
     fileref->parent = related;
 
-    ExAcquireResourceExclusiveLite(&fileref->parent->nonpaged->children_lock, TRUE);
-    InsertHeadList(&fileref->list_entry, &fr2->list_entry);
-    RemoveEntryList(&fileref->list_entry);
-    ExReleaseResourceLite(&fileref->parent->nonpaged->children_lock);
+    ExAcquireResourceExclusiveLite(&fr2->parent->nonpaged->children_lock, TRUE);
+    remove_fileref_child(fr2->parent, fileref);
+    insert_fileref_child(fr2->parent, fr2, FALSE);
+    ExReleaseResourceLite(&fr2->parent->nonpaged->children_lock);
     
     insert_fileref_child(related, fileref, TRUE);
     
@@ -1828,6 +1820,17 @@ end:
         ExReleaseResourceLite(&Vcb->fcb_lock);
     }
     
+    // Cached paths may include the old name - renaming a directory changes the paths of everything
+    // underneath it, but otherwise it's only the entries for the file and its streams which are out of date.
+    ExAcquireResourceExclusiveLite(&Vcb->fcb_lock, TRUE);
+    
+    if (NT_SUCCESS(Status) && fcb->type == BTRFS_TYPE_DIRECTORY)
+        flush_path_cache(Vcb);
+    else if (fileref)
+        remove_path_cache_fileref(Vcb, fileref);
+    
+    ExReleaseResourceLite(&Vcb->fcb_lock);
+    
     if (!NT_SUCCESS(Status) && related) {
         ExAcquireResourceExclusiveLite(&Vcb->fcb_lock, TRUE);
         free_fileref(related);
@@ -2459,6 +2462,9 @@ NTSTATUS STDCALL drv_set_information(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp
         goto end;
     }
 
+    if (top_level)
+        throttle_writes(Vcb);
+    
     Irp->IoStatus.Information = 0;
     
     Status = STATUS_NOT_IMPLEMENTED;
@@ -3817,25 +3823,17 @@ static NTSTATUS STDCALL fill_in_hard_link_information(FILE_LINKS_INFORMATION* fl
                 if (!NT_SUCCESS(Status)) {
                     ERR("open_fileref_by_inode returned %08x\n", Status);
                 } else if (!parfr->deleted) {
-                    LIST_ENTRY* le2;
+                    file_ref* fr2;
                     BOOL found = FALSE, deleted = FALSE;
                     UNICODE_STRING* fn;
                     
-                    le2 = parfr->children.Flink;
-                    while (le2 != &parfr->children) {
-                        file_ref* fr2 = CONTAINING_RECORD(le2, file_ref, list_entry);
+                    fr2 = find_fileref_child_by_index(parfr, hl->index);
+                    if (fr2) {
+                        found = TRUE;
+                        deleted = fr2->deleted;
                         
-                        if (fr2->index == hl->index) {
-                            found = TRUE;
-                            deleted = fr2->deleted;
-                            
-                            if (!deleted)
-                                fn = &fr2->filepart;
-                            
-                            break;
-                        }
-                        
-                        le2 = le2->Flink;
+                        if (!deleted)
+                            fn = &fr2->filepart;
                     }
                     
                     if (!found)
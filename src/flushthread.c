@@ -19,13 +19,49 @@
 
 #define MAX_CSUM_SIZE (4096 - sizeof(tree_header) - sizeof(leaf_node))
 
+// number of tree nodes to checksum and write at a time
+#define TREE_WRITE_BATCH 64
+
+// below this many dirty fcbs, it's not worth splitting them between threads
+#define PARALLEL_FLUSH_MIN_FCBS 64
+
+// how full to make the nodes when splitting an overlarge tree, leaving a bit of space for later inserts
+#define SPLIT_FILL_PERCENT 90
+
 // #define DEBUG_WRITE_LOOPS
 
+// Once any of these soft limits is reached we commit without waiting for the
+// timer. Writers are then slowed down more and more until the hard limit, at
+// which point they have to wait for the commit to finish.
+#define DIRTY_TREES_SOFT_LIMIT 0x2000000 // bytes
+#define DIRTY_FCBS_SOFT_LIMIT 4096
+#define DIRTY_CSUMS_SOFT_LIMIT 0x40000 // sectors
+#define DIRTY_HARD_LIMIT_FACTOR 4
+#define THROTTLE_MAX_DELAY 100 // ms
+#define THROTTLE_MAX_WAITS 50
+
 typedef struct {
     KEVENT Event;
     IO_STATUS_BLOCK iosb;
 } write_context;
 
+struct _write_superblocks_context;
+
+typedef struct {
+    struct _write_superblocks_context* context;
+    device* device;
+    PIRP Irp;
+    superblock* sb;
+    IO_STATUS_BLOCK iosb;
+    LIST_ENTRY list_entry;
+} write_superblocks_stripe;
+
+typedef struct _write_superblocks_context {
+    KEVENT Event;
+    LIST_ENTRY stripes;
+    LONG left;
+} write_superblocks_context;
+
 typedef struct {
     EXTENT_ITEM_TREE eit;
     UINT8 type;
@@ -138,19 +174,10 @@ exit2:
     return Status;
 }
 
-static void clean_space_cache_chunk(device_extension* Vcb, chunk* c) {
-    // FIXME - loop through c->deleting and do TRIM if device supports it
-    // FIXME - also find way of doing TRIM of dropped chunks
-    
-    while (!IsListEmpty(&c->deleting)) {
-        space* s = CONTAINING_RECORD(c->deleting.Flink, space, list_entry);
-        
-        RemoveEntryList(&s->list_entry);
-        ExFreePool(s);
-    }
-}
-
-static void clean_space_cache(device_extension* Vcb) {
+// Space freed by this transaction can't be reused until the new superblock is on
+// disk, as the old one still points to it - so we keep it out of the free space
+// list until then.
+static void hold_freed_space(device_extension* Vcb) {
     chunk* c;
     
     TRACE("(%p)\n", Vcb);
@@ -160,7 +187,13 @@ static void clean_space_cache(device_extension* Vcb) {
         
         ExAcquireResourceExclusiveLite(&c->lock, TRUE);
         
-        clean_space_cache_chunk(Vcb, c);
+        while (!IsListEmpty(&c->deleting)) {
+            space* s = CONTAINING_RECORD(RemoveHeadList(&c->deleting), space, list_entry);
+            
+            _space_list_subtract2(Vcb, &c->space, &c->space_size, s->address, s->size, c, NULL, funcname);
+            InsertTailList(&c->freed, &s->list_entry);
+        }
+        
         RemoveEntryList(&c->list_entry_changed);
         c->list_entry_changed.Flink = NULL;
         
@@ -168,6 +201,55 @@ static void clean_space_cache(device_extension* Vcb) {
     }
 }
 
+static void release_freed_space(device_extension* Vcb, BOOL committed) {
+    LIST_ENTRY* le;
+    
+    TRACE("(%p, %u)\n", Vcb, committed);
+    
+    ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
+    
+    le = Vcb->chunks.Flink;
+    while (le != &Vcb->chunks) {
+        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+        
+        if (!IsListEmpty(&c->freed)) {
+            LIST_ENTRY* le2;
+            
+            ExAcquireResourceExclusiveLite(&c->lock, TRUE);
+            
+            // The free space cache on disk already has these as free, so we don't mark the chunk as changed.
+            // If the superblocks didn't get written, the old trees are still live and must be left alone.
+            if (committed) {
+                le2 = c->freed.Flink;
+                while (le2 != &c->freed) {
+                    space* s = CONTAINING_RECORD(le2, space, list_entry);
+                    
+                    _space_list_add2(Vcb, &c->space, &c->space_size, s->address, s->size, c, NULL, funcname);
+                    
+                    le2 = le2->Flink;
+                }
+                
+                // FIXME - also find way of doing TRIM of dropped chunks
+                
+                if (Vcb->discard.thread)
+                    queue_discard(Vcb, &c->freed);
+            }
+            
+            while (!IsListEmpty(&c->freed)) {
+                space* s = CONTAINING_RECORD(RemoveHeadList(&c->freed), space, list_entry);
+                
+                ExFreePool(s);
+            }
+            
+            ExReleaseResourceLite(&c->lock);
+        }
+        
+        le = le->Flink;
+    }
+    
+    ExReleaseResourceLite(&Vcb->chunk_lock);
+}
+
 static BOOL trees_consistent(device_extension* Vcb, LIST_ENTRY* rollback) {
     ULONG maxsize = Vcb->superblock.node_size - sizeof(tree_header);
     LIST_ENTRY* le;
@@ -1280,19 +1362,120 @@ NTSTATUS do_tree_writes(device_extension* Vcb, LIST_ENTRY* tree_writes, PIRP Irp
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
+// Checksums the nodes on the calc threads, in batches, and writes out each batch
+// as soon as it's ready while the later ones are still being checksummed.
+static NTSTATUS checksum_and_write_trees(device_extension* Vcb, LIST_ENTRY* tree_writes, PIRP Irp) {
+    NTSTATUS Status;
+    ULONG num_trees = 0, num_batches, i, j;
+    LIST_ENTRY* le;
+    tree_write** tws;
+    UINT8** trees;
+    calc_job** jobs;
+    
+    le = tree_writes->Flink;
+    while (le != tree_writes) {
+        num_trees++;
+        le = le->Flink;
+    }
+    
+    if (num_trees == 0)
+        return STATUS_SUCCESS;
+    
+    num_batches = (num_trees + TREE_WRITE_BATCH - 1) / TREE_WRITE_BATCH;
+    
+    tws = ExAllocatePoolWithTag(PagedPool, num_trees * sizeof(tree_write*), ALLOC_TAG);
+    if (!tws) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    trees = ExAllocatePoolWithTag(PagedPool, num_trees * sizeof(UINT8*), ALLOC_TAG);
+    if (!trees) {
+        ERR("out of memory\n");
+        ExFreePool(tws);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    jobs = ExAllocatePoolWithTag(PagedPool, num_batches * sizeof(calc_job*), ALLOC_TAG);
+    if (!jobs) {
+        ERR("out of memory\n");
+        ExFreePool(trees);
+        ExFreePool(tws);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    i = 0;
+    le = tree_writes->Flink;
+    while (le != tree_writes) {
+        tws[i] = CONTAINING_RECORD(le, tree_write, list_entry);
+        trees[i] = tws[i]->data;
+        i++;
+        
+        le = le->Flink;
+    }
+    
+    for (i = 0; i < num_batches; i++) {
+        Status = add_calc_tree_job(Vcb, &trees[i * TREE_WRITE_BATCH], min(TREE_WRITE_BATCH, num_trees - (i * TREE_WRITE_BATCH)), &jobs[i]);
+        if (!NT_SUCCESS(Status)) {
+            WARN("add_calc_tree_job returned %08x\n", Status);
+            jobs[i] = NULL;
+        }
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+    for (i = 0; i < num_batches; i++) {
+        ULONG start = i * TREE_WRITE_BATCH, end = min(start + TREE_WRITE_BATCH, num_trees);
+        LIST_ENTRY batch;
+        
+        if (jobs[i]) {
+            KeWaitForSingleObject(&jobs[i]->event, Executive, KernelMode, FALSE, NULL);
+            free_calc_job(jobs[i]);
+        } else {
+            for (j = start; j < end; j++) {
+                tree_header* th = (tree_header*)trees[j];
+                
+                *((UINT32*)th) = ~calc_crc32c(0xffffffff, (UINT8*)&th->fs_uuid, Vcb->superblock.node_size - sizeof(th->csum));
+            }
+        }
+        
+        // we still have to wait for the rest of the jobs after a failure
+        if (!NT_SUCCESS(Status))
+            continue;
+        
+        InitializeListHead(&batch);
+        
+        for (j = start; j < end; j++) {
+            RemoveEntryList(&tws[j]->list_entry);
+            InsertTailList(&batch, &tws[j]->list_entry);
+        }
+        
+        Status = do_tree_writes(Vcb, &batch, Irp);
+        if (!NT_SUCCESS(Status))
+            ERR("do_tree_writes returned %08x\n", Status);
+        
+        // give back what's left, so the caller can free it
+        while (!IsListEmpty(&batch)) {
+            InsertTailList(tree_writes, RemoveHeadList(&batch));
+        }
+    }
+    
+    ExFreePool(jobs);
+    ExFreePool(trees);
+    ExFreePool(tws);
+    
+    return Status;
+}
+
+static NTSTATUS build_tree_writes(device_extension* Vcb, PIRP Irp, LIST_ENTRY* tree_writes) {
     UINT8 level;
     UINT8 *data, *body;
-    UINT32 crc32;
     NTSTATUS Status;
     LIST_ENTRY* le;
-    LIST_ENTRY tree_writes;
     tree_write* tw;
     
     TRACE("(%p)\n", Vcb);
     
-    InitializeListHead(&tree_writes);
-
     for (level = 0; level <= 255; level++) {
         BOOL nothing_found = TRUE;
         
@@ -1466,8 +1649,7 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
             data = ExAllocatePoolWithTag(NonPagedPool, Vcb->superblock.node_size, ALLOC_TAG);
             if (!data) {
                 ERR("out of memory\n");
-                Status = STATUS_INSUFFICIENT_RESOURCES;
-                goto end;
+                return STATUS_INSUFFICIENT_RESOURCES;
             }
             
             body = data + sizeof(tree_header);
@@ -1517,11 +1699,6 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
                 }
             }
             
-            crc32 = calc_crc32c(0xffffffff, (UINT8*)&((tree_header*)data)->fs_uuid, Vcb->superblock.node_size - sizeof(((tree_header*)data)->csum));
-            crc32 = ~crc32;
-            *((UINT32*)data) = crc32;
-            TRACE("setting crc32 to %08x\n", crc32);
-            
             tw = ExAllocatePoolWithTag(PagedPool, sizeof(tree_write), ALLOC_TAG);
             if (!tw) {
                 ERR("out of memory\n");
@@ -1533,14 +1710,14 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
             tw->data = data;
             tw->overlap = FALSE;
             
-            if (IsListEmpty(&tree_writes))
-                InsertTailList(&tree_writes, &tw->list_entry);
+            if (IsListEmpty(tree_writes))
+                InsertTailList(tree_writes, &tw->list_entry);
             else {
                 LIST_ENTRY* le2;
                 BOOL inserted = FALSE;
                 
-                le2 = tree_writes.Flink;
-                while (le2 != &tree_writes) {
+                le2 = tree_writes->Flink;
+                while (le2 != tree_writes) {
                     tree_write* tw2 = CONTAINING_RECORD(le2, tree_write, list_entry);
                     
                     if (tw2->address > tw->address) {
@@ -1553,30 +1730,14 @@ static NTSTATUS write_trees(device_extension* Vcb, PIRP Irp) {
                 }
                 
                 if (!inserted)
-                    InsertTailList(&tree_writes, &tw->list_entry);
+                    InsertTailList(tree_writes, &tw->list_entry);
             }
         }
 
         le = le->Flink;
     }
     
-    Status = do_tree_writes(Vcb, &tree_writes, Irp);
-    if (!NT_SUCCESS(Status)) {
-        ERR("do_tree_writes returned %08x\n", Status);
-        goto end;
-    }
-    
-    Status = STATUS_SUCCESS;
-
-end:
-    while (!IsListEmpty(&tree_writes)) {
-        le = RemoveHeadList(&tree_writes);
-        tw = CONTAINING_RECORD(le, tree_write, list_entry);
-        
-        ExFreePool(tw);
-    }
-    
-    return Status;
+    return STATUS_SUCCESS;
 }
 
 static void update_backup_superblock(device_extension* Vcb, superblock_backup* sb, PIRP Irp) {
@@ -1648,30 +1809,182 @@ static void update_backup_superblock(device_extension* Vcb, superblock_backup* s
     sb->num_devices = Vcb->superblock.num_devices;
 }
 
-static NTSTATUS STDCALL write_superblock(device_extension* Vcb, device* device) {
+static NTSTATUS STDCALL write_superblock_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr) {
+    write_superblocks_stripe* stripe = conptr;
+    write_superblocks_context* context = stripe->context;
+    
+    stripe->iosb = Irp->IoStatus;
+    
+    if (InterlockedDecrement(&context->left) == 0)
+        KeSetEvent(&context->Event, 0, FALSE);
+    
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+// If sb is NULL, this queues a flush of the device's write cache rather than a write.
+static NTSTATUS add_superblock_irp(write_superblocks_context* context, device* device, superblock* sb) {
+    write_superblocks_stripe* stripe;
+    PIO_STACK_LOCATION IrpSp;
+    
+    stripe = ExAllocatePoolWithTag(NonPagedPool, sizeof(write_superblocks_stripe), ALLOC_TAG);
+    if (!stripe) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlZeroMemory(stripe, sizeof(write_superblocks_stripe));
+    
+    stripe->context = context;
+    stripe->device = device;
+    
+    stripe->Irp = IoAllocateIrp(device->devobj->StackSize, FALSE);
+    if (!stripe->Irp) {
+        ERR("IoAllocateIrp failed\n");
+        ExFreePool(stripe);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    IrpSp = IoGetNextIrpStackLocation(stripe->Irp);
+    
+    if (sb) {
+        IrpSp->MajorFunction = IRP_MJ_WRITE;
+        IrpSp->Flags |= SL_WRITE_THROUGH;
+        
+        if (device->devobj->Flags & DO_BUFFERED_IO) {
+            stripe->Irp->AssociatedIrp.SystemBuffer = sb;
+            stripe->Irp->Flags = IRP_BUFFERED_IO;
+        } else if (device->devobj->Flags & DO_DIRECT_IO) {
+            stripe->Irp->MdlAddress = IoAllocateMdl(sb, sizeof(superblock), FALSE, FALSE, NULL);
+            if (!stripe->Irp->MdlAddress) {
+                ERR("IoAllocateMdl failed\n");
+                IoFreeIrp(stripe->Irp);
+                ExFreePool(stripe);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            
+            MmProbeAndLockPages(stripe->Irp->MdlAddress, KernelMode, IoWriteAccess);
+        } else
+            stripe->Irp->UserBuffer = sb;
+        
+        IrpSp->Parameters.Write.Length = sizeof(superblock);
+        IrpSp->Parameters.Write.ByteOffset.QuadPart = sb->sb_phys_addr;
+        
+        stripe->sb = sb;
+    } else
+        IrpSp->MajorFunction = IRP_MJ_FLUSH_BUFFERS;
+    
+    stripe->Irp->UserIosb = &stripe->iosb;
+    
+    IoSetCompletionRoutine(stripe->Irp, write_superblock_completion, stripe, TRUE, TRUE, TRUE);
+    
+    InsertTailList(&context->stripes, &stripe->list_entry);
+    
+    return STATUS_SUCCESS;
+}
+
+// Sends all the queued IRPs at once, and waits for them all to finish.
+static NTSTATUS send_superblock_irps(write_superblocks_context* context) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY* le;
+    
+    context->left = 0;
+    
+    le = context->stripes.Flink;
+    while (le != &context->stripes) {
+        context->left++;
+        le = le->Flink;
+    }
+    
+    if (context->left == 0)
+        return STATUS_SUCCESS;
+    
+    KeClearEvent(&context->Event);
+    
+    le = context->stripes.Flink;
+    while (le != &context->stripes) {
+        write_superblocks_stripe* stripe = CONTAINING_RECORD(le, write_superblocks_stripe, list_entry);
+        
+        IoCallDriver(stripe->device->devobj, stripe->Irp);
+        
+        le = le->Flink;
+    }
+    
+    KeWaitForSingleObject(&context->Event, Executive, KernelMode, FALSE, NULL);
+    
+    le = context->stripes.Flink;
+    while (le != &context->stripes) {
+        write_superblocks_stripe* stripe = CONTAINING_RECORD(le, write_superblocks_stripe, list_entry);
+        
+        if (!NT_SUCCESS(stripe->iosb.Status)) {
+            // not every device has a write cache to flush
+            if (!stripe->sb && (stripe->iosb.Status == STATUS_INVALID_DEVICE_REQUEST || stripe->iosb.Status == STATUS_NOT_SUPPORTED))
+                WARN("device %llx does not support flushing\n", stripe->device->devitem.dev_id);
+            else {
+                ERR("%s of device %llx returned %08x\n", stripe->sb ? "superblock write" : "flush", stripe->device->devitem.dev_id, stripe->iosb.Status);
+                Status = stripe->iosb.Status;
+            }
+        }
+        
+        le = le->Flink;
+    }
+    
+    return Status;
+}
+
+static void free_superblock_irps(write_superblocks_context* context) {
+    while (!IsListEmpty(&context->stripes)) {
+        write_superblocks_stripe* stripe = CONTAINING_RECORD(RemoveHeadList(&context->stripes), write_superblocks_stripe, list_entry);
+        
+        if (stripe->Irp->MdlAddress) {
+            MmUnlockPages(stripe->Irp->MdlAddress);
+            IoFreeMdl(stripe->Irp->MdlAddress);
+        }
+        
+        IoFreeIrp(stripe->Irp);
+        
+        if (stripe->sb)
+            ExFreePool(stripe->sb);
+        
+        ExFreePool(stripe);
+    }
+}
+
+static NTSTATUS STDCALL write_superblock(device_extension* Vcb, write_superblocks_context* context, superblock* sb, device* device) {
     NTSTATUS Status;
     unsigned int i = 0;
     UINT32 crc32;
     
-    RtlCopyMemory(&Vcb->superblock.dev_item, &device->devitem, sizeof(DEV_ITEM));
-    
     // All the documentation says that the Linux driver only writes one superblock
     // if it thinks a disk is an SSD, but this doesn't seem to be the case!
     
     while (superblock_addrs[i] > 0 && device->length >= superblock_addrs[i] + sizeof(superblock)) {
+        superblock* sb2;
+        
         TRACE("writing superblock %u\n", i);
         
-        Vcb->superblock.sb_phys_addr = superblock_addrs[i];
+        // each copy has its own address and checksum, so needs its own buffer
+        sb2 = ExAllocatePoolWithTag(NonPagedPool, sizeof(superblock), ALLOC_TAG);
+        if (!sb2) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        RtlCopyMemory(sb2, sb, sizeof(superblock));
+        RtlCopyMemory(&sb2->dev_item, &device->devitem, sizeof(DEV_ITEM));
         
-        crc32 = calc_crc32c(0xffffffff, (UINT8*)&Vcb->superblock.uuid, (ULONG)sizeof(superblock) - sizeof(Vcb->superblock.checksum));
+        sb2->sb_phys_addr = superblock_addrs[i];
+        
+        crc32 = calc_crc32c(0xffffffff, (UINT8*)&sb2->uuid, (ULONG)sizeof(superblock) - sizeof(sb2->checksum));
         crc32 = ~crc32;
         TRACE("crc32 is %08x\n", crc32);
-        RtlCopyMemory(&Vcb->superblock.checksum, &crc32, sizeof(UINT32));
-        
-        Status = write_data_phys(device->devobj, superblock_addrs[i], &Vcb->superblock, sizeof(superblock));
+        RtlCopyMemory(&sb2->checksum, &crc32, sizeof(UINT32));
         
-        if (!NT_SUCCESS(Status))
-            break;
+        Status = add_superblock_irp(context, device, sb2);
+        if (!NT_SUCCESS(Status)) {
+            ERR("add_superblock_irp returned %08x\n", Status);
+            ExFreePool(sb2);
+            return Status;
+        }
         
         i++;
     }
@@ -1680,12 +1993,11 @@ static NTSTATUS STDCALL write_superblock(device_extension* Vcb, device* device)
         ERR("no superblocks written!\n");
     }
 
-    return Status;
+    return STATUS_SUCCESS;
 }
 
-static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
+static void update_superblock(device_extension* Vcb, PIRP Irp) {
     UINT64 i;
-    NTSTATUS Status;
     LIST_ENTRY* le;
     
     TRACE("(%p)\n", Vcb);
@@ -1713,18 +2025,63 @@ static NTSTATUS write_superblocks(device_extension* Vcb, PIRP Irp) {
     }
     
     update_backup_superblock(Vcb, &Vcb->superblock.backup[BTRFS_NUM_BACKUP_ROOTS - 1], Irp);
+}
+
+// sb is a copy of the superblock taken when the transaction was frozen, so this
+// can run after the tree lock has been let go of.
+static NTSTATUS write_superblocks(device_extension* Vcb, superblock* sb) {
+    UINT64 i;
+    NTSTATUS Status;
+    write_superblocks_context context;
     
-    for (i = 0; i < Vcb->superblock.num_devices; i++) {
+    TRACE("(%p, %p)\n", Vcb, sb);
+    
+    KeInitializeEvent(&context.Event, NotificationEvent, FALSE);
+    InitializeListHead(&context.stripes);
+    
+    // The trees have to be on the disk before any superblock points to them, so
+    // we flush every device first. The superblocks themselves are written through.
+    
+    for (i = 0; i < sb->num_devices; i++) {
+        if (Vcb->devices[i].devobj && !Vcb->devices[i].readonly) {
+            Status = add_superblock_irp(&context, &Vcb->devices[i], NULL);
+            if (!NT_SUCCESS(Status)) {
+                ERR("add_superblock_irp returned %08x\n", Status);
+                goto end;
+            }
+        }
+    }
+    
+    Status = send_superblock_irps(&context);
+    if (!NT_SUCCESS(Status)) {
+        ERR("send_superblock_irps returned %08x\n", Status);
+        goto end;
+    }
+    
+    free_superblock_irps(&context);
+    
+    for (i = 0; i < sb->num_devices; i++) {
         if (Vcb->devices[i].devobj && !Vcb->devices[i].readonly) {
-            Status = write_superblock(Vcb, &Vcb->devices[i]);
+            Status = write_superblock(Vcb, &context, sb, &Vcb->devices[i]);
             if (!NT_SUCCESS(Status)) {
                 ERR("write_superblock returned %08x\n", Status);
-                return Status;
+                goto end;
             }
         }
     }
     
-    return STATUS_SUCCESS;
+    Status = send_superblock_irps(&context);
+    if (!NT_SUCCESS(Status)) {
+        ERR("send_superblock_irps returned %08x\n", Status);
+        goto end;
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    free_superblock_irps(&context);
+    
+    return Status;
 }
 
 static NTSTATUS flush_changed_extent(device_extension* Vcb, chunk* c, changed_extent* ce, PIRP Irp, LIST_ENTRY* rollback) {
@@ -1890,191 +2247,300 @@ end:
     return STATUS_SUCCESS;
 }
 
-static void update_checksum_tree(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
-    LIST_ENTRY* le = Vcb->sector_checksums.Flink;
-    changed_sector* cs;
-    traverse_ptr tp, next_tp;
-    KEY searchkey;
-    UINT32* data;
-    NTSTATUS Status;
+// Sorts idx by the address of the changed_sector each entry refers to. This is a
+// bottom-up merge sort, so it's stable and doesn't need any stack.
+static void sort_changed_sectors(changed_sector** entries, ULONG* idx, ULONG* tmp, ULONG num) {
+    ULONG width, i;
     
-    if (!Vcb->checksum_root) {
-        ERR("no checksum root\n");
-        goto exit;
+    for (width = 1; width < num; width *= 2) {
+        for (i = 0; i < num; i += 2 * width) {
+            ULONG mid = min(i + width, num), right = min(i + (2 * width), num);
+            ULONG a = i, b = mid, k = i;
+            
+            while (a < mid && b < right) {
+                if (entries[idx[b]]->ol.key < entries[idx[a]]->ol.key)
+                    tmp[k++] = idx[b++];
+                else
+                    tmp[k++] = idx[a++];
+            }
+            
+            while (a < mid) {
+                tmp[k++] = idx[a++];
+            }
+            
+            while (b < right) {
+                tmp[k++] = idx[b++];
+            }
+        }
+        
+        RtlCopyMemory(idx, tmp, sizeof(ULONG) * num);
     }
+}
+
+// Applies all the changes between runstart and runend to the checksum tree in one go. idx
+// holds the changes' positions in Vcb->sector_checksums, so that where several overlap
+// the one queued last wins, as if they had been applied one by one.
+static NTSTATUS apply_checksum_run(device_extension* Vcb, changed_sector** entries, ULONG* idx, ULONG num, UINT64 runstart, UINT64 runend,
+                                   PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status;
+    traverse_ptr tp, next_tp;
+    KEY searchkey;
+    UINT64 startaddr, endaddr;
+    ULONG len, runlength, index, base, i, j;
+    UINT32 *checksums, *data;
+    ULONG *bmparr, *seqs;
+    RTL_BITMAP bmp;
+    BOOL empty = FALSE;
     
-    while (le != &Vcb->sector_checksums) {
-        UINT64 startaddr, endaddr;
-        ULONG len;
-        UINT32* checksums;
-        RTL_BITMAP bmp;
-        ULONG* bmparr;
-        ULONG runlength, index;
+    searchkey.obj_id = EXTENT_CSUM_ID;
+    searchkey.obj_type = TYPE_EXTENT_CSUM;
+    searchkey.offset = runstart;
+    
+    // FIXME - create checksum_root if it doesn't exist at all
+    
+    Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
+    if (Status == STATUS_NOT_FOUND) { // tree is completely empty
+        empty = TRUE;
+        startaddr = runstart;
+        endaddr = runend;
+    } else if (!NT_SUCCESS(Status)) {
+        ERR("find_item returned %08x\n", Status);
+        return Status;
+    } else {
+        UINT32 tplen;
         
-        cs = (changed_sector*)le;
+        // FIXME - check entry is TYPE_EXTENT_CSUM?
         
-        searchkey.obj_id = EXTENT_CSUM_ID;
-        searchkey.obj_type = TYPE_EXTENT_CSUM;
-        searchkey.offset = cs->ol.key;
+        if (tp.item->key.offset < runstart && tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / sizeof(UINT32)) >= runstart)
+            startaddr = tp.item->key.offset;
+        else
+            startaddr = runstart;
         
-        // FIXME - create checksum_root if it doesn't exist at all
+        searchkey.offset = runend;
         
         Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
-        if (Status == STATUS_NOT_FOUND) { // tree is completely empty
-            if (!cs->deleted) {
-                checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * cs->length, ALLOC_TAG);
-                if (!checksums) {
-                    ERR("out of memory\n");
-                    goto exit;
+        if (!NT_SUCCESS(Status)) {
+            ERR("error - find_item returned %08x\n", Status);
+            return Status;
+        }
+        
+        tplen = tp.item->size / sizeof(UINT32);
+        
+        if (tp.item->key.offset + (tplen * Vcb->superblock.sector_size) >= runend)
+            endaddr = tp.item->key.offset + (tplen * Vcb->superblock.sector_size);
+        else
+            endaddr = runend;
+    }
+    
+    TRACE("run at %llx to %llx (%u changes)\n", runstart, runend, num);
+    TRACE("startaddr = %llx\n", startaddr);
+    TRACE("endaddr = %llx\n", endaddr);
+    
+    len = (ULONG)((endaddr - startaddr) / Vcb->superblock.sector_size);
+    base = (ULONG)((runstart - startaddr) / Vcb->superblock.sector_size);
+    
+    checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * len, ALLOC_TAG);
+    if (!checksums) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    bmparr = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * ((len/8)+1), ALLOC_TAG);
+    if (!bmparr) {
+        ERR("out of memory\n");
+        ExFreePool(checksums);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    seqs = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * (len - base), ALLOC_TAG);
+    if (!seqs) {
+        ERR("out of memory\n");
+        ExFreePool(bmparr);
+        ExFreePool(checksums);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlZeroMemory(seqs, sizeof(ULONG) * (len - base));
+    
+    RtlInitializeBitMap(&bmp, bmparr, len);
+    RtlSetAllBits(&bmp);
+    
+    // set bit = free space, cleared bit = allocated sector
+    
+    if (!empty) {
+        searchkey.offset = runstart;
+        
+        Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
+        if (!NT_SUCCESS(Status)) {
+            ERR("error - find_item returned %08x\n", Status);
+            goto end;
+        }
+        
+        while (tp.item->key.offset < endaddr) {
+            if (tp.item->key.offset >= startaddr) {
+                if (tp.item->size > 0) {
+                    ULONG itemlen = min((len - (tp.item->key.offset - startaddr) / Vcb->superblock.sector_size) * sizeof(UINT32), tp.item->size);
+                    
+                    RtlCopyMemory(&checksums[(tp.item->key.offset - startaddr) / Vcb->superblock.sector_size], tp.item->data, itemlen);
+                    RtlClearBits(&bmp, (tp.item->key.offset - startaddr) / Vcb->superblock.sector_size, itemlen / sizeof(UINT32));
                 }
                 
-                RtlCopyMemory(checksums, cs->checksums, sizeof(UINT32) * cs->length);
-                
-                if (!insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, cs->ol.key, checksums, sizeof(UINT32) * cs->length, NULL, Irp, rollback)) {
-                    ERR("insert_tree_item failed\n");
-                    ExFreePool(checksums);
-                    goto exit;
-                }
+                delete_tree_item(Vcb, &tp, rollback);
             }
-        } else if (!NT_SUCCESS(Status)) {
-            ERR("find_item returned %08x\n", Status);
-            goto exit;
-        } else {
-            UINT32 tplen;
-            
-            // FIXME - check entry is TYPE_EXTENT_CSUM?
             
-            if (tp.item->key.offset < cs->ol.key && tp.item->key.offset + (tp.item->size * Vcb->superblock.sector_size / sizeof(UINT32)) >= cs->ol.key)
-                startaddr = tp.item->key.offset;
-            else
-                startaddr = cs->ol.key;
+            if (find_next_item(Vcb, &tp, &next_tp, FALSE, Irp)) {
+                tp = next_tp;
+            } else
+                break;
+        }
+    }
+    
+    for (i = 0; i < num; i++) {
+        changed_sector* cs = entries[idx[i]];
+        ULONG off = (ULONG)((cs->ol.key - runstart) / Vcb->superblock.sector_size);
+        
+        for (j = 0; j < cs->length; j++) {
+            if (seqs[off + j] > idx[i])
+                continue;
             
-            searchkey.obj_id = EXTENT_CSUM_ID;
-            searchkey.obj_type = TYPE_EXTENT_CSUM;
-            searchkey.offset = cs->ol.key + (cs->length * Vcb->superblock.sector_size);
+            seqs[off + j] = idx[i] + 1;
             
-            Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
-            if (!NT_SUCCESS(Status)) {
-                ERR("error - find_item returned %08x\n", Status);
-                goto exit;
+            if (cs->deleted)
+                RtlSetBits(&bmp, base + off + j, 1);
+            else {
+                checksums[base + off + j] = cs->checksums[j];
+                RtlClearBits(&bmp, base + off + j, 1);
             }
+        }
+    }
+    
+    runlength = RtlFindFirstRunClear(&bmp, &index);
+    
+    while (runlength != 0) {
+        do {
+            ULONG rl;
+            UINT64 off;
             
-            tplen = tp.item->size / sizeof(UINT32);
-            
-            if (tp.item->key.offset + (tplen * Vcb->superblock.sector_size) >= cs->ol.key + (cs->length * Vcb->superblock.sector_size))
-                endaddr = tp.item->key.offset + (tplen * Vcb->superblock.sector_size);
+            if (runlength * sizeof(UINT32) > MAX_CSUM_SIZE)
+                rl = MAX_CSUM_SIZE / sizeof(UINT32);
             else
-                endaddr = cs->ol.key + (cs->length * Vcb->superblock.sector_size);
-            
-            TRACE("cs starts at %llx (%x sectors)\n", cs->ol.key, cs->length);
-            TRACE("startaddr = %llx\n", startaddr);
-            TRACE("endaddr = %llx\n", endaddr);
-            
-            len = (endaddr - startaddr) / Vcb->superblock.sector_size;
-            
-            checksums = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * len, ALLOC_TAG);
-            if (!checksums) {
-                ERR("out of memory\n");
-                goto exit;
-            }
+                rl = runlength;
             
-            bmparr = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * ((len/8)+1), ALLOC_TAG);
-            if (!bmparr) {
+            data = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * rl, ALLOC_TAG);
+            if (!data) {
                 ERR("out of memory\n");
-                ExFreePool(checksums);
-                goto exit;
-            }
-                
-            RtlInitializeBitMap(&bmp, bmparr, len);
-            RtlSetAllBits(&bmp);
-            
-            searchkey.obj_id = EXTENT_CSUM_ID;
-            searchkey.obj_type = TYPE_EXTENT_CSUM;
-            searchkey.offset = cs->ol.key;
-            
-            Status = find_item(Vcb, Vcb->checksum_root, &tp, &searchkey, FALSE, Irp);
-            if (!NT_SUCCESS(Status)) {
-                ERR("error - find_item returned %08x\n", Status);
-                goto exit;
+                Status = STATUS_INSUFFICIENT_RESOURCES;
+                goto end;
             }
             
-            // set bit = free space, cleared bit = allocated sector
+            RtlCopyMemory(data, &checksums[index], sizeof(UINT32) * rl);
             
-    //         ERR("start loop\n");
-            while (tp.item->key.offset < endaddr) {
-    //             ERR("%llx,%x,%llx\n", tp.item->key.obj_id, tp.item->key.obj_type, tp.item->key.offset);
-                if (tp.item->key.offset >= startaddr) {
-                    if (tp.item->size > 0) {
-                        ULONG itemlen = min((len - (tp.item->key.offset - startaddr) / Vcb->superblock.sector_size) * sizeof(UINT32), tp.item->size);
-                        
-                        RtlCopyMemory(&checksums[(tp.item->key.offset - startaddr) / Vcb->superblock.sector_size], tp.item->data, itemlen);
-                        RtlClearBits(&bmp, (tp.item->key.offset - startaddr) / Vcb->superblock.sector_size, itemlen / sizeof(UINT32));
-                    }
-                    
-                    delete_tree_item(Vcb, &tp, rollback);
-                }
-                
-                if (find_next_item(Vcb, &tp, &next_tp, FALSE, Irp)) {
-                    tp = next_tp;
-                } else
-                    break;
-            }
-    //         ERR("end loop\n");
+            off = startaddr + UInt32x32To64(index, Vcb->superblock.sector_size);
             
-            if (cs->deleted) {
-                RtlSetBits(&bmp, (cs->ol.key - startaddr) / Vcb->superblock.sector_size, cs->length);
-            } else {
-                RtlCopyMemory(&checksums[(cs->ol.key - startaddr) / Vcb->superblock.sector_size], cs->checksums, cs->length * sizeof(UINT32));
-                RtlClearBits(&bmp, (cs->ol.key - startaddr) / Vcb->superblock.sector_size, cs->length);
+            if (!insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, off, data, sizeof(UINT32) * rl, NULL, Irp, rollback)) {
+                ERR("insert_tree_item failed\n");
+                ExFreePool(data);
+                Status = STATUS_INTERNAL_ERROR;
+                goto end;
             }
             
-            runlength = RtlFindFirstRunClear(&bmp, &index);
+            runlength -= rl;
+            index += rl;
+        } while (runlength > 0);
+        
+        runlength = RtlFindNextForwardRunClear(&bmp, index, &index);
+    }
+    
+    Status = STATUS_SUCCESS;
+    
+end:
+    ExFreePool(seqs);
+    ExFreePool(bmparr);
+    ExFreePool(checksums);
+    
+    return Status;
+}
+
+static void update_checksum_tree(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY* le;
+    changed_sector *cs, **entries = NULL;
+    ULONG *idx = NULL, *tmp = NULL, num = 0, i;
+    NTSTATUS Status;
+    
+    if (!Vcb->checksum_root) {
+        ERR("no checksum root\n");
+        goto exit;
+    }
+    
+    le = Vcb->sector_checksums.Flink;
+    while (le != &Vcb->sector_checksums) {
+        num++;
+        le = le->Flink;
+    }
+    
+    if (num == 0)
+        goto exit;
+    
+    entries = ExAllocatePoolWithTag(PagedPool, sizeof(changed_sector*) * num, ALLOC_TAG);
+    idx = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * num, ALLOC_TAG);
+    tmp = ExAllocatePoolWithTag(PagedPool, sizeof(ULONG) * num, ALLOC_TAG);
+    
+    if (!entries || !idx || !tmp) {
+        ERR("out of memory\n");
+        goto exit;
+    }
+    
+    i = 0;
+    le = Vcb->sector_checksums.Flink;
+    while (le != &Vcb->sector_checksums) {
+        entries[i] = (changed_sector*)le;
+        idx[i] = i;
+        i++;
+        
+        le = le->Flink;
+    }
+    
+    sort_changed_sectors(entries, idx, tmp, num);
+    
+    // Coalesce overlapping and adjacent changes into runs, so that each part of
+    // the checksum tree only gets looked up and rewritten once.
+    
+    i = 0;
+    while (i < num) {
+        ULONG first = i;
+        UINT64 runstart, runend;
+        
+        cs = entries[idx[i]];
+        runstart = cs->ol.key;
+        runend = cs->ol.key + ((UINT64)cs->length * Vcb->superblock.sector_size);
+        i++;
+        
+        while (i < num && entries[idx[i]]->ol.key <= runend) {
+            cs = entries[idx[i]];
             
-            while (runlength != 0) {
-                do {
-                    ULONG rl;
-                    UINT64 off;
-                    
-                    if (runlength * sizeof(UINT32) > MAX_CSUM_SIZE)
-                        rl = MAX_CSUM_SIZE / sizeof(UINT32);
-                    else
-                        rl = runlength;
-                    
-                    data = ExAllocatePoolWithTag(PagedPool, sizeof(UINT32) * rl, ALLOC_TAG);
-                    if (!data) {
-                        ERR("out of memory\n");
-                        ExFreePool(bmparr);
-                        ExFreePool(checksums);
-                        goto exit;
-                    }
-                    
-                    RtlCopyMemory(data, &checksums[index], sizeof(UINT32) * rl);
-                    
-                    off = startaddr + UInt32x32To64(index, Vcb->superblock.sector_size);
-                    
-                    if (!insert_tree_item(Vcb, Vcb->checksum_root, EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, off, data, sizeof(UINT32) * rl, NULL, Irp, rollback)) {
-                        ERR("insert_tree_item failed\n");
-                        ExFreePool(data);
-                        ExFreePool(bmparr);
-                        ExFreePool(checksums);
-                        goto exit;
-                    }
-                    
-                    runlength -= rl;
-                    index += rl;
-                } while (runlength > 0);
-                
-                runlength = RtlFindNextForwardRunClear(&bmp, index, &index);
-            }
+            if (cs->ol.key + ((UINT64)cs->length * Vcb->superblock.sector_size) > runend)
+                runend = cs->ol.key + ((UINT64)cs->length * Vcb->superblock.sector_size);
             
-            ExFreePool(bmparr);
-            ExFreePool(checksums);
+            i++;
         }
         
-        le = le->Flink;
+        Status = apply_checksum_run(Vcb, entries, &idx[first], i - first, runstart, runend, Irp, rollback);
+        if (!NT_SUCCESS(Status)) {
+            ERR("apply_checksum_run returned %08x\n", Status);
+            goto exit;
+        }
     }
     
 exit:
+    if (tmp)
+        ExFreePool(tmp);
+    
+    if (idx)
+        ExFreePool(idx);
+    
+    if (entries)
+        ExFreePool(entries);
+    
     while (!IsListEmpty(&Vcb->sector_checksums)) {
         le = RemoveHeadList(&Vcb->sector_checksums);
         cs = (changed_sector*)le;
@@ -2500,14 +2966,17 @@ end:
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS STDCALL split_tree(device_extension* Vcb, tree* t) {
+typedef struct {
+    tree_data* td;
+    UINT32 numitems;
+    UINT32 size;
+} split_point;
+
+// Walks t once, and finds where each new node should start so that every node is filled to
+// roughly target bytes. If splits is NULL, just counts them.
+static UINT32 find_split_points(device_extension* Vcb, tree* t, UINT32 target, split_point* splits) {
     LIST_ENTRY* le;
-    UINT32 size, ds, numitems;
-    
-    size = 0;
-    numitems = 0;
-    
-    // FIXME - naïve implementation: maximizes number of filled trees
+    UINT32 size = 0, numitems = 0, totalitems = 0, totalsize = 0, ds, numsplits = 0;
     
     le = t->itemlist.Flink;
     while (le != &t->itemlist) {
@@ -2520,16 +2989,77 @@ static NTSTATUS STDCALL split_tree(device_extension* Vcb, tree* t) {
                 ds = sizeof(internal_node);
             
             // FIXME - move back if previous item was deleted item with same key
-            if (size + ds > Vcb->superblock.node_size - sizeof(tree_header))
-                return split_tree_at(Vcb, t, td, numitems, size);
-
+            if (numitems > 0 && (size >= target || size + ds > Vcb->superblock.node_size - sizeof(tree_header))) {
+                if (splits) {
+                    splits[numsplits].td = td;
+                    splits[numsplits].numitems = totalitems;
+                    splits[numsplits].size = totalsize;
+                }
+                
+                numsplits++;
+                size = 0;
+                numitems = 0;
+            }
+            
             size += ds;
             numitems++;
+            totalsize += ds;
+            totalitems++;
         }
         
         le = le->Flink;
     }
     
+    return numsplits;
+}
+
+static NTSTATUS STDCALL split_tree(device_extension* Vcb, tree* t) {
+    UINT32 capacity, nodes, target, numsplits, i;
+    split_point* splits;
+    NTSTATUS Status;
+    
+    // Work out how many nodes we need. If a large batch of keys has gone into one node,
+    // spread the items evenly between all its replacements, so we build them in one pass.
+    // Otherwise fill the left node and leave the remainder in the right one - most
+    // overflows come from appending, and halving the node would leave both half empty.
+    
+    capacity = Vcb->superblock.node_size - sizeof(tree_header);
+    
+    nodes = (UINT32)(((UINT64)t->size * 100 + ((UINT64)capacity * SPLIT_FILL_PERCENT) - 1) / ((UINT64)capacity * SPLIT_FILL_PERCENT));
+    
+    if (nodes > 2)
+        target = (t->size + nodes - 1) / nodes;
+    else
+        target = (UINT32)(((UINT64)capacity * SPLIT_FILL_PERCENT) / 100);
+    
+    numsplits = find_split_points(Vcb, t, target, NULL);
+    if (numsplits == 0)
+        return STATUS_SUCCESS;
+    
+    splits = ExAllocatePoolWithTag(PagedPool, sizeof(split_point) * numsplits, ALLOC_TAG);
+    if (!splits) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    find_split_points(Vcb, t, target, splits);
+    
+    TRACE("splitting tree into %u nodes\n", numsplits + 1);
+    
+    // Split off the last node first - each new node goes straight after t in its parent,
+    // so this leaves them in the right order, and only the items being moved get touched.
+    
+    for (i = numsplits; i > 0; i--) {
+        Status = split_tree_at(Vcb, t, splits[i - 1].td, splits[i - 1].numitems, splits[i - 1].size);
+        if (!NT_SUCCESS(Status)) {
+            ERR("split_tree_at returned %08x\n", Status);
+            ExFreePool(splits);
+            return Status;
+        }
+    }
+    
+    ExFreePool(splits);
+    
     return STATUS_SUCCESS;
 }
 
@@ -4030,128 +4560,123 @@ end:
     }
 }
 
-void flush_fcb(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
-    traverse_ptr tp;
-    KEY searchkey;
+// Tidies up the extent list before it gets written. This can change extent refs and
+// free space, so unlike flush_fcb_items it mustn't run for two fcbs at once.
+static NTSTATUS prepare_fcb_extents(fcb* fcb, PIRP Irp) {
     NTSTATUS Status;
-    INODE_ITEM* ii;
-    UINT64 ii_offset;
-#ifdef DEBUG_PARANOID
-    UINT64 old_size = 0;
-    BOOL extents_changed;
-#endif
-    
-    while (!IsListEmpty(&fcb->index_list)) {
-        LIST_ENTRY* le = RemoveHeadList(&fcb->index_list);
-        index_entry* ie = CONTAINING_RECORD(le, index_entry, list_entry);
-
-        if (ie->utf8.Buffer) ExFreePool(ie->utf8.Buffer);
-        if (ie->filepart_uc.Buffer) ExFreePool(ie->filepart_uc.Buffer);
-        ExFreePool(ie);
-    }
-    
-    if (fcb->index_ptrs) {
-        ExFreePool(fcb->index_ptrs);
-        fcb->index_ptrs = NULL;
-    }
-    
-    fcb->index_loaded = FALSE;
+    LIST_ENTRY* le;
     
-    if (fcb->ads) {
-        if (fcb->deleted)
-            delete_xattr(fcb->Vcb, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adshash, Irp, rollback);
-        else {
-            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adshash, (UINT8*)fcb->adsdata.Buffer, fcb->adsdata.Length, Irp, rollback);
-            if (!NT_SUCCESS(Status)) {
-                ERR("set_xattr returned %08x\n", Status);
-                goto end;
-            }
+    // delete ignored extent items
+    le = fcb->extents.Flink;
+    while (le != &fcb->extents) {
+        LIST_ENTRY* le2 = le->Flink;
+        extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+        
+        if (ext->ignore) {
+            RemoveEntryList(&ext->list_entry);
+            ExFreePool(ext->data);
+            ExFreePool(ext);
         }
-        goto end;
-    }
-    
-    if (fcb->deleted) {
-        if (!insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0xffffffffffffffff, NULL, 0, Batch_DeleteInode, Irp, rollback))
-            ERR("insert_tree_item_batch failed\n");
         
-        goto end;
+        le = le2;
     }
     
-#ifdef DEBUG_PARANOID
-    extents_changed = fcb->extents_changed;
-#endif
-    
-    if (fcb->extents_changed) {
-        BOOL b;
-        traverse_ptr next_tp;
-        LIST_ENTRY* le;
-        BOOL prealloc = FALSE, extents_inline = FALSE;
-        UINT64 last_end;
+    if (!IsListEmpty(&fcb->extents)) {
+        rationalize_extents(fcb, Irp);
+        
+        // merge together adjacent EXTENT_DATAs pointing to same extent
         
-        // delete ignored extent items
         le = fcb->extents.Flink;
         while (le != &fcb->extents) {
             LIST_ENTRY* le2 = le->Flink;
             extent* ext = CONTAINING_RECORD(le, extent, list_entry);
             
-            if (ext->ignore) {
-                RemoveEntryList(&ext->list_entry);
-                ExFreePool(ext->data);
-                ExFreePool(ext);
-            }
-            
-            le = le2;
-        }
-        
-        if (!IsListEmpty(&fcb->extents)) {
-            rationalize_extents(fcb, Irp);
-            
-            // merge together adjacent EXTENT_DATAs pointing to same extent
-            
-            le = fcb->extents.Flink;
-            while (le != &fcb->extents) {
-                LIST_ENTRY* le2 = le->Flink;
-                extent* ext = CONTAINING_RECORD(le, extent, list_entry);
+            if ((ext->data->type == EXTENT_TYPE_REGULAR || ext->data->type == EXTENT_TYPE_PREALLOC) && le->Flink != &fcb->extents) {
+                extent* nextext = CONTAINING_RECORD(le->Flink, extent, list_entry);
                 
-                if ((ext->data->type == EXTENT_TYPE_REGULAR || ext->data->type == EXTENT_TYPE_PREALLOC) && le->Flink != &fcb->extents) {
-                    extent* nextext = CONTAINING_RECORD(le->Flink, extent, list_entry);
-                        
-                    if (ext->data->type == nextext->data->type) {
-                        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->data->data;
-                        EXTENT_DATA2* ned2 = (EXTENT_DATA2*)nextext->data->data;
+                if (ext->data->type == nextext->data->type) {
+                    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ext->data->data;
+                    EXTENT_DATA2* ned2 = (EXTENT_DATA2*)nextext->data->data;
+                    
+                    if (ed2->size != 0 && ed2->address == ned2->address && ed2->size == ned2->size &&
+                        nextext->offset == ext->offset + ed2->num_bytes && ned2->offset == ed2->offset + ed2->num_bytes) {
+                        chunk* c;
                         
-                        if (ed2->size != 0 && ed2->address == ned2->address && ed2->size == ned2->size &&
-                            nextext->offset == ext->offset + ed2->num_bytes && ned2->offset == ed2->offset + ed2->num_bytes) {
-                            chunk* c;
+                        ext->data->generation = fcb->Vcb->superblock.generation;
+                        ed2->num_bytes += ned2->num_bytes;
                         
-                            ext->data->generation = fcb->Vcb->superblock.generation;
-                            ed2->num_bytes += ned2->num_bytes;
+                        RemoveEntryList(&nextext->list_entry);
+                        ExFreePool(nextext->data);
+                        ExFreePool(nextext);
                         
-                            RemoveEntryList(&nextext->list_entry);
-                            ExFreePool(nextext->data);
-                            ExFreePool(nextext);
+                        c = get_chunk_from_address(fcb->Vcb, ed2->address);
                         
-                            c = get_chunk_from_address(fcb->Vcb, ed2->address);
-                                
-                            if (!c) {
-                                ERR("get_chunk_from_address(%llx) failed\n", ed2->address);
-                            } else {
-                                Status = update_changed_extent_ref(fcb->Vcb, c, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset, -1,
-                                                                fcb->inode_item.flags & BTRFS_INODE_NODATASUM, FALSE, Irp);
-                                if (!NT_SUCCESS(Status)) {
-                                    ERR("update_changed_extent_ref returned %08x\n", Status);
-                                    goto end;
-                                }
+                        if (!c) {
+                            ERR("get_chunk_from_address(%llx) failed\n", ed2->address);
+                        } else {
+                            Status = update_changed_extent_ref(fcb->Vcb, c, ed2->address, ed2->size, fcb->subvol->id, fcb->inode, ext->offset - ed2->offset, -1,
+                                                            fcb->inode_item.flags & BTRFS_INODE_NODATASUM, FALSE, Irp);
+                            if (!NT_SUCCESS(Status)) {
+                                ERR("update_changed_extent_ref returned %08x\n", Status);
+                                return Status;
                             }
-                        
-                            le2 = le;
                         }
+                        
+                        le2 = le;
                     }
                 }
-                
-                le = le2;
             }
+            
+            le = le2;
         }
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+static void flush_fcb_items(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
+    traverse_ptr tp;
+    KEY searchkey;
+    NTSTATUS Status;
+    INODE_ITEM* ii;
+    UINT64 ii_offset;
+#ifdef DEBUG_PARANOID
+    UINT64 old_size = 0;
+    BOOL extents_changed;
+#endif
+    
+    free_dir_index(fcb);
+    
+    if (fcb->ads) {
+        if (fcb->deleted)
+            delete_xattr(fcb->Vcb, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adshash, Irp, rollback);
+        else {
+            Status = set_xattr(fcb->Vcb, batchlist, fcb->subvol, fcb->inode, fcb->adsxattr.Buffer, fcb->adshash, (UINT8*)fcb->adsdata.Buffer, fcb->adsdata.Length, Irp, rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("set_xattr returned %08x\n", Status);
+                goto end;
+            }
+        }
+        goto end;
+    }
+    
+    if (fcb->deleted) {
+        if (!insert_tree_item_batch(batchlist, fcb->Vcb, fcb->subvol, fcb->inode, TYPE_INODE_ITEM, 0xffffffffffffffff, NULL, 0, Batch_DeleteInode, Irp, rollback))
+            ERR("insert_tree_item_batch failed\n");
+        
+        goto end;
+    }
+    
+#ifdef DEBUG_PARANOID
+    extents_changed = fcb->extents_changed;
+#endif
+    
+    if (fcb->extents_changed) {
+        BOOL b;
+        traverse_ptr next_tp;
+        LIST_ENTRY* le;
+        BOOL prealloc = FALSE, extents_inline = FALSE;
+        UINT64 last_end;
         
         if (!fcb->created) {
             // delete existing EXTENT_DATA items
@@ -4418,6 +4943,20 @@ end:
     fcb->dirty = FALSE;
 }
 
+void flush_fcb(fcb* fcb, BOOL cache, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
+    if (!fcb->ads && !fcb->deleted && fcb->extents_changed) {
+        NTSTATUS Status = prepare_fcb_extents(fcb, Irp);
+        
+        if (!NT_SUCCESS(Status)) {
+            ERR("prepare_fcb_extents returned %08x\n", Status);
+            fcb->dirty = FALSE;
+            return;
+        }
+    }
+    
+    flush_fcb_items(fcb, cache, batchlist, Irp, rollback);
+}
+
 static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
     NTSTATUS Status;
     KEY searchkey;
@@ -4479,7 +5018,7 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
                     
                     c->devices[i]->devitem.bytes_used -= de->length;
                     
-                    space_list_add2(Vcb, &c->devices[i]->space, NULL, cis[i].offset, de->length, rollback);
+                    space_list_add2(Vcb, &c->devices[i]->space, &c->devices[i]->space_size, cis[i].offset, de->length, rollback);
                 }
             } else
                 WARN("could not find (%llx,%x,%llx) in dev tree\n", searchkey.obj_id, searchkey.obj_type, searchkey.offset);
@@ -4487,7 +5026,7 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
             UINT64 len = c->chunk_item->size / factor;
             
             c->devices[i]->devitem.bytes_used -= len;
-            space_list_add2(Vcb, &c->devices[i]->space, NULL, cis[i].offset, len, rollback);
+            space_list_add2(Vcb, &c->devices[i]->space, &c->devices[i]->space_size, cis[i].offset, len, rollback);
         }
     }
     
@@ -4573,6 +5112,8 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
     
     RemoveEntryList(&c->list_entry);
     
+    space_list_add2(Vcb, &Vcb->chunk_gaps, NULL, c->offset, c->chunk_item->size, NULL);
+    
     if (c->list_entry_changed.Flink)
         RemoveEntryList(&c->list_entry_changed);
     
@@ -4586,6 +5127,8 @@ static NTSTATUS drop_chunk(device_extension* Vcb, chunk* c, LIST_ENTRY* batchlis
         ExFreePool(s);
     }
     
+    free_space_bitmap(c);
+    
     while (!IsListEmpty(&c->deleting)) {
         space* s = CONTAINING_RECORD(c->deleting.Flink, space, list_entry);
         
@@ -4605,6 +5148,7 @@ static NTSTATUS update_chunks(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP
     LIST_ENTRY *le = Vcb->chunks_changed.Flink, *le2;
     NTSTATUS Status;
     UINT64 used_minus_cache;
+    BOOL drop;
     
     ExAcquireResourceExclusiveLite(&Vcb->chunk_lock, TRUE);
     
@@ -4652,7 +5196,11 @@ static NTSTATUS update_chunks(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP
             }
         }
         
-        if (used_minus_cache == 0) {
+        // If the discard thread has taken some of the chunk's free space while it trims it, it puts
+        // the chunk back on chunks_changed when it's finished, and we can drop it then.
+        drop = used_minus_cache == 0 && c->discarding == 0;
+        
+        if (drop) {
             Status = drop_chunk(Vcb, c, batchlist, Irp, rollback);
             if (!NT_SUCCESS(Status)) {
                 ERR("drop_chunk returned %08x\n", Status);
@@ -4670,7 +5218,7 @@ static NTSTATUS update_chunks(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP
             }
         }
         
-        if (used_minus_cache > 0)
+        if (!drop)
             ExReleaseResourceLite(&c->lock);
 
         le = le2;
@@ -5283,12 +5831,313 @@ static NTSTATUS flush_fileref(file_ref* fileref, LIST_ENTRY* batchlist, PIRP Irp
     return STATUS_SUCCESS;
 }
 
-NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+typedef struct {
+    device_extension* Vcb;
+    PIRP Irp;
+    root* subvol;
+    LIST_ENTRY fcbs;
+    LIST_ENTRY batchlist;
+    LIST_ENTRY rollback;
+    KEVENT event;
+    HANDLE thread;
+    LIST_ENTRY list_entry;
+} flush_fcbs_job;
+
+static void flush_fcbs_in_subvol(flush_fcbs_job* job) {
+    LIST_ENTRY* le;
+    
+    le = job->fcbs.Flink;
+    while (le != &job->fcbs) {
+        dirty_fcb* dirt = CONTAINING_RECORD(le, dirty_fcb, list_entry);
+        
+        ExAcquireResourceExclusiveLite(dirt->fcb->Header.Resource, TRUE);
+        flush_fcb_items(dirt->fcb, FALSE, &job->batchlist, job->Irp, &job->rollback);
+        ExReleaseResourceLite(dirt->fcb->Header.Resource);
+        
+        le = le->Flink;
+    }
+}
+
+static void flush_fcbs_thread(void* context) {
+    flush_fcbs_job* job = context;
+    
+    FsRtlEnterFileSystem();
+    
+    flush_fcbs_in_subvol(job);
+    
+    FsRtlExitFileSystem();
+    
+    KeSetEvent(&job->event, 0, FALSE);
+    
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Anything which can touch extent refs or free space is done here one fcb at a time,
+// after which the tree items are written out. Different subvolumes have different
+// trees, so when there's enough to do each subvolume gets its own thread. These are our own
+// rather than system work items, as we're holding tree_lock exclusively while we wait for them.
+static ULONG flush_dirty_fcbs(device_extension* Vcb, LIST_ENTRY* batchlist, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY *le, jobs;
+    ULONG num_fcbs = 0, num_jobs = 0;
+#ifdef DEBUG_STATS
+    LARGE_INTEGER time1, time2;
+    
+    time1 = KeQueryPerformanceCounter(NULL);
+#endif
+    
+    InitializeListHead(&jobs);
+    
+    le = Vcb->dirty_fcbs.Flink;
+    while (le != &Vcb->dirty_fcbs) {
+        dirty_fcb* dirt;
+        LIST_ENTRY* le2 = le->Flink;
+        
+        dirt = CONTAINING_RECORD(le, dirty_fcb, list_entry);
+        
+        if (dirt->fcb->subvol != Vcb->root_root || dirt->fcb->deleted) {
+            NTSTATUS Status;
+            LIST_ENTRY* le3;
+            flush_fcbs_job* job = NULL;
+            
+            RemoveEntryList(le);
+            
+            ExAcquireResourceExclusiveLite(dirt->fcb->Header.Resource, TRUE);
+            
+            if (dirt->fcb->deleted)
+                free_fcb_delalloc(dirt->fcb);
+            else {
+                // If this fails, the data which couldn't be written is still queued, and the fcb's
+                // extents are as they were before it. The rest of the transaction can go ahead.
+                Status = flush_fcb_delalloc(dirt->fcb, Irp, rollback);
+                if (!NT_SUCCESS(Status))
+                    ERR("flush_fcb_delalloc returned %08x\n", Status);
+            }
+            
+            if (!dirt->fcb->ads && !dirt->fcb->deleted && dirt->fcb->extents_changed) {
+                Status = prepare_fcb_extents(dirt->fcb, Irp);
+                if (!NT_SUCCESS(Status)) {
+                    ERR("prepare_fcb_extents returned %08x\n", Status);
+                    
+                    dirt->fcb->dirty = FALSE;
+                    ExReleaseResourceLite(dirt->fcb->Header.Resource);
+                    
+                    free_fcb(dirt->fcb);
+                    ExFreePool(dirt);
+                    
+                    le = le2;
+                    continue;
+                }
+            }
+            
+            ExReleaseResourceLite(dirt->fcb->Header.Resource);
+            
+            le3 = jobs.Flink;
+            while (le3 != &jobs) {
+                flush_fcbs_job* job2 = CONTAINING_RECORD(le3, flush_fcbs_job, list_entry);
+                
+                if (job2->subvol == dirt->fcb->subvol) {
+                    job = job2;
+                    break;
+                }
+                
+                le3 = le3->Flink;
+            }
+            
+            if (!job) {
+                job = ExAllocatePoolWithTag(NonPagedPool, sizeof(flush_fcbs_job), ALLOC_TAG);
+                if (!job) {
+                    ERR("out of memory\n");
+                    
+                    ExAcquireResourceExclusiveLite(dirt->fcb->Header.Resource, TRUE);
+                    flush_fcb_items(dirt->fcb, FALSE, batchlist, Irp, rollback);
+                    ExReleaseResourceLite(dirt->fcb->Header.Resource);
+                    
+                    free_fcb(dirt->fcb);
+                    ExFreePool(dirt);
+                    num_fcbs++;
+                    
+                    le = le2;
+                    continue;
+                }
+                
+                job->Vcb = Vcb;
+                job->Irp = Irp;
+                job->subvol = dirt->fcb->subvol;
+                InitializeListHead(&job->fcbs);
+                InitializeListHead(&job->batchlist);
+                InitializeListHead(&job->rollback);
+                KeInitializeEvent(&job->event, NotificationEvent, FALSE);
+                
+                InsertTailList(&jobs, &job->list_entry);
+                num_jobs++;
+            }
+            
+            InsertTailList(&job->fcbs, &dirt->list_entry);
+            num_fcbs++;
+        }
+        
+        le = le2;
+    }
+    
+    if (num_jobs > 1 && num_fcbs >= PARALLEL_FLUSH_MIN_FCBS) {
+        // the first subvolume gets done on this thread
+        le = jobs.Flink->Flink;
+        while (le != &jobs) {
+            flush_fcbs_job* job = CONTAINING_RECORD(le, flush_fcbs_job, list_entry);
+            
+            NTSTATUS Status;
+            
+            Status = PsCreateSystemThread(&job->thread, 0, NULL, NULL, NULL, flush_fcbs_thread, job);
+            if (!NT_SUCCESS(Status)) {
+                WARN("PsCreateSystemThread returned %08x\n", Status);
+                
+                job->thread = NULL;
+                flush_fcbs_in_subvol(job);
+                KeSetEvent(&job->event, 0, FALSE);
+            }
+            
+            le = le->Flink;
+        }
+        
+        if (!IsListEmpty(&jobs))
+            flush_fcbs_in_subvol(CONTAINING_RECORD(jobs.Flink, flush_fcbs_job, list_entry));
+        
+        le = jobs.Flink->Flink;
+        while (le != &jobs) {
+            flush_fcbs_job* job = CONTAINING_RECORD(le, flush_fcbs_job, list_entry);
+            
+            KeWaitForSingleObject(&job->event, Executive, KernelMode, FALSE, NULL);
+            
+            if (job->thread)
+                ZwClose(job->thread);
+            
+            le = le->Flink;
+        }
+    } else {
+        le = jobs.Flink;
+        while (le != &jobs) {
+            flush_fcbs_in_subvol(CONTAINING_RECORD(le, flush_fcbs_job, list_entry));
+            
+            le = le->Flink;
+        }
+    }
+    
+    // Each job only has items for its own subvolume, so the batch lists can just be joined together.
+    while (!IsListEmpty(&jobs)) {
+        flush_fcbs_job* job = CONTAINING_RECORD(RemoveHeadList(&jobs), flush_fcbs_job, list_entry);
+        
+        while (!IsListEmpty(&job->batchlist)) {
+            InsertTailList(batchlist, RemoveHeadList(&job->batchlist));
+        }
+        
+        while (!IsListEmpty(&job->rollback)) {
+            InsertTailList(rollback, RemoveHeadList(&job->rollback));
+        }
+        
+        while (!IsListEmpty(&job->fcbs)) {
+            dirty_fcb* dirt = CONTAINING_RECORD(RemoveHeadList(&job->fcbs), dirty_fcb, list_entry);
+            
+            // keep hold of anything with data still queued, so that it's tried again in the next commit
+            if (!dirt->fcb->deleted && !IsListEmpty(&dirt->fcb->delalloc)) {
+                dirt->fcb->dirty = TRUE;
+                ExInterlockedInsertTailList(&Vcb->dirty_fcbs, &dirt->list_entry, &Vcb->dirty_fcbs_lock);
+                continue;
+            }
+            
+            free_fcb(dirt->fcb);
+            ExFreePool(dirt);
+        }
+        
+        ExFreePool(job);
+    }
+    
+#ifdef DEBUG_STATS
+    time2 = KeQueryPerformanceCounter(NULL);
+    
+    Vcb->stats.num_fcb_flushes++;
+    Vcb->stats.fcbs_flushed += num_fcbs;
+    Vcb->stats.fcb_flush_jobs += num_jobs;
+    Vcb->stats.fcb_flush_time += time2.QuadPart - time1.QuadPart;
+#endif
+    
+    return num_fcbs;
+}
+
+static void add_commit_time(btrfs_commit_time* ct, UINT64 us) {
+    UINT8 bucket = 0;
+    
+    ct->count++;
+    ct->total_time += us;
+    
+    if (us > ct->max_time)
+        ct->max_time = us;
+    
+    while (us > 0 && bucket < BTRFS_COMMIT_HISTOGRAM_BUCKETS - 1) {
+        bucket++;
+        us >>= 1;
+    }
+    
+    ct->histogram[bucket]++;
+}
+
+static UINT64 commit_time_since(LARGE_INTEGER* start, LARGE_INTEGER* now) {
+    LARGE_INTEGER freq;
+    
+    *now = KeQueryPerformanceCounter(&freq);
+    
+    return (now->QuadPart - start->QuadPart) * 1000000 / freq.QuadPart;
+}
+
+static void add_phase_time(device_extension* Vcb, UINT8 phase, UINT64 us) {
+    KIRQL irql;
+    
+    KeAcquireSpinLock(&Vcb->commit_stats_lock, &irql);
+    add_commit_time(&Vcb->commit_stats.phases[phase], us);
+    KeReleaseSpinLock(&Vcb->commit_stats_lock, irql);
+}
+
+// Records the time since *start against the given phase, and resets *start so the next phase can be timed from here.
+static void commit_phase_done(device_extension* Vcb, UINT8 phase, LARGE_INTEGER* start) {
+    LARGE_INTEGER now;
+    
+    add_phase_time(Vcb, phase, commit_time_since(start, &now));
+    
+    *start = now;
+}
+
+static void commit_done(device_extension* Vcb, LARGE_INTEGER* start, BOOL success, UINT64 filerefs, UINT64 fcbs, UINT64 trees) {
+    LARGE_INTEGER now;
+    UINT64 us = commit_time_since(start, &now);
+    KIRQL irql;
+    
+    KeAcquireSpinLock(&Vcb->commit_stats_lock, &irql);
+    
+    Vcb->commit_stats.num_commits++;
+    
+    if (!success)
+        Vcb->commit_stats.failed_commits++;
+    
+    Vcb->commit_stats.filerefs_flushed += filerefs;
+    Vcb->commit_stats.fcbs_flushed += fcbs;
+    Vcb->commit_stats.trees_written += trees;
+    
+    add_commit_time(&Vcb->commit_stats.commit, us);
+    
+    KeReleaseSpinLock(&Vcb->commit_stats_lock, irql);
+}
+
+// If pipelined is TRUE, the tree lock is downgraded to shared once the transaction
+// has been frozen, so that other threads can carry on while the trees and superblocks
+// are written - the caller then only holds it shared on return.
+NTSTATUS STDCALL do_write2(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback, BOOL pipelined) {
     NTSTATUS Status;
-    LIST_ENTRY *le, batchlist;
+    LIST_ENTRY *le, batchlist, tree_writes;
     BOOL cache_changed = FALSE;
+    superblock* sb;
+    UINT64 filerefs = 0, fcbs = 0, trees = 0;
+    LARGE_INTEGER commit_start, phase_start, chunks_start, now;
+    UINT64 chunks_time = 0, us;
 #ifdef DEBUG_FLUSH_TIMES
-    UINT64 filerefs = 0, fcbs = 0;
     LARGE_INTEGER freq, time1, time2;
 #endif
 #ifdef DEBUG_WRITE_LOOPS
@@ -5298,6 +6147,9 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     TRACE("(%p)\n", Vcb);
     
     InitializeListHead(&batchlist);
+    InitializeListHead(&tree_writes);
+    
+    commit_start = phase_start = KeQueryPerformanceCounter(NULL);
 
 #ifdef DEBUG_FLUSH_TIMES
     time1 = KeQueryPerformanceCounter(&freq);
@@ -5314,13 +6166,13 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         free_fileref(dirt->fileref);
         ExFreePool(dirt);
 
-#ifdef DEBUG_FLUSH_TIMES
         filerefs++;
-#endif
     }
     
     commit_batch_list(Vcb, &batchlist, Irp, rollback);
     
+    commit_phase_done(Vcb, BTRFS_COMMIT_PHASE_FILEREFS, &phase_start);
+    
 #ifdef DEBUG_FLUSH_TIMES
     time2 = KeQueryPerformanceCounter(NULL);
 
@@ -5349,40 +6201,20 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
             free_fcb(dirt->fcb);
             ExFreePool(dirt);
 
-#ifdef DEBUG_FLUSH_TIMES
             fcbs++;
-#endif
         }
         
         le = le2;
     }
     
-    le = Vcb->dirty_fcbs.Flink;
-    while (le != &Vcb->dirty_fcbs) {
-        dirty_fcb* dirt;
-        LIST_ENTRY* le2 = le->Flink;
-        
-        dirt = CONTAINING_RECORD(le, dirty_fcb, list_entry);
-        
-        if (dirt->fcb->subvol != Vcb->root_root || dirt->fcb->deleted) {
-            RemoveEntryList(le);
-            
-            ExAcquireResourceExclusiveLite(dirt->fcb->Header.Resource, TRUE);
-            flush_fcb(dirt->fcb, FALSE, &batchlist, Irp, rollback);
-            ExReleaseResourceLite(dirt->fcb->Header.Resource);
-            free_fcb(dirt->fcb);
-            ExFreePool(dirt);
-
-#ifdef DEBUG_FLUSH_TIMES
-            fcbs++;
-#endif
-        }
-        
-        le = le2;
-    }
+    fcbs += flush_dirty_fcbs(Vcb, &batchlist, Irp, rollback);
+    
+    commit_phase_done(Vcb, BTRFS_COMMIT_PHASE_FCBS, &phase_start);
     
     commit_batch_list(Vcb, &batchlist, Irp, rollback);
     
+    commit_phase_done(Vcb, BTRFS_COMMIT_PHASE_BATCH, &phase_start);
+    
 #ifdef DEBUG_FLUSH_TIMES
     time2 = KeQueryPerformanceCounter(NULL);
 
@@ -5395,22 +6227,31 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     }
     ExReleaseResourceLite(&Vcb->checksum_lock);
     
+    commit_phase_done(Vcb, BTRFS_COMMIT_PHASE_CHECKSUMS, &phase_start);
+    
     if (!IsListEmpty(&Vcb->drop_roots)) {
         Status = drop_roots(Vcb, Irp, rollback);
         
         if (!NT_SUCCESS(Status)) {
             ERR("drop_roots returned %08x\n", Status);
-            return Status;
+            goto end;
         }
     }
     
+    // The chunk updates are interleaved with the extent allocations below, so their time is
+    // added up separately and taken out of BTRFS_COMMIT_PHASE_EXTENTS.
+    
     if (!IsListEmpty(&Vcb->chunks_changed)) {
+        chunks_start = KeQueryPerformanceCounter(NULL);
+        
         Status = update_chunks(Vcb, &batchlist, Irp, rollback);
         
         if (!NT_SUCCESS(Status)) {
             ERR("update_chunks returned %08x\n", Status);
-            return Status;
+            goto end;
         }
+        
+        chunks_time += commit_time_since(&chunks_start, &now);
     }
     
     commit_batch_list(Vcb, &batchlist, Irp, rollback);
@@ -5429,7 +6270,7 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
         Status = find_item(Vcb, Vcb->root_root, &tp, &searchkey, FALSE, Irp);
         if (!NT_SUCCESS(Status)) {
             ERR("error - find_item returned %08x\n", Status);
-            return Status;
+            goto end;
         }
         
         Vcb->root_root->treeholder.tree->write = TRUE;
@@ -5439,7 +6280,7 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     Status = add_root_item_to_cache(Vcb, BTRFS_ROOT_EXTENT, Irp, rollback);
     if (!NT_SUCCESS(Status)) {
         ERR("add_root_item_to_cache returned %08x\n", Status);
-        return Status;
+        goto end;
     }
     
     do {
@@ -5461,6 +6302,8 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
             goto end;
         }
         
+        chunks_start = KeQueryPerformanceCounter(NULL);
+        
         Status = update_chunk_usage(Vcb, Irp, rollback);
         if (!NT_SUCCESS(Status)) {
             ERR("update_chunk_usage returned %08x\n", Status);
@@ -5472,6 +6315,8 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
             ERR("allocate_cache returned %08x\n", Status);
             goto end;
         }
+        
+        chunks_time += commit_time_since(&chunks_start, &now);
 
 #ifdef DEBUG_WRITE_LOOPS
         loops++;
@@ -5487,18 +6332,32 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     
     TRACE("trees consistent\n");
     
+    us = commit_time_since(&phase_start, &now);
+    add_phase_time(Vcb, BTRFS_COMMIT_PHASE_EXTENTS, us > chunks_time ? us - chunks_time : 0);
+    add_phase_time(Vcb, BTRFS_COMMIT_PHASE_CHUNKS, chunks_time);
+    phase_start = now;
+    
     Status = update_root_root(Vcb, Irp, rollback);
     if (!NT_SUCCESS(Status)) {
         ERR("update_root_root returned %08x\n", Status);
         goto end;
     }
     
-    Status = write_trees(Vcb, Irp);
+    commit_phase_done(Vcb, BTRFS_COMMIT_PHASE_ROOTS, &phase_start);
+    
+    Status = build_tree_writes(Vcb, Irp, &tree_writes);
     if (!NT_SUCCESS(Status)) {
-        ERR("write_trees returned %08x\n", Status);
+        ERR("build_tree_writes returned %08x\n", Status);
         goto end;
     }
     
+    le = tree_writes.Flink;
+    while (le != &tree_writes) {
+        trees++;
+        
+        le = le->Flink;
+    }
+    
 #ifdef DEBUG_PARANOID
     le = Vcb->trees.Flink;
     while (le != &Vcb->trees) {
@@ -5539,17 +6398,22 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     
     Vcb->superblock.cache_generation = Vcb->superblock.generation;
     
-    Status = write_superblocks(Vcb, Irp);
-    if (!NT_SUCCESS(Status)) {
-        ERR("write_superblocks returned %08x\n", Status);
+    update_superblock(Vcb, Irp);
+    
+    sb = ExAllocatePoolWithTag(NonPagedPool, sizeof(superblock), ALLOC_TAG);
+    if (!sb) {
+        ERR("out of memory\n");
+        Status = STATUS_INSUFFICIENT_RESOURCES;
         goto end;
     }
     
-    clean_space_cache(Vcb);
+    RtlCopyMemory(sb, &Vcb->superblock, sizeof(superblock));
     
-    Vcb->superblock.generation++;
+    // The transaction is now frozen - everything from here on belongs to the next one.
     
-    Status = STATUS_SUCCESS;
+    hold_freed_space(Vcb);
+    
+    Vcb->superblock.generation++;
     
     le = Vcb->trees.Flink;
     while (le != &Vcb->trees) {
@@ -5562,21 +6426,81 @@ NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback)
     
     Vcb->need_write = FALSE;
     
+    Vcb->dirty_fcb_count = 0;
+    Vcb->dirty_tree_count = 0;
+    Vcb->dirty_csum_count = 0;
+    
+    // Anything still queued couldn't be written, and its fcb is still on the dirty list.
+    if (Vcb->delalloc_size > 0)
+        Vcb->need_write = TRUE;
+    
     while (!IsListEmpty(&Vcb->drop_roots)) {
         LIST_ENTRY* le = RemoveHeadList(&Vcb->drop_roots);
         root* r = CONTAINING_RECORD(le, root, list_entry);
 
         ExDeleteResourceLite(&r->nonpaged->load_tree_lock);
         ExFreePool(r->nonpaged);
+        
+        if (r->fcbs_hash)
+            ExFreePool(r->fcbs_hash);
+        
         ExFreePool(r);
     }
     
+    // The transaction is frozen, so there's nothing left to roll back. The trees have to stay
+    // in memory though, as until they're written anything loading them would read stale data.
+    // Other threads can change them once we let go of the lock, but build_tree_writes has already
+    // copied the nodes into tree_writes, so that doesn't affect what gets written.
+    if (pipelined) {
+        clear_rollback(Vcb, rollback);
+        Vcb->commit_writing = TRUE;
+        ExConvertExclusiveToSharedLite(&Vcb->tree_lock);
+    }
+    
+    Status = checksum_and_write_trees(Vcb, &tree_writes, Irp);
+    if (!NT_SUCCESS(Status))
+        ERR("checksum_and_write_trees returned %08x\n", Status);
+    else {
+        commit_phase_done(Vcb, BTRFS_COMMIT_PHASE_TREES, &phase_start);
+        
+        Status = write_superblocks(Vcb, sb);
+        if (!NT_SUCCESS(Status))
+            ERR("write_superblocks returned %08x\n", Status);
+        else
+            commit_phase_done(Vcb, BTRFS_COMMIT_PHASE_SUPERBLOCKS, &phase_start);
+    }
+    
+    release_freed_space(Vcb, NT_SUCCESS(Status));
+    
+    ExFreePool(sb);
+    
+    // The in-memory trees now disagree with what's on disk, so we can't safely do another commit.
+    if (!NT_SUCCESS(Status)) {
+        ERR("transaction %llx could not be written, making volume readonly\n", Vcb->superblock.generation - 1);
+        Vcb->readonly = TRUE;
+        Vcb->commit_failed = TRUE;
+    }
+    
+    Vcb->commit_writing = FALSE;
+    
 end:
+    while (!IsListEmpty(&tree_writes)) {
+        tree_write* tw = CONTAINING_RECORD(RemoveHeadList(&tree_writes), tree_write, list_entry);
+        
+        ExFreePool(tw);
+    }
+    
+    commit_done(Vcb, &commit_start, NT_SUCCESS(Status), filerefs, fcbs, trees);
+    
     TRACE("do_write returning %08x\n", Status);
     
     return Status;
 }
 
+NTSTATUS STDCALL do_write(device_extension* Vcb, PIRP Irp, LIST_ENTRY* rollback) {
+    return do_write2(Vcb, Irp, rollback, FALSE);
+}
+
 #ifdef DEBUG_STATS
 static void print_stats(device_extension* Vcb) {
     ERR("READ STATS:\n");
@@ -5595,6 +6519,12 @@ static void print_stats(device_extension* Vcb) {
     ERR("number of creates: %llu\n", Vcb->stats.num_creates);
     ERR("total time taken: %llu\n", Vcb->stats.create_total_time);
     
+    ERR("FLUSH STATS:\n");
+    ERR("number of flushes: %llu\n", Vcb->stats.num_fcb_flushes);
+    ERR("fcbs flushed: %llu\n", Vcb->stats.fcbs_flushed);
+    ERR("subvolume jobs: %llu\n", Vcb->stats.fcb_flush_jobs);
+    ERR("total time taken: %llu\n", Vcb->stats.fcb_flush_time);
+    
     RtlZeroMemory(&Vcb->stats, sizeof(debug_stats));
 }
 #endif
@@ -5612,22 +6542,92 @@ static void do_flush(device_extension* Vcb) {
     print_stats(Vcb);
 #endif
 
-    if (Vcb->need_write && !Vcb->readonly)
-        do_write(Vcb, NULL, &rollback);
-    
-    free_trees(Vcb);
-    
-    clear_rollback(Vcb, &rollback);
+    if (Vcb->need_write && !Vcb->readonly) {
+        do_write2(Vcb, NULL, &rollback, TRUE);
+        
+        if (ExIsResourceAcquiredExclusiveLite(&Vcb->tree_lock)) {
+            free_trees(Vcb);
+            clear_rollback(Vcb, &rollback);
+        } else {
+            // do_write2 downgraded the lock, so other threads may have changed trees since the commit
+            ExReleaseResourceLite(&Vcb->tree_lock);
+            ExAcquireResourceExclusiveLite(&Vcb->tree_lock, TRUE);
+            
+            free_clean_trees(Vcb);
+        }
+    } else if (Vcb->open_trees > IDLE_TREE_CACHE_LIMIT) {
+        // Nothing's been written, so the trees are only a cache, e.g. of what the readahead
+        // threads have loaded. Keep them unless there are too many.
+        free_trees(Vcb);
+    }
 
     ExReleaseResourceLite(&Vcb->tree_lock);
 
     FsRtlExitFileSystem();
 }
 
+// Returns how full we are, as a percentage of the soft limit of whichever kind
+// of dirty metadata is closest to its limit.
+static ULONG dirty_level(device_extension* Vcb) {
+    UINT64 level, l;
+    
+    level = ((UINT64)Vcb->dirty_tree_count * Vcb->superblock.node_size * 100) / DIRTY_TREES_SOFT_LIMIT;
+    
+    l = ((UINT64)Vcb->dirty_fcb_count * 100) / DIRTY_FCBS_SOFT_LIMIT;
+    level = max(level, l);
+    
+    l = ((UINT64)Vcb->dirty_csum_count * 100) / DIRTY_CSUMS_SOFT_LIMIT;
+    level = max(level, l);
+    
+    return (ULONG)min(level, 0xffffffff);
+}
+
+void check_dirty_limits(device_extension* Vcb) {
+    if (dirty_level(Vcb) >= 100)
+        KeSetEvent(&Vcb->flush_thread_wake, 0, FALSE);
+}
+
+void throttle_writes(device_extension* Vcb) {
+    ULONG level, i;
+    LARGE_INTEGER delay;
+    
+    if (Vcb->readonly)
+        return;
+    
+    level = dirty_level(Vcb);
+    
+    if (level < 100)
+        return;
+    
+    KeSetEvent(&Vcb->flush_thread_wake, 0, FALSE);
+    
+    if (level < 100 * DIRTY_HARD_LIMIT_FACTOR) {
+        delay.QuadPart = -10000 * (LONGLONG)((level - 100) * THROTTLE_MAX_DELAY / (100 * (DIRTY_HARD_LIMIT_FACTOR - 1)));
+        
+        if (delay.QuadPart != 0)
+            KeDelayExecutionThread(KernelMode, FALSE, &delay);
+        
+        return;
+    }
+    
+    // Over the hard limit - wait for the flush thread to catch up, but don't
+    // wait forever in case the commit is failing.
+    
+    delay.QuadPart = -10000 * (LONGLONG)THROTTLE_MAX_DELAY;
+    
+    for (i = 0; i < THROTTLE_MAX_WAITS; i++) {
+        KeDelayExecutionThread(KernelMode, FALSE, &delay);
+        
+        if (dirty_level(Vcb) < 100 * DIRTY_HARD_LIMIT_FACTOR)
+            break;
+    }
+}
+
 void STDCALL flush_thread(void* context) {
     DEVICE_OBJECT* devobj = context;
     device_extension* Vcb = devobj->DeviceExtension;
     LARGE_INTEGER due_time;
+    PVOID objects[2];
     
     ObReferenceObject(devobj);
     
@@ -5637,12 +6637,19 @@ void STDCALL flush_thread(void* context) {
     
     KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
     
+    objects[0] = &Vcb->flush_thread_timer;
+    objects[1] = &Vcb->flush_thread_wake;
+    
     while (TRUE) {
-        KeWaitForSingleObject(&Vcb->flush_thread_timer, Executive, KernelMode, FALSE, NULL);
+        KeWaitForMultipleObjects(2, objects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
 
         if (!(devobj->Vpb->Flags & VPB_MOUNTED) || Vcb->removing)
             break;
             
+        // Clear this before committing, not after - writers can carry on while the commit's being
+        // written, and if they cross the limits again we need to go round again straight away.
+        KeClearEvent(&Vcb->flush_thread_wake);
+        
         do_flush(Vcb);
         
         KeSetTimer(&Vcb->flush_thread_timer, due_time, NULL);
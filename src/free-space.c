@@ -193,6 +193,8 @@ size:
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS add_loaded_space(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length);
+
 static void load_free_space_bitmap(device_extension* Vcb, chunk* c, UINT64 offset, void* data, UINT64* total_space) {
     RTL_BITMAP bmph;
     UINT32 i, *dwords = data;
@@ -214,7 +216,7 @@ static void load_free_space_bitmap(device_extension* Vcb, chunk* c, UINT64 offse
         addr = offset + (index * Vcb->superblock.sector_size);
         length = Vcb->superblock.sector_size * runlength;
         
-        add_space_entry(&c->space, &c->space_size, addr, length);
+        add_loaded_space(Vcb, c, addr, length);
         index += runlength;
         *total_space += length;
        
@@ -246,6 +248,228 @@ static void order_space_entry(space* s, LIST_ENTRY* list_size) {
     InsertTailList(list_size, &s->list_entry_size);
 }
 
+// Chunks whose free space is split into lots of small holes keep it as a bitmap of
+// one bit per sector rather than as a list of space entries, so that the memory
+// used doesn't depend on how fragmented the chunk is. A set bit means the sector
+// is in use. We switch when the list would be bigger than the bitmap, and switch
+// back when it would be a quarter of the size.
+#define SPACE_BITMAP_MIN_ENTRIES    1024
+
+static ULONG space_bitmap_bits(device_extension* Vcb, chunk* c) {
+    return (ULONG)(c->chunk_item->size / Vcb->superblock.sector_size);
+}
+
+static BOOL space_bitmap_worthwhile(device_extension* Vcb, chunk* c, UINT64 num_entries) {
+    if (num_entries < SPACE_BITMAP_MIN_ENTRIES)
+        return FALSE;
+    
+    return num_entries * sizeof(space) > sector_align(space_bitmap_bits(Vcb, c), 32) / 8;
+}
+
+static BOOL space_bitmap_range(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length, BOOL freeing, ULONG* index, ULONG* count) {
+    UINT64 start, end;
+    
+    if (address + length <= c->offset || address >= c->offset + c->chunk_item->size)
+        return FALSE;
+    
+    start = max(address, c->offset) - c->offset;
+    end = min(address + length, c->offset + c->chunk_item->size) - c->offset;
+    
+    // only free whole sectors, but mark any partial sector as used
+    if (freeing) {
+        start = sector_align(start, Vcb->superblock.sector_size);
+        end -= end % Vcb->superblock.sector_size;
+    } else {
+        start -= start % Vcb->superblock.sector_size;
+        end = sector_align(end, Vcb->superblock.sector_size);
+    }
+    
+    if (end <= start)
+        return FALSE;
+    
+    *index = (ULONG)(start / Vcb->superblock.sector_size);
+    *count = (ULONG)((end - start) / Vcb->superblock.sector_size);
+    
+    return TRUE;
+}
+
+static NTSTATUS convert_space_to_bitmap(device_extension* Vcb, chunk* c) {
+    ULONG bits = space_bitmap_bits(Vcb, c), index, count;
+    ULONG* buf;
+    
+    buf = ExAllocatePoolWithTag(PagedPool, sector_align(bits, 32) / 8, ALLOC_TAG);
+    if (!buf) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlInitializeBitMap(&c->space_bitmap, buf, bits);
+    RtlSetAllBits(&c->space_bitmap);
+    
+    while (!IsListEmpty(&c->space)) {
+        space* s = CONTAINING_RECORD(RemoveHeadList(&c->space), space, list_entry);
+        
+        if (space_bitmap_range(Vcb, c, s->address, s->size, TRUE, &index, &count))
+            RtlClearBits(&c->space_bitmap, index, count);
+        
+        ExFreePool(s);
+    }
+    
+    InitializeListHead(&c->space_size);
+    
+    c->space_bitmap_buf = buf;
+    
+    TRACE("chunk %llx: now using free-space bitmap\n", c->offset);
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS convert_bitmap_to_space(device_extension* Vcb, chunk* c) {
+    LIST_ENTRY space_list, space_size_list;
+    ULONG index, runstart, runlength;
+    
+    InitializeListHead(&space_list);
+    InitializeListHead(&space_size_list);
+    
+    index = 0;
+    while (index < c->space_bitmap.SizeOfBitMap) {
+        space* s;
+        
+        runlength = RtlFindNextForwardRunClear(&c->space_bitmap, index, &runstart);
+        if (runlength == 0)
+            break;
+        
+        s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
+        if (!s) {
+            ERR("out of memory\n");
+            
+            while (!IsListEmpty(&space_list)) {
+                s = CONTAINING_RECORD(RemoveHeadList(&space_list), space, list_entry);
+                ExFreePool(s);
+            }
+            
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        s->address = c->offset + ((UINT64)runstart * Vcb->superblock.sector_size);
+        s->size = (UINT64)runlength * Vcb->superblock.sector_size;
+        InsertTailList(&space_list, &s->list_entry);
+        order_space_entry(s, &space_size_list);
+        
+        index = runstart + runlength;
+    }
+    
+    while (!IsListEmpty(&space_list)) {
+        InsertTailList(&c->space, RemoveHeadList(&space_list));
+    }
+    
+    while (!IsListEmpty(&space_size_list)) {
+        InsertTailList(&c->space_size, RemoveHeadList(&space_size_list));
+    }
+    
+    free_space_bitmap(c);
+    
+    TRACE("chunk %llx: now using free-space list\n", c->offset);
+    
+    return STATUS_SUCCESS;
+}
+
+static void update_space_representation(device_extension* Vcb, chunk* c, UINT64 num_entries) {
+    NTSTATUS Status;
+    
+    if (!c->space_bitmap_buf && space_bitmap_worthwhile(Vcb, c, num_entries)) {
+        Status = convert_space_to_bitmap(Vcb, c);
+        if (!NT_SUCCESS(Status))
+            WARN("convert_space_to_bitmap returned %08x\n", Status);
+    } else if (c->space_bitmap_buf && !space_bitmap_worthwhile(Vcb, c, num_entries * 4)) {
+        Status = convert_bitmap_to_space(Vcb, c);
+        if (!NT_SUCCESS(Status))
+            WARN("convert_bitmap_to_space returned %08x\n", Status);
+    }
+}
+
+static UINT64 count_space_bitmap_runs(chunk* c) {
+    ULONG index, runstart, runlength;
+    UINT64 num_runs = 0;
+    
+    index = 0;
+    while (index < c->space_bitmap.SizeOfBitMap) {
+        runlength = RtlFindNextForwardRunClear(&c->space_bitmap, index, &runstart);
+        if (runlength == 0)
+            break;
+        
+        num_runs++;
+        index = runstart + runlength;
+    }
+    
+    return num_runs;
+}
+
+void free_space_bitmap(chunk* c) {
+    if (c->space_bitmap_buf) {
+        ExFreePool(c->space_bitmap_buf);
+        c->space_bitmap_buf = NULL;
+    }
+}
+
+BOOL find_space_bitmap_run(device_extension* Vcb, chunk* c, UINT64 start, UINT64* address, UINT64* length) {
+    ULONG index, runstart, runlength;
+    
+    if (start < c->offset)
+        start = c->offset;
+    
+    index = (ULONG)(sector_align(start - c->offset, Vcb->superblock.sector_size) / Vcb->superblock.sector_size);
+    
+    if (index >= c->space_bitmap.SizeOfBitMap)
+        return FALSE;
+    
+    runlength = RtlFindNextForwardRunClear(&c->space_bitmap, index, &runstart);
+    if (runlength == 0)
+        return FALSE;
+    
+    *address = c->offset + ((UINT64)runstart * Vcb->superblock.sector_size);
+    *length = (UINT64)runlength * Vcb->superblock.sector_size;
+    
+    return TRUE;
+}
+
+BOOL find_space_bitmap_address(device_extension* Vcb, chunk* c, UINT64 length, UINT64 hint, UINT64* address) {
+    ULONG count, hintindex = 0, index;
+    
+    if (length > c->chunk_item->size)
+        return FALSE;
+    
+    count = (ULONG)(sector_align(length, Vcb->superblock.sector_size) / Vcb->superblock.sector_size);
+    
+    if (hint > c->offset) {
+        if (hint >= c->offset + c->chunk_item->size)
+            return FALSE;
+        
+        hintindex = (ULONG)(sector_align(hint - c->offset, Vcb->superblock.sector_size) / Vcb->superblock.sector_size);
+    }
+    
+    // RtlFindClearBits wraps round to the start of the bitmap, so ignore anything before the hint
+    index = RtlFindClearBits(&c->space_bitmap, count, hintindex);
+    if (index == 0xffffffff || index < hintindex)
+        return FALSE;
+    
+    *address = c->offset + ((UINT64)index * Vcb->superblock.sector_size);
+    
+    return TRUE;
+}
+
+static NTSTATUS add_loaded_space(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length) {
+    ULONG index, count;
+    
+    if (!c->space_bitmap_buf)
+        return add_space_entry(&c->space, &c->space_size, address, length);
+    
+    if (space_bitmap_range(Vcb, c, address, length, TRUE, &index, &count))
+        RtlClearBits(&c->space_bitmap, index, count);
+    
+    return STATUS_SUCCESS;
+}
+
 typedef struct {
     UINT64 stripe;
     LIST_ENTRY list_entry;
@@ -517,6 +741,13 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
         }
     }
     
+    // bitmaps on disk usually mean the chunk is badly fragmented
+    if (num_bitmaps > 0 || space_bitmap_worthwhile(Vcb, c, num_entries)) {
+        Status = convert_space_to_bitmap(Vcb, c);
+        if (!NT_SUCCESS(Status))
+            WARN("convert_space_to_bitmap returned %08x\n", Status);
+    }
+    
     off = (sizeof(UINT32) * num_sectors) + sizeof(UINT64);
 
     bmpnum = 0;
@@ -527,9 +758,9 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
         fse = (FREE_SPACE_ENTRY*)&data[off];
         
         if (fse->type == FREE_SPACE_EXTENT) {
-            Status = add_space_entry(&c->space, &c->space_size, fse->offset, fse->size);
+            Status = add_loaded_space(Vcb, c, fse->offset, fse->size);
             if (!NT_SUCCESS(Status)) {
-                ERR("add_space_entry returned %08x\n", Status);
+                ERR("add_loaded_space returned %08x\n", Status);
                 ExFreePool(data);
                 return Status;
             }
@@ -608,6 +839,8 @@ static NTSTATUS load_stored_free_space_cache(device_extension* Vcb, chunk* c, PI
 clearcache:
     ExFreePool(data);
     
+    free_space_bitmap(c);
+    
     InitializeListHead(&rollback);
     
     delete_tree_item(Vcb, &tp, &rollback);
@@ -636,6 +869,7 @@ NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
     BOOL b;
     space* s;
     NTSTATUS Status;
+    UINT64 num_entries = 0;
 //     LIST_ENTRY* le;
     
     if (Vcb->superblock.generation - 1 == Vcb->superblock.cache_generation) {
@@ -681,6 +915,7 @@ NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
                     InsertTailList(&c->space, &s->list_entry);
                     
                     order_space_entry(s, &c->space_size);
+                    num_entries++;
                     
                     TRACE("(%llx,%llx)\n", s->address, s->size);
                 }
@@ -709,9 +944,12 @@ NTSTATUS load_free_space_cache(device_extension* Vcb, chunk* c, PIRP Irp) {
             InsertTailList(&c->space, &s->list_entry);
             
             order_space_entry(s, &c->space_size);
+            num_entries++;
             
             TRACE("(%llx,%llx)\n", s->address, s->size);
         }
+        
+        update_space_representation(Vcb, c, num_entries);
     }
     
 //     le = c->space_size.Flink;
@@ -794,7 +1032,9 @@ static NTSTATUS allocate_cache_chunk(device_extension* Vcb, chunk* c, BOOL* chan
     // num_entries is the number of entries in c->space and c->deleting - it might
     // be slightly higher then what we end up writing, but doing it this way is much
     // quicker and simpler.
-    if (!IsListEmpty(&c->space)) {
+    if (c->space_bitmap_buf)
+        num_entries = count_space_bitmap_runs(c);
+    else if (!IsListEmpty(&c->space)) {
         le = c->space.Flink;
         while (le != &c->space) {
             num_entries++;
@@ -1065,21 +1305,72 @@ NTSTATUS allocate_cache(device_extension* Vcb, BOOL* changed, PIRP Irp, LIST_ENT
 }
 
 static void add_rollback_space(device_extension* Vcb, LIST_ENTRY* rollback, BOOL add, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c) {
-    rollback_space* rs;
+    rollback_space rs;
     
-    rs = ExAllocatePoolWithTag(PagedPool, sizeof(rollback_space), ALLOC_TAG);
-    if (!rs) {
-        ERR("out of memory\n");
+    rs.list = list;
+    rs.list_size = list_size;
+    rs.address = address;
+    rs.length = length;
+    rs.chunk = c;
+    
+    add_rollback(Vcb, rollback, add ? ROLLBACK_ADD_SPACE : ROLLBACK_SUBTRACT_SPACE, &rs);
+}
+
+static void space_bitmap_add(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length, LIST_ENTRY* rollback) {
+    ULONG index, count, pos, runstart, runlength;
+    
+    if (!space_bitmap_range(Vcb, c, address, length, TRUE, &index, &count))
         return;
+    
+    // only record the parts which weren't already free
+    if (rollback) {
+        pos = index;
+        while (pos < index + count) {
+            runlength = RtlFindNextForwardRunClear(&c->space_bitmap, pos, &runstart);
+            
+            if (runlength == 0 || runstart >= index + count) {
+                add_rollback_space(Vcb, rollback, TRUE, &c->space, &c->space_size, c->offset + ((UINT64)pos * Vcb->superblock.sector_size),
+                                   (UINT64)(index + count - pos) * Vcb->superblock.sector_size, c);
+                break;
+            }
+            
+            if (runstart > pos) {
+                add_rollback_space(Vcb, rollback, TRUE, &c->space, &c->space_size, c->offset + ((UINT64)pos * Vcb->superblock.sector_size),
+                                   (UINT64)(runstart - pos) * Vcb->superblock.sector_size, c);
+            }
+            
+            pos = runstart + runlength;
+        }
     }
     
-    rs->list = list;
-    rs->list_size = list_size;
-    rs->address = address;
-    rs->length = length;
-    rs->chunk = c;
+    RtlClearBits(&c->space_bitmap, index, count);
+}
+
+static void space_bitmap_subtract(device_extension* Vcb, chunk* c, UINT64 address, UINT64 length, LIST_ENTRY* rollback) {
+    ULONG index, count, pos, runstart, runlength;
+    
+    if (!space_bitmap_range(Vcb, c, address, length, FALSE, &index, &count))
+        return;
+    
+    // only record the parts which were free
+    if (rollback) {
+        pos = index;
+        while (pos < index + count) {
+            runlength = RtlFindNextForwardRunClear(&c->space_bitmap, pos, &runstart);
+            
+            if (runlength == 0 || runstart >= index + count)
+                break;
+            
+            runlength = min(runlength, index + count - runstart);
+            
+            add_rollback_space(Vcb, rollback, FALSE, &c->space, &c->space_size, c->offset + ((UINT64)runstart * Vcb->superblock.sector_size),
+                               (UINT64)runlength * Vcb->superblock.sector_size, c);
+            
+            pos = runstart + runlength;
+        }
+    }
     
-    add_rollback(Vcb, rollback, add ? ROLLBACK_ADD_SPACE : ROLLBACK_SUBTRACT_SPACE, rs);
+    RtlSetBits(&c->space_bitmap, index, count);
 }
 
 void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_size, UINT64 address, UINT64 length, chunk* c, LIST_ENTRY* rollback, const char* func) {
@@ -1090,6 +1381,11 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
     _debug_message(func, "called space_list_add (%p, %llx, %llx, %p)\n", list, address, length, rollback);
 #endif
     
+    if (c && list == &c->space && c->space_bitmap_buf) {
+        space_bitmap_add(Vcb, c, address, length, rollback);
+        return;
+    }
+    
     if (IsListEmpty(list)) {
         s = ExAllocatePoolWithTag(PagedPool, sizeof(space), ALLOC_TAG);
 
@@ -1297,7 +1593,7 @@ void _space_list_add2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY* list_
         add_rollback_space(Vcb, rollback, TRUE, list, list_size, address, length, c);
 }
 
-static void space_list_merge(device_extension* Vcb, LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting) {
+static void space_list_merge(device_extension* Vcb, chunk* c, LIST_ENTRY* spacelist, LIST_ENTRY* spacelist_size, LIST_ENTRY* deleting) {
     LIST_ENTRY* le;
     
     if (!IsListEmpty(deleting)) {
@@ -1305,7 +1601,7 @@ static void space_list_merge(device_extension* Vcb, LIST_ENTRY* spacelist, LIST_
         while (le != deleting) {
             space* s = CONTAINING_RECORD(le, space, list_entry);
             
-            space_list_add2(Vcb, spacelist, spacelist_size, s->address, s->size, NULL);
+            _space_list_add2(Vcb, spacelist, spacelist_size, s->address, s->size, c, NULL, funcname);
             
             le = le->Flink;
         }
@@ -1323,7 +1619,7 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     UINT32* checksums;
     LIST_ENTRY* le;
     
-    space_list_merge(Vcb, &c->space, &c->space_size, &c->deleting);
+    space_list_merge(Vcb, c, &c->space, &c->space_size, &c->deleting);
     
     data = ExAllocatePoolWithTag(NonPagedPool, c->cache->inode_item.st_size, ALLOC_TAG);
     if (!data) {
@@ -1337,23 +1633,43 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
     num_sectors = c->cache->inode_item.st_size / Vcb->superblock.sector_size;
     off = (sizeof(UINT32) * num_sectors) + sizeof(UINT64);
     
-    le = c->space.Flink;
-    while (le != &c->space) {
-        space* s = CONTAINING_RECORD(le, space, list_entry);
-
-        if ((off + sizeof(FREE_SPACE_ENTRY)) / Vcb->superblock.sector_size != off / Vcb->superblock.sector_size)
-            off = sector_align(off, Vcb->superblock.sector_size);
-        
-        fse = (FREE_SPACE_ENTRY*)((UINT8*)data + off);
+    if (c->space_bitmap_buf) {
+        UINT64 address = c->offset, length;
         
-        fse->offset = s->address;
-        fse->size = s->size;
-        fse->type = FREE_SPACE_EXTENT;
-        num_entries++;
-        
-        off += sizeof(FREE_SPACE_ENTRY);
-        
-        le = le->Flink;
+        while (find_space_bitmap_run(Vcb, c, address, &address, &length)) {
+            if ((off + sizeof(FREE_SPACE_ENTRY)) / Vcb->superblock.sector_size != off / Vcb->superblock.sector_size)
+                off = sector_align(off, Vcb->superblock.sector_size);
+            
+            fse = (FREE_SPACE_ENTRY*)((UINT8*)data + off);
+            
+            fse->offset = address;
+            fse->size = length;
+            fse->type = FREE_SPACE_EXTENT;
+            num_entries++;
+            
+            off += sizeof(FREE_SPACE_ENTRY);
+            
+            address += length;
+        }
+    } else {
+        le = c->space.Flink;
+        while (le != &c->space) {
+            space* s = CONTAINING_RECORD(le, space, list_entry);
+            
+            if ((off + sizeof(FREE_SPACE_ENTRY)) / Vcb->superblock.sector_size != off / Vcb->superblock.sector_size)
+                off = sector_align(off, Vcb->superblock.sector_size);
+            
+            fse = (FREE_SPACE_ENTRY*)((UINT8*)data + off);
+            
+            fse->offset = s->address;
+            fse->size = s->size;
+            fse->type = FREE_SPACE_EXTENT;
+            num_entries++;
+            
+            off += sizeof(FREE_SPACE_ENTRY);
+            
+            le = le->Flink;
+        }
     }
 
     // update INODE_ITEM
@@ -1423,6 +1739,8 @@ static NTSTATUS update_chunk_cache(device_extension* Vcb, chunk* c, BTRFS_TIME*
 
     ExFreePool(data);
     
+    update_space_representation(Vcb, c, num_entries);
+    
     return STATUS_SUCCESS;
 }
 
@@ -1480,6 +1798,11 @@ void _space_list_subtract2(device_extension* Vcb, LIST_ENTRY* list, LIST_ENTRY*
     _debug_message(func, "called space_list_subtract (%p, %llx, %llx, %p)\n", list, address, length, rollback);
 #endif
     
+    if (c && list == &c->space && c->space_bitmap_buf) {
+        space_bitmap_subtract(Vcb, c, address, length, rollback);
+        return;
+    }
+    
     if (IsListEmpty(list))
         return;
     
@@ -936,7 +936,7 @@ static NTSTATUS create_subvol(device_extension* Vcb, PFILE_OBJECT FileObject, WC
     rootfcb->inode_item_changed = TRUE;
 
     ExAcquireResourceExclusiveLite(&Vcb->fcb_lock, TRUE);
-    InsertTailList(&r->fcbs, &rootfcb->list_entry);
+    add_fcb_to_subvol(rootfcb);
     InsertTailList(&Vcb->all_fcbs, &rootfcb->list_entry_all);
     ExReleaseResourceLite(&Vcb->fcb_lock);
     
@@ -1440,6 +1440,51 @@ end:
     return Status;
 }
 
+static NTSTATUS get_commit_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_commit_stats* stats;
+    KIRQL irql;
+    
+    if (!data || length < sizeof(btrfs_commit_stats))
+        return STATUS_BUFFER_OVERFLOW;
+    
+    // take a copy first, as data may be a user-mode buffer
+    stats = ExAllocatePoolWithTag(NonPagedPool, sizeof(btrfs_commit_stats), ALLOC_TAG);
+    if (!stats) {
+        ERR("out of memory\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    KeAcquireSpinLock(&Vcb->commit_stats_lock, &irql);
+    RtlCopyMemory(stats, &Vcb->commit_stats, sizeof(btrfs_commit_stats));
+    KeReleaseSpinLock(&Vcb->commit_stats_lock, irql);
+    
+    RtlCopyMemory(data, stats, sizeof(btrfs_commit_stats));
+    
+    ExFreePool(stats);
+    
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS get_lookup_stats(device_extension* Vcb, void* data, ULONG length) {
+    btrfs_lookup_stats* stats = data;
+    
+    if (!data || length < sizeof(btrfs_lookup_stats))
+        return STATUS_BUFFER_OVERFLOW;
+    
+    stats->negative_hits = Vcb->lookup_stats.negative_hits;
+    stats->negative_misses = Vcb->lookup_stats.negative_misses;
+    stats->negative_added = Vcb->lookup_stats.negative_added;
+    stats->negative_invalidated = Vcb->lookup_stats.negative_invalidated;
+    stats->path_hits = Vcb->lookup_stats.path_hits;
+    stats->path_misses = Vcb->lookup_stats.path_misses;
+    stats->path_flushes = Vcb->lookup_stats.path_flushes;
+    stats->readahead_jobs = Vcb->lookup_stats.readahead_jobs;
+    stats->readahead_inodes = Vcb->lookup_stats.readahead_inodes;
+    stats->readahead_skipped = Vcb->lookup_stats.readahead_skipped;
+    
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS is_volume_mounted(device_extension* Vcb, PIRP Irp) {
     UINT64 i, num_devices;
     NTSTATUS Status;
@@ -2809,6 +2854,14 @@ NTSTATUS fsctl_request(PDEVICE_OBJECT DeviceObject, PIRP Irp, UINT32 type, BOOL
         case FSCTL_BTRFS_START_BALANCE:
             Status = start_balance(DeviceObject->DeviceExtension);
             break;
+        
+        case FSCTL_BTRFS_GET_COMMIT_STATS:
+            Status = get_commit_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
+        
+        case FSCTL_BTRFS_GET_LOOKUP_STATS:
+            Status = get_lookup_stats(DeviceObject->DeviceExtension, map_user_buffer(Irp), IrpSp->Parameters.FileSystemControl.OutputBufferLength);
+            break;
 
         default:
             TRACE("unknown control code %x (DeviceType = %x, Access = %x, Function = %x, Method = %x)\n",
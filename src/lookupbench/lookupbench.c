@@ -0,0 +1,207 @@
+/* Copyright (c) Mark Harmstone 2016
+ * 
+ * This file is part of WinBtrfs.
+ * 
+ * WinBtrfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ * 
+ * WinBtrfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with WinBtrfs.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Walks a directory tree the way a backup agent or indexer does - list each directory, then open
+// everything in it - and reports how many opens a second we managed, along with what the driver's
+// lookup caches and directory readahead did in the meantime. For a cold run, remount the volume first.
+//
+// lookupbench -create <files> <dir> fills dir with that many empty files, 1000 to a directory.
+
+#include <windows.h>
+#include <winternl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../btrfsioctl.h"
+
+NTSYSCALLAPI NTSTATUS NTAPI NtFsControlFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, ULONG FsControlCode, PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength);
+
+#define STATUS_SUCCESS (NTSTATUS)0x00000000
+
+#define PATH_LEN 32768
+#define FILES_PER_DIR 1000
+
+typedef struct {
+    UINT64 dirs;
+    UINT64 opens;
+    UINT64 failed;
+} scan_counts;
+
+static BOOL get_lookup_stats(HANDLE h, btrfs_lookup_stats* stats) {
+    NTSTATUS Status;
+    IO_STATUS_BLOCK iosb;
+    
+    Status = NtFsControlFile(h, NULL, NULL, NULL, &iosb, FSCTL_BTRFS_GET_LOOKUP_STATS, NULL, 0, stats, sizeof(btrfs_lookup_stats));
+    
+    return Status == STATUS_SUCCESS;
+}
+
+static void scan_dir(WCHAR* path, size_t len, scan_counts* counts) {
+    WIN32_FIND_DATAW fd;
+    HANDLE find;
+    
+    if (len + 3 >= PATH_LEN)
+        return;
+    
+    wcscpy(&path[len], L"\\*");
+    
+    find = FindFirstFileW(path, &fd);
+    if (find == INVALID_HANDLE_VALUE) {
+        counts->failed++;
+        return;
+    }
+    
+    counts->dirs++;
+    
+    do {
+        size_t namelen = wcslen(fd.cFileName);
+        HANDLE h;
+        
+        if (!wcscmp(fd.cFileName, L".") || !wcscmp(fd.cFileName, L".."))
+            continue;
+        
+        if (len + 1 + namelen >= PATH_LEN)
+            continue;
+        
+        path[len] = '\\';
+        wcscpy(&path[len + 1], fd.cFileName);
+        
+        h = CreateFileW(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+        
+        if (h == INVALID_HANDLE_VALUE)
+            counts->failed++;
+        else {
+            counts->opens++;
+            CloseHandle(h);
+        }
+        
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY && !(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            scan_dir(path, len + 1 + namelen, counts);
+    } while (FindNextFileW(find, &fd));
+    
+    FindClose(find);
+}
+
+static int create_tree(WCHAR* dir, ULONG num_files) {
+    WCHAR path[MAX_PATH];
+    ULONG i;
+    
+    for (i = 0; i < num_files; i++) {
+        HANDLE h;
+        
+        if (i % FILES_PER_DIR == 0) {
+            _snwprintf(path, MAX_PATH, L"%s\\d%u", dir, i / FILES_PER_DIR);
+            path[MAX_PATH - 1] = 0;
+            
+            if (!CreateDirectoryW(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+                fwprintf(stderr, L"could not create %s (error %u)\n", path, GetLastError());
+                return 1;
+            }
+        }
+        
+        _snwprintf(path, MAX_PATH, L"%s\\d%u\\f%u", dir, i / FILES_PER_DIR, i % FILES_PER_DIR);
+        path[MAX_PATH - 1] = 0;
+        
+        h = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            fwprintf(stderr, L"could not create %s (error %u)\n", path, GetLastError());
+            return 1;
+        }
+        
+        CloseHandle(h);
+    }
+    
+    wprintf(L"created %u files in %s\n", num_files, dir);
+    
+    return 0;
+}
+
+static void print_stat(const WCHAR* name, UINT64 before, UINT64 after) {
+    wprintf(L"  %-22s %llu\n", name, after - before);
+}
+
+int wmain(int argc, WCHAR* argv[]) {
+    WCHAR* path;
+    HANDLE h;
+    btrfs_lookup_stats before, after;
+    BOOL have_stats;
+    scan_counts counts;
+    LARGE_INTEGER freq, start, end;
+    double secs;
+    
+    if (argc == 4 && !wcscmp(argv[1], L"-create"))
+        return create_tree(argv[3], wcstoul(argv[2], NULL, 10));
+    
+    if (argc != 2) {
+        fwprintf(stderr, L"usage: lookupbench <dir>\n       lookupbench -create <files> <dir>\n");
+        return 1;
+    }
+    
+    h = CreateFileW(argv[1], FILE_TRAVERSE | FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                    OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        fwprintf(stderr, L"could not open %s (error %u)\n", argv[1], GetLastError());
+        return 1;
+    }
+    
+    have_stats = get_lookup_stats(h, &before);
+    if (!have_stats)
+        fwprintf(stderr, L"could not get lookup stats - is %s on a btrfs volume?\n", argv[1]);
+    
+    path = malloc(PATH_LEN * sizeof(WCHAR));
+    if (!path) {
+        fwprintf(stderr, L"out of memory\n");
+        CloseHandle(h);
+        return 1;
+    }
+    
+    wcsncpy(path, argv[1], PATH_LEN - 1);
+    path[PATH_LEN - 1] = 0;
+    
+    counts.dirs = counts.opens = counts.failed = 0;
+    
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    
+    scan_dir(path, wcslen(path), &counts);
+    
+    QueryPerformanceCounter(&end);
+    
+    secs = (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+    
+    wprintf(L"%llu directories, %llu opens, %llu failed, in %.3f s\n", counts.dirs, counts.opens, counts.failed, secs);
+    wprintf(L"%.0f opens/s\n", secs > 0.0 ? (double)counts.opens / secs : 0.0);
+    
+    if (have_stats && get_lookup_stats(h, &after)) {
+        wprintf(L"lookup stats during scan:\n");
+        print_stat(L"negative_hits", before.negative_hits, after.negative_hits);
+        print_stat(L"negative_misses", before.negative_misses, after.negative_misses);
+        print_stat(L"negative_added", before.negative_added, after.negative_added);
+        print_stat(L"negative_invalidated", before.negative_invalidated, after.negative_invalidated);
+        print_stat(L"path_hits", before.path_hits, after.path_hits);
+        print_stat(L"path_misses", before.path_misses, after.path_misses);
+        print_stat(L"path_flushes", before.path_flushes, after.path_flushes);
+        print_stat(L"readahead_jobs", before.readahead_jobs, after.readahead_jobs);
+        print_stat(L"readahead_inodes", before.readahead_inodes, after.readahead_inodes);
+        print_stat(L"readahead_skipped", before.readahead_skipped, after.readahead_skipped);
+    }
+    
+    free(path);
+    CloseHandle(h);
+    
+    return 0;
+}
@@ -3332,6 +3332,10 @@ nextitem:
         length -= read;
     }
     
+    // overlay anything written by the lazy writer which hasn't been allocated yet
+    if (!IsListEmpty(&fcb->delalloc))
+        read_delalloc(fcb, data, start, bytes_read);
+    
     Status = STATUS_SUCCESS;
     if (pbr)
         *pbr = bytes_read;
@@ -27,7 +27,7 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     BTRFS_UUID* uuid = &Vcb->superblock.uuid;
     mount_options* options = &Vcb->options;
     UNICODE_STRING path, ignoreus, compressus, compressforceus, compresstypeus, readonlyus, zliblevelus, flushintervalus,
-                   maxinlineus, subvolidus, raid5recalcus, raid6recalcus;
+                   maxinlineus, subvolidus, raid5recalcus, raid6recalcus, notrimus, trimonmountus;
     OBJECT_ATTRIBUTES oa;
     NTSTATUS Status;
     ULONG i, j, kvfilen, index, retlen;
@@ -43,6 +43,8 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     options->max_inline = min(mount_max_inline, Vcb->superblock.node_size - sizeof(tree_header) - sizeof(leaf_node) - sizeof(EXTENT_DATA) + 1);
     options->raid5_recalculation = mount_raid5_recalculation;
     options->raid6_recalculation = mount_raid6_recalculation;
+    options->no_trim = mount_no_trim;
+    options->trim_on_mount = mount_trim_on_mount;
     options->subvol_id = 0;
     
     path.Length = path.MaximumLength = registry_path.Length + (37 * sizeof(WCHAR));
@@ -103,6 +105,8 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
     RtlInitUnicodeString(&subvolidus, L"SubvolId");
     RtlInitUnicodeString(&raid5recalcus, L"Raid5Recalculation");
     RtlInitUnicodeString(&raid6recalcus, L"Raid6Recalculation");
+    RtlInitUnicodeString(&notrimus, L"NoTrim");
+    RtlInitUnicodeString(&trimonmountus, L"TrimOnMount");
     
     do {
         Status = ZwEnumerateValueKey(h, index, KeyValueFullInformation, kvfi, kvfilen, &retlen);
@@ -159,6 +163,14 @@ NTSTATUS registry_load_volume_options(device_extension* Vcb) {
                 DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
                 
                 options->raid6_recalculation = *val;
+            } else if (FsRtlAreNamesEqual(&notrimus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+                
+                options->no_trim = *val != 0 ? TRUE : FALSE;
+            } else if (FsRtlAreNamesEqual(&trimonmountus, &us, TRUE, NULL) && kvfi->DataOffset > 0 && kvfi->DataLength > 0 && kvfi->Type == REG_DWORD) {
+                DWORD* val = (DWORD*)((UINT8*)kvfi + kvfi->DataOffset);
+                
+                options->trim_on_mount = *val != 0 ? TRUE : FALSE;
             }
         } else if (Status != STATUS_NO_MORE_ENTRIES) {
             ERR("ZwEnumerateValueKey returned %08x\n", Status);
@@ -649,6 +661,8 @@ void STDCALL read_registry(PUNICODE_STRING regpath) {
     get_registry_value(h, L"MaxInline", REG_DWORD, &mount_max_inline, sizeof(mount_max_inline));
     get_registry_value(h, L"Raid5Recalculation", REG_DWORD, &mount_raid5_recalculation, sizeof(mount_raid5_recalculation));
     get_registry_value(h, L"Raid6Recalculation", REG_DWORD, &mount_raid6_recalculation, sizeof(mount_raid6_recalculation));
+    get_registry_value(h, L"NoTrim", REG_DWORD, &mount_no_trim, sizeof(mount_no_trim));
+    get_registry_value(h, L"TrimOnMount", REG_DWORD, &mount_trim_on_mount, sizeof(mount_trim_on_mount));
     
     if (mount_flush_interval == 0)
         mount_flush_interval = 1;
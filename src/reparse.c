@@ -381,6 +381,13 @@ end:
         clear_rollback(fcb->Vcb, &rollback);
     else
         do_rollback(fcb->Vcb, &rollback);
+    
+    // a directory becoming or ceasing to be a reparse point changes how paths through it are resolved
+    if (NT_SUCCESS(Status) && fcb->type == BTRFS_TYPE_DIRECTORY) {
+        ExAcquireResourceExclusiveLite(&fcb->Vcb->fcb_lock, TRUE);
+        flush_path_cache(fcb->Vcb);
+        ExReleaseResourceLite(&fcb->Vcb->fcb_lock);
+    }
 
     ExReleaseResourceLite(fcb->Header.Resource);
     ExReleaseResourceLite(&fcb->Vcb->tree_lock);
@@ -573,6 +580,13 @@ end:
     else
         do_rollback(fcb->Vcb, &rollback);
     
+    // a directory becoming or ceasing to be a reparse point changes how paths through it are resolved
+    if (NT_SUCCESS(Status) && fcb->type == BTRFS_TYPE_DIRECTORY) {
+        ExAcquireResourceExclusiveLite(&fcb->Vcb->fcb_lock, TRUE);
+        flush_path_cache(fcb->Vcb);
+        ExReleaseResourceLite(&fcb->Vcb->fcb_lock);
+    }
+    
     ExReleaseResourceLite(fcb->Header.Resource);
     ExReleaseResourceLite(&fcb->Vcb->tree_lock);
     
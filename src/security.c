@@ -889,6 +889,12 @@ static NTSTATUS STDCALL set_file_security(device_extension* Vcb, PFILE_OBJECT Fi
     
     send_notification_fcb(fileref, FILE_NOTIFY_CHANGE_SECURITY, FILE_ACTION_MODIFIED);
     
+    if (fcb->type == BTRFS_TYPE_DIRECTORY) {
+        ExAcquireResourceExclusiveLite(&Vcb->fcb_lock, TRUE);
+        flush_path_cache(Vcb);
+        ExReleaseResourceLite(&Vcb->fcb_lock);
+    }
+    
 end:
     ExReleaseResourceLite(fcb->Header.Resource);
 
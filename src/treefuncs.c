@@ -156,7 +156,11 @@ NTSTATUS STDCALL _load_tree(device_extension* Vcb, UINT64 addr, root* r, tree**
     ExFreePool(buf);
     
     InterlockedIncrement(&Vcb->open_trees);
+    
+    // trees in different roots can be loaded at the same time
+    ExAcquireResourceExclusiveLite(&Vcb->trees_list_lock, TRUE);
     InsertTailList(&Vcb->trees, &t->list_entry);
+    ExReleaseResourceLite(&Vcb->trees_list_lock);
     
     TRACE("returning %p\n", t);
     
@@ -205,7 +209,10 @@ static tree* free_tree2(tree* t, const char* func, const char* file, unsigned in
     }
     
     InterlockedDecrement(&t->Vcb->open_trees);
+    
+    ExAcquireResourceExclusiveLite(&t->Vcb->trees_list_lock, TRUE);
     RemoveEntryList(&t->list_entry);
+    ExReleaseResourceLite(&t->Vcb->trees_list_lock);
     
     if (r) {
         r->treeholder.tree = NULL;
@@ -733,18 +740,111 @@ void STDCALL free_trees(device_extension* Vcb) {
     }
 }
 
+// Like free_trees, but leaves alone any tree which has been changed, along with its parents,
+// for when other threads may have modified trees since the last commit.
+void free_clean_trees(device_extension* Vcb) {
+    LIST_ENTRY* le;
+    UINT8 level;
+    
+    for (level = 0; level <= 255; level++) {
+        BOOL empty = TRUE;
+        
+        le = Vcb->trees.Flink;
+        
+        while (le != &Vcb->trees) {
+            LIST_ENTRY* nextle = le->Flink;
+            tree* t = CONTAINING_RECORD(le, tree, list_entry);
+            root* r = t->root;
+            
+            if (t->header.level == level) {
+                BOOL top = !t->paritem, children = FALSE;
+                
+                empty = FALSE;
+                
+                // lower levels have already been done, so any child still loaded has to stay
+                if (level > 0) {
+                    LIST_ENTRY* le2 = t->itemlist.Flink;
+                    
+                    while (le2 != &t->itemlist) {
+                        tree_data* td = CONTAINING_RECORD(le2, tree_data, list_entry);
+                        
+                        if (td->treeholder.tree) {
+                            children = TRUE;
+                            break;
+                        }
+                        
+                        le2 = le2->Flink;
+                    }
+                }
+                
+                if (!t->write && !children) {
+                    free_tree2(t, funcname, __FILE__, __LINE__);
+                    if (top && r->treeholder.tree == t)
+                        r->treeholder.tree = NULL;
+                    
+                    if (IsListEmpty(&Vcb->trees))
+                        return;
+                }
+            } else if (t->header.level > level)
+                empty = FALSE;
+            
+            le = nextle;
+        }
+        
+        if (empty)
+            break;
+    }
+}
+
+// Rollback entries are appended to blocks of ROLLBACK_BLOCK_ITEMS, so that
+// the log only needs an allocation every few hundred changes, and can be
+// thrown away in one go if everything succeeds.
 void add_rollback(device_extension* Vcb, LIST_ENTRY* rollback, enum rollback_type type, void* ptr) {
+    rollback_block* rb = NULL;
     rollback_item* ri;
     
-    ri = ExAllocatePoolWithTag(PagedPool, sizeof(rollback_item), ALLOC_TAG);
-    if (!ri) {
-        ERR("out of memory\n");
-        return;
+    if (!IsListEmpty(rollback)) {
+        rb = CONTAINING_RECORD(rollback->Blink, rollback_block, list_entry);
+        
+        if (rb->count == ROLLBACK_BLOCK_ITEMS)
+            rb = NULL;
     }
     
+    if (!rb) {
+        rb = ExAllocateFromPagedLookasideList(&Vcb->rollback_block_lookaside);
+        if (!rb) {
+            ERR("out of memory\n");
+            return;
+        }
+        
+        rb->count = 0;
+        InsertTailList(rollback, &rb->list_entry);
+    }
+    
+    ri = &rb->items[rb->count];
     ri->type = type;
-    ri->ptr = ptr;
-    InsertTailList(rollback, &ri->list_entry);
+    
+    switch (type) {
+        case ROLLBACK_INSERT_ITEM:
+        case ROLLBACK_DELETE_ITEM:
+            ri->tp = *(traverse_ptr*)ptr;
+            break;
+        
+        case ROLLBACK_INSERT_EXTENT:
+        case ROLLBACK_DELETE_EXTENT:
+            ri->re = *(rollback_extent*)ptr;
+            break;
+        
+        case ROLLBACK_ADD_SPACE:
+        case ROLLBACK_SUBTRACT_SPACE:
+            ri->rs = *(rollback_space*)ptr;
+            break;
+        
+        default:
+            break;
+    }
+    
+    rb->count++;
 }
 
 BOOL STDCALL insert_tree_item(device_extension* Vcb, root* r, UINT64 obj_id, UINT8 obj_type, UINT64 offset, void* data, UINT32 size, traverse_ptr* ptp, PIRP Irp, LIST_ENTRY* rollback) {
@@ -757,7 +857,7 @@ BOOL STDCALL insert_tree_item(device_extension* Vcb, root* r, UINT64 obj_id, UIN
     LIST_ENTRY* le;
     KEY firstitem = {0xcccccccccccccccc,0xcc,0xcccccccccccccccc};
 #endif
-    traverse_ptr* tp2;
+    traverse_ptr tp2;
     BOOL success = FALSE;
     NTSTATUS Status;
     
@@ -878,6 +978,9 @@ BOOL STDCALL insert_tree_item(device_extension* Vcb, root* r, UINT64 obj_id, UIN
     if (!tp.tree->write) {
         tp.tree->write = TRUE;
         Vcb->need_write = TRUE;
+        
+        InterlockedIncrement(&Vcb->dirty_tree_count);
+        check_dirty_limits(Vcb);
     }
     
     if (ptp)
@@ -897,18 +1000,10 @@ BOOL STDCALL insert_tree_item(device_extension* Vcb, root* r, UINT64 obj_id, UIN
         t = t->parent;
     }
     
-    // FIXME - free this correctly
-    
-    tp2 = ExAllocateFromPagedLookasideList(&Vcb->traverse_ptr_lookaside);
-    if (!tp2) {
-        ERR("out of memory\n");
-        goto end;
-    }
+    tp2.tree = tp.tree;
+    tp2.item = td;
     
-    tp2->tree = tp.tree;
-    tp2->item = td;
-    
-    add_rollback(Vcb, rollback, ROLLBACK_INSERT_ITEM, tp2);
+    add_rollback(Vcb, rollback, ROLLBACK_INSERT_ITEM, &tp2);
     
     success = TRUE;
 
@@ -934,7 +1029,7 @@ static __inline tree_data* first_valid_item(tree* t) {
 void STDCALL delete_tree_item(device_extension* Vcb, traverse_ptr* tp, LIST_ENTRY* rollback) {
     tree* t;
     UINT64 gen;
-    traverse_ptr* tp2;
+    traverse_ptr tp2;
 
     TRACE("deleting item %llx,%x,%llx (ignore = %s)\n", tp->item->key.obj_id, tp->item->key.obj_type, tp->item->key.offset, tp->item->ignore ? "TRUE" : "FALSE");
     
@@ -955,6 +1050,9 @@ void STDCALL delete_tree_item(device_extension* Vcb, traverse_ptr* tp, LIST_ENTR
     if (!tp->tree->write) {
         tp->tree->write = TRUE;
         Vcb->need_write = TRUE;
+        
+        InterlockedIncrement(&Vcb->dirty_tree_count);
+        check_dirty_limits(Vcb);
     }
     
     tp->tree->header.num_items--;
@@ -972,43 +1070,17 @@ void STDCALL delete_tree_item(device_extension* Vcb, traverse_ptr* tp, LIST_ENTR
         t = t->parent;
     }
     
-    tp2 = ExAllocateFromPagedLookasideList(&Vcb->traverse_ptr_lookaside);
-    if (!tp2) {
-        ERR("out of memory\n");
-        return;
-    }
-    
-    tp2->tree = tp->tree;
-    tp2->item = tp->item;
+    tp2.tree = tp->tree;
+    tp2.item = tp->item;
 
-    add_rollback(Vcb, rollback, ROLLBACK_DELETE_ITEM, tp2);
+    add_rollback(Vcb, rollback, ROLLBACK_DELETE_ITEM, &tp2);
 }
 
 void clear_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
-    rollback_item* ri;
-    
     while (!IsListEmpty(rollback)) {
-        LIST_ENTRY* le = RemoveHeadList(rollback);
-        ri = CONTAINING_RECORD(le, rollback_item, list_entry);
-        
-        switch (ri->type) {
-            case ROLLBACK_INSERT_ITEM:
-            case ROLLBACK_DELETE_ITEM:
-                ExFreeToPagedLookasideList(&Vcb->traverse_ptr_lookaside, ri->ptr);
-                break;
-                
-            case ROLLBACK_ADD_SPACE:
-            case ROLLBACK_SUBTRACT_SPACE:
-            case ROLLBACK_INSERT_EXTENT:
-            case ROLLBACK_DELETE_EXTENT:
-                ExFreePool(ri->ptr);
-                break;
-
-            default:
-                break;
-        }
+        rollback_block* rb = CONTAINING_RECORD(RemoveHeadList(rollback), rollback_block, list_entry);
         
-        ExFreePool(ri);
+        ExFreeToPagedLookasideList(&Vcb->rollback_block_lookaside, rb);
     }
 }
 
@@ -1017,152 +1089,164 @@ void do_rollback(device_extension* Vcb, LIST_ENTRY* rollback) {
     rollback_item* ri;
     
     while (!IsListEmpty(rollback)) {
-        LIST_ENTRY* le = RemoveTailList(rollback);
-        ri = CONTAINING_RECORD(le, rollback_item, list_entry);
+        rollback_block* rb = CONTAINING_RECORD(rollback->Blink, rollback_block, list_entry);
         
-        switch (ri->type) {
-            case ROLLBACK_INSERT_ITEM:
-            {
-                traverse_ptr* tp = ri->ptr;
-                
-                if (!tp->item->ignore) {
-                    tp->item->ignore = TRUE;
-                    tp->tree->header.num_items--;
-                
-                    if (tp->tree->header.level == 0)
-                        tp->tree->size -= sizeof(leaf_node) + tp->item->size;
-                    else
-                        tp->tree->size -= sizeof(internal_node);
+        while (rb->count > 0) {
+            rb->count--;
+            ri = &rb->items[rb->count];
+            
+            switch (ri->type) {
+                case ROLLBACK_INSERT_ITEM:
+                {
+                    traverse_ptr* tp = &ri->tp;
+                    
+                    if (!tp->item->ignore) {
+                        tp->item->ignore = TRUE;
+                        tp->tree->header.num_items--;
+                        
+                        if (tp->tree->header.level == 0)
+                            tp->tree->size -= sizeof(leaf_node) + tp->item->size;
+                        else
+                            tp->tree->size -= sizeof(internal_node);
+                    }
+                    
+                    break;
                 }
                 
-                ExFreeToPagedLookasideList(&Vcb->traverse_ptr_lookaside, tp);
-                break;
-            }
-                
-            case ROLLBACK_DELETE_ITEM:
-            {
-                traverse_ptr* tp = ri->ptr;
-                
-                if (tp->item->ignore) {
-                    tp->item->ignore = FALSE;
-                    tp->tree->header.num_items++;
-                
-                    if (tp->tree->header.level == 0)
-                        tp->tree->size += sizeof(leaf_node) + tp->item->size;
-                    else
-                        tp->tree->size += sizeof(internal_node);
+                case ROLLBACK_DELETE_ITEM:
+                {
+                    traverse_ptr* tp = &ri->tp;
+                    
+                    if (tp->item->ignore) {
+                        tp->item->ignore = FALSE;
+                        tp->tree->header.num_items++;
+                        
+                        if (tp->tree->header.level == 0)
+                            tp->tree->size += sizeof(leaf_node) + tp->item->size;
+                        else
+                            tp->tree->size += sizeof(internal_node);
+                    }
+                    
+                    break;
                 }
                 
-                ExFreeToPagedLookasideList(&Vcb->traverse_ptr_lookaside, tp);
-                break;
-            }
-            
-            case ROLLBACK_INSERT_EXTENT:
-            {
-                rollback_extent* re = ri->ptr;
-                
-                re->ext->ignore = TRUE;
-                
-                if (re->ext->data->type == EXTENT_TYPE_REGULAR || re->ext->data->type == EXTENT_TYPE_PREALLOC) {
-                    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)re->ext->data->data;
+                case ROLLBACK_INSERT_EXTENT:
+                {
+                    rollback_extent* re = &ri->re;
+                    
+                    re->ext->ignore = TRUE;
                     
-                    if (ed2->size != 0) {
-                        chunk* c = get_chunk_from_address(Vcb, ed2->address);
+                    if (re->ext->data->type == EXTENT_TYPE_REGULAR || re->ext->data->type == EXTENT_TYPE_PREALLOC) {
+                        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)re->ext->data->data;
                         
-                        if (c) {
-                            Status = update_changed_extent_ref(Vcb, c, ed2->address, ed2->size, re->fcb->subvol->id,
-                                                               re->fcb->inode, re->ext->offset - ed2->offset, -1,
-                                                               re->fcb->inode_item.flags & BTRFS_INODE_NODATASUM, FALSE, NULL);
+                        if (ed2->size != 0) {
+                            chunk* c = get_chunk_from_address(Vcb, ed2->address);
+                            
+                            if (c) {
+                                Status = update_changed_extent_ref(Vcb, c, ed2->address, ed2->size, re->fcb->subvol->id,
+                                                                   re->fcb->inode, re->ext->offset - ed2->offset, -1,
+                                                                   re->fcb->inode_item.flags & BTRFS_INODE_NODATASUM, FALSE, NULL);
+                                
+                                if (!NT_SUCCESS(Status))
+                                    ERR("update_changed_extent_ref returned %08x\n", Status);
+                            }
                             
-                            if (!NT_SUCCESS(Status))
-                                ERR("update_changed_extent_ref returned %08x\n", Status);
+                            re->fcb->inode_item.st_blocks -= ed2->num_bytes;
                         }
-                        
-                        re->fcb->inode_item.st_blocks -= ed2->num_bytes;
                     }
+                    
+                    break;
                 }
                 
-                ExFreePool(re);
-                break;
-            }
-            
-            case ROLLBACK_DELETE_EXTENT:
-            {
-                rollback_extent* re = ri->ptr;
-                
-                re->ext->ignore = FALSE;
-                
-                if (re->ext->data->type == EXTENT_TYPE_REGULAR || re->ext->data->type == EXTENT_TYPE_PREALLOC) {
-                    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)re->ext->data->data;
+                case ROLLBACK_DELETE_EXTENT:
+                {
+                    rollback_extent* re = &ri->re;
+                    
+                    re->ext->ignore = FALSE;
                     
-                    if (ed2->size != 0) {
-                        chunk* c = get_chunk_from_address(Vcb, ed2->address);
+                    if (re->ext->data->type == EXTENT_TYPE_REGULAR || re->ext->data->type == EXTENT_TYPE_PREALLOC) {
+                        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)re->ext->data->data;
                         
-                        if (c) {
-                            Status = update_changed_extent_ref(Vcb, c, ed2->address, ed2->size, re->fcb->subvol->id,
-                                                               re->fcb->inode, re->ext->offset - ed2->offset, 1,
-                                                               re->fcb->inode_item.flags & BTRFS_INODE_NODATASUM, FALSE, NULL);
+                        if (ed2->size != 0) {
+                            chunk* c = get_chunk_from_address(Vcb, ed2->address);
                             
-                            if (!NT_SUCCESS(Status))
-                                ERR("update_changed_extent_ref returned %08x\n", Status);
+                            if (c) {
+                                Status = update_changed_extent_ref(Vcb, c, ed2->address, ed2->size, re->fcb->subvol->id,
+                                                                   re->fcb->inode, re->ext->offset - ed2->offset, 1,
+                                                                   re->fcb->inode_item.flags & BTRFS_INODE_NODATASUM, FALSE, NULL);
+                                
+                                if (!NT_SUCCESS(Status))
+                                    ERR("update_changed_extent_ref returned %08x\n", Status);
+                            }
+                            
+                            re->fcb->inode_item.st_blocks += ed2->num_bytes;
                         }
-                        
-                        re->fcb->inode_item.st_blocks += ed2->num_bytes;
                     }
+                    
+                    break;
                 }
-                
-                ExFreePool(re);
-                break;
-            }
 
-            case ROLLBACK_ADD_SPACE:
-            case ROLLBACK_SUBTRACT_SPACE:
-            {
-                rollback_space* rs = ri->ptr;
-                
-                if (rs->chunk)
-                    ExAcquireResourceExclusiveLite(&rs->chunk->lock, TRUE);
-                
-                if (ri->type == ROLLBACK_ADD_SPACE)
-                    space_list_subtract2(Vcb, rs->list, rs->list_size, rs->address, rs->length, NULL);
-                else
-                    space_list_add2(Vcb, rs->list, rs->list_size, rs->address, rs->length, NULL);
-                
-                if (rs->chunk) {
-                    LIST_ENTRY* le2 = le->Blink;
+                case ROLLBACK_ADD_SPACE:
+                case ROLLBACK_SUBTRACT_SPACE:
+                {
+                    rollback_space* rs = &ri->rs;
+                    
+                    if (rs->chunk)
+                        ExAcquireResourceExclusiveLite(&rs->chunk->lock, TRUE);
+                    
+                    if (ri->type == ROLLBACK_ADD_SPACE)
+                        _space_list_subtract2(Vcb, rs->list, rs->list_size, rs->address, rs->length, rs->chunk, NULL, funcname);
+                    else
+                        _space_list_add2(Vcb, rs->list, rs->list_size, rs->address, rs->length, rs->chunk, NULL, funcname);
                     
-                    while (le2 != rollback) {
-                        LIST_ENTRY* le3 = le2->Blink;
-                        rollback_item* ri2 = CONTAINING_RECORD(le2, rollback_item, list_entry);
+                    if (rs->chunk) {
+                        rollback_block* rb2 = rb;
+                        ULONG i = rb->count;
                         
-                        if (ri2->type == ROLLBACK_ADD_SPACE || ri2->type == ROLLBACK_SUBTRACT_SPACE) {
-                            rollback_space* rs2 = ri2->ptr;
+                        // undo the earlier changes to this chunk while we hold its lock
+                        
+                        while (TRUE) {
+                            rollback_item* ri2;
+                            
+                            if (i == 0) {
+                                if (rb2->list_entry.Blink == rollback)
+                                    break;
+                                
+                                rb2 = CONTAINING_RECORD(rb2->list_entry.Blink, rollback_block, list_entry);
+                                i = rb2->count;
+                                continue;
+                            }
+                            
+                            i--;
+                            ri2 = &rb2->items[i];
                             
-                            if (rs2->chunk == rs->chunk) {
-                                if (ri2->type == ROLLBACK_ADD_SPACE)
-                                    space_list_subtract2(Vcb, rs2->list, rs2->list_size, rs2->address, rs2->length, NULL);
-                                else
-                                    space_list_add2(Vcb, rs2->list, rs2->list_size, rs2->address, rs2->length, NULL);
+                            if (ri2->type == ROLLBACK_ADD_SPACE || ri2->type == ROLLBACK_SUBTRACT_SPACE) {
+                                rollback_space* rs2 = &ri2->rs;
                                 
-                                ExFreePool(rs2);
-                                RemoveEntryList(&ri2->list_entry);
-                                ExFreePool(ri2);
+                                if (rs2->chunk == rs->chunk) {
+                                    if (ri2->type == ROLLBACK_ADD_SPACE)
+                                        _space_list_subtract2(Vcb, rs2->list, rs2->list_size, rs2->address, rs2->length, rs2->chunk, NULL, funcname);
+                                    else
+                                        _space_list_add2(Vcb, rs2->list, rs2->list_size, rs2->address, rs2->length, rs2->chunk, NULL, funcname);
+                                    
+                                    ri2->type = ROLLBACK_NONE;
+                                }
                             }
                         }
                         
-                        le2 = le3;
+                        ExReleaseResourceLite(&rs->chunk->lock);
                     }
                     
-                    ExReleaseResourceLite(&rs->chunk->lock);
+                    break;
                 }
-                    
-                ExFreePool(rs);
                 
-                break;
+                default:
+                    break;
             }
         }
         
-        ExFreePool(ri);
+        RemoveEntryList(&rb->list_entry);
+        ExFreeToPagedLookasideList(&Vcb->rollback_block_lookaside, rb);
     }
 }
 
@@ -1707,7 +1791,7 @@ static BOOL handle_batch_collision(device_extension* Vcb, batch_item* bi, tree*
         
         // delete old item
         if (!td->ignore) {
-            traverse_ptr* tp2;
+            traverse_ptr tp2;
             
             td->ignore = TRUE;
         
@@ -1716,16 +1800,10 @@ static BOOL handle_batch_collision(device_extension* Vcb, batch_item* bi, tree*
             t->write = TRUE;
             
             if (rollback) {
-                tp2 = ExAllocateFromPagedLookasideList(&Vcb->traverse_ptr_lookaside);
-                if (!tp2) {
-                    ERR("out of memory\n");
-                    return FALSE;
-                }
-                
-                tp2->tree = t;
-                tp2->item = td;
+                tp2.tree = t;
+                tp2.item = td;
     
-                add_rollback(Vcb, rollback, ROLLBACK_DELETE_ITEM, tp2);
+                add_rollback(Vcb, rollback, ROLLBACK_DELETE_ITEM, &tp2);
             }
         }
 
@@ -1752,7 +1830,7 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
     while (le != &br->items) {
         batch_item* bi = CONTAINING_RECORD(le, batch_item, list_entry);
         LIST_ENTRY *le2, *listhead;
-        traverse_ptr tp, *tp2;
+        traverse_ptr tp, tp2;
         KEY tree_end;
         BOOL no_end;
         tree_data* td;
@@ -1884,17 +1962,10 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
                 tp.tree->write = TRUE;
                 
                 if (rollback) {
-                    // FIXME - free this correctly
-                    tp2 = ExAllocateFromPagedLookasideList(&Vcb->traverse_ptr_lookaside);
-                    if (!tp2) {
-                        ERR("out of memory\n");
-                        return;
-                    }
-                    
-                    tp2->tree = tp.tree;
-                    tp2->item = td;
+                    tp2.tree = tp.tree;
+                    tp2.item = td;
 
-                    add_rollback(Vcb, rollback, ROLLBACK_INSERT_ITEM, tp2);
+                    add_rollback(Vcb, rollback, ROLLBACK_INSERT_ITEM, &tp2);
                 }
                 
                 listhead = &td->list_entry;
@@ -1973,17 +2044,10 @@ static void commit_batch_list_root(device_extension* Vcb, batch_root* br, PIRP I
                             tp.tree->size += bi2->datalen + sizeof(leaf_node);
                             
                             if (rollback) {
-                                // FIXME - free this correctly
-                                tp2 = ExAllocateFromPagedLookasideList(&Vcb->traverse_ptr_lookaside);
-                                if (!tp2) {
-                                    ERR("out of memory\n");
-                                    return;
-                                }
-                                
-                                tp2->tree = tp.tree;
-                                tp2->item = td;
+                                tp2.tree = tp.tree;
+                                tp2.item = td;
                                 
-                                add_rollback(Vcb, rollback, ROLLBACK_INSERT_ITEM, tp2);
+                                add_rollback(Vcb, rollback, ROLLBACK_INSERT_ITEM, &tp2);
                             }
                             
                             listhead = &td->list_entry;
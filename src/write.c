@@ -43,6 +43,7 @@ typedef struct {
 // static BOOL extent_item_is_shared(EXTENT_ITEM* ei, ULONG len);
 static NTSTATUS STDCALL write_data_completion(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID conptr);
 static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback);
+static NTSTATUS trim_delalloc(fcb* fcb, UINT64 start, UINT64 end, PIRP Irp, LIST_ENTRY* rollback);
 
 BOOL find_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT64* address) {
     LIST_ENTRY* le;
@@ -50,6 +51,9 @@ BOOL find_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT6
     
     TRACE("(%p, %llx, %llx, %p)\n", Vcb, c->offset, length, address);
     
+    if (c->space_bitmap_buf)
+        return find_space_bitmap_address(Vcb, c, length, c->offset, address);
+    
     if (IsListEmpty(&c->space_size))
         return FALSE;
     
@@ -83,6 +87,63 @@ BOOL find_address_in_chunk(device_extension* Vcb, chunk* c, UINT64 length, UINT6
     return FALSE;
 }
 
+static BOOL find_address_after_hint(device_extension* Vcb, chunk* c, UINT64 length, UINT64 hint, UINT64* address) {
+    LIST_ENTRY* le;
+    space* s;
+    
+    if (hint < c->offset || hint >= c->offset + c->chunk_item->size)
+        return FALSE;
+    
+    if (c->space_bitmap_buf)
+        return find_space_bitmap_address(Vcb, c, length, hint, address);
+    
+    // Find the first hole which ends after the hint - c->space is sorted by address,
+    // so start from whichever end is nearer.
+    
+    if (hint - c->offset < c->chunk_item->size / 2) {
+        le = c->space.Flink;
+        while (le != &c->space) {
+            s = CONTAINING_RECORD(le, space, list_entry);
+            
+            if (s->address + s->size > hint)
+                break;
+            
+            le = le->Flink;
+        }
+    } else {
+        LIST_ENTRY* le2 = c->space.Blink;
+        
+        le = &c->space;
+        while (le2 != &c->space) {
+            s = CONTAINING_RECORD(le2, space, list_entry);
+            
+            if (s->address + s->size <= hint)
+                break;
+            
+            le = le2;
+            le2 = le2->Blink;
+        }
+    }
+    
+    // next-fit from there
+    
+    while (le != &c->space) {
+        UINT64 start;
+        
+        s = CONTAINING_RECORD(le, space, list_entry);
+        start = max(s->address, hint);
+        
+        if (s->address + s->size - start >= length) {
+            *address = start;
+            return TRUE;
+        }
+        
+        le = le->Flink;
+    }
+    
+    return FALSE;
+}
+
 chunk* get_chunk_from_address(device_extension* Vcb, UINT64 address) {
     LIST_ENTRY* le2;
     chunk* c;
@@ -114,24 +175,48 @@ typedef struct {
 } stripe;
 
 static UINT64 find_new_chunk_address(device_extension* Vcb, UINT64 size) {
-    UINT64 lastaddr;
     LIST_ENTRY* le;
     
-    lastaddr = 0;
+    // Vcb->chunk_gaps always ends with the space after the last chunk, so we'll find something
+    
+    le = Vcb->chunk_gaps.Flink;
+    while (le != &Vcb->chunk_gaps) {
+        space* s = CONTAINING_RECORD(le, space, list_entry);
+        
+        if (s->size >= size)
+            return s->address;
+        
+        le = le->Flink;
+    }
+    
+    ERR("could not find logical address for chunk of size %llx\n", size);
+    
+    return 0xffffffffffffffff;
+}
+
+static space* find_device_hole(device* dev, UINT64 max_stripe_size, space** next) {
+    LIST_ENTRY* le;
+    space *dh1 = NULL, *dh2 = NULL;
+    
+    // dev->space_size is sorted largest first, so the last hole big enough is the best fit
     
-    le = Vcb->chunks.Flink;
-    while (le != &Vcb->chunks) {
-        chunk* c = CONTAINING_RECORD(le, chunk, list_entry);
+    le = dev->space_size.Flink;
+    while (le != &dev->space_size) {
+        space* dh = CONTAINING_RECORD(le, space, list_entry_size);
         
-        if (c->offset >= lastaddr + size)
-            return lastaddr;
+        if (dh->size < max_stripe_size)
+            break;
         
-        lastaddr = c->offset + c->chunk_item->size;
+        dh2 = dh1;
+        dh1 = dh;
         
         le = le->Flink;
     }
     
-    return lastaddr;
+    if (next)
+        *next = dh2;
+    
+    return dh1;
 }
 
 static BOOL find_new_dup_stripes(device_extension* Vcb, stripe* stripes, UINT64 max_stripe_size) {
@@ -144,28 +229,15 @@ static BOOL find_new_dup_stripes(device_extension* Vcb, stripe* stripes, UINT64
             
             // favour devices which have been used the least
             if (usage < devusage) {
-                if (!IsListEmpty(&Vcb->devices[j].space)) {
-                    LIST_ENTRY* le;
-                    space *dh1 = NULL, *dh2 = NULL;
-                    
-                    le = Vcb->devices[j].space.Flink;
-                    while (le != &Vcb->devices[j].space) {
-                        space* dh = CONTAINING_RECORD(le, space, list_entry);
-                        
-                        if (dh->size >= max_stripe_size && (!dh1 || dh->size < dh1->size)) {
-                            dh2 = dh1;
-                            dh1 = dh;
-                        }
-
-                        le = le->Flink;
-                    }
-                    
-                    if (dh1 && (dh2 || dh1->size >= 2 * max_stripe_size)) {
-                        devnum = j;
-                        devusage = usage;
-                        devdh1 = dh1;
-                        devdh2 = dh2 ? dh2 : dh1;
-                    }
+                space *dh1, *dh2;
+                
+                dh1 = find_device_hole(&Vcb->devices[j], max_stripe_size, &dh2);
+                
+                if (dh1 && (dh2 || dh1->size >= 2 * max_stripe_size)) {
+                    devnum = j;
+                    devusage = usage;
+                    devdh1 = dh1;
+                    devdh2 = dh2 ? dh2 : dh1;
                 }
             }
         }
@@ -208,23 +280,12 @@ static BOOL find_new_stripe(device_extension* Vcb, stripe* stripes, UINT16 i, UI
             
             // favour devices which have been used the least
             if (usage < devusage) {
-                if (!IsListEmpty(&Vcb->devices[j].space)) {
-                    LIST_ENTRY* le;
-                    
-                    le = Vcb->devices[j].space.Flink;
-                    while (le != &Vcb->devices[j].space) {
-                        space* dh = CONTAINING_RECORD(le, space, list_entry);
-                        
-                        if ((devnum != j && dh->size >= max_stripe_size) ||
-                            (devnum == j && dh->size >= max_stripe_size && dh->size < devdh->size)
-                        ) {
-                            devdh = dh;
-                            devnum = j;
-                            devusage = usage;
-                        }
-
-                        le = le->Flink;
-                    }
+                space* dh = find_device_hole(&Vcb->devices[j], max_stripe_size, NULL);
+                
+                if (dh) {
+                    devdh = dh;
+                    devnum = j;
+                    devusage = usage;
                 }
             }
         }
@@ -419,6 +480,10 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     }
     
     logaddr = find_new_chunk_address(Vcb, c->chunk_item->size);
+    if (logaddr == 0xffffffffffffffff) {
+        ExFreePool(c->devices);
+        goto end;
+    }
     
     Vcb->superblock.chunk_root_generation = Vcb->superblock.generation;
     
@@ -428,9 +493,12 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     c->cache = NULL;
     c->readonly = FALSE;
     c->reloc = FALSE;
+    c->discarding = 0;
     InitializeListHead(&c->space);
     InitializeListHead(&c->space_size);
+    c->space_bitmap_buf = NULL;
     InitializeListHead(&c->deleting);
+    InitializeListHead(&c->freed);
     InitializeListHead(&c->changed_extents);
     
     InitializeListHead(&c->range_locks);
@@ -456,9 +524,11 @@ chunk* alloc_chunk(device_extension* Vcb, UINT64 flags) {
     for (i = 0; i < num_stripes; i++) {
         stripes[i].device->devitem.bytes_used += stripe_size;
         
-        space_list_subtract2(Vcb, &stripes[i].device->space, NULL, cis[i].offset, stripe_size, NULL);
+        space_list_subtract2(Vcb, &stripes[i].device->space, &stripes[i].device->space_size, cis[i].offset, stripe_size, NULL);
     }
     
+    space_list_subtract2(Vcb, &Vcb->chunk_gaps, NULL, c->offset, c->chunk_item->size, NULL);
+    
     success = TRUE;
     
 end:
@@ -1805,6 +1875,12 @@ NTSTATUS excise_extents(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT
     NTSTATUS Status;
     LIST_ENTRY* le;
     
+    Status = trim_delalloc(fcb, start_data, end_data, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("trim_delalloc returned %08x\n", Status);
+        return Status;
+    }
+    
     le = fcb->extents.Flink;
 
     while (le != &fcb->extents) {
@@ -2360,18 +2436,12 @@ end:
 }
 
 static void add_insert_extent_rollback(LIST_ENTRY* rollback, fcb* fcb, extent* ext) {
-    rollback_extent* re;
+    rollback_extent re;
     
-    re = ExAllocatePoolWithTag(NonPagedPool, sizeof(rollback_extent), ALLOC_TAG);
-    if (!re) {
-        ERR("out of memory\n");
-        return;
-    }
+    re.fcb = fcb;
+    re.ext = ext;
     
-    re->fcb = fcb;
-    re->ext = ext;
-    
-    add_rollback(fcb->Vcb, rollback, ROLLBACK_INSERT_EXTENT, re);
+    add_rollback(fcb->Vcb, rollback, ROLLBACK_INSERT_EXTENT, &re);
 }
 
 static BOOL add_extent_to_fcb(fcb* fcb, UINT64 offset, EXTENT_DATA* ed, ULONG edsize, BOOL unique, UINT32* csum, LIST_ENTRY* rollback) {
@@ -2415,20 +2485,14 @@ end:
 
 static void remove_fcb_extent(fcb* fcb, extent* ext, LIST_ENTRY* rollback) {
     if (!ext->ignore) {
-        rollback_extent* re;
+        rollback_extent re;
         
         ext->ignore = TRUE;
         
-        re = ExAllocatePoolWithTag(NonPagedPool, sizeof(rollback_extent), ALLOC_TAG);
-        if (!re) {
-            ERR("out of memory\n");
-            return;
-        }
+        re.fcb = fcb;
+        re.ext = ext;
         
-        re->fcb = fcb;
-        re->ext = ext;
-        
-        add_rollback(fcb->Vcb, rollback, ROLLBACK_DELETE_EXTENT, re);
+        add_rollback(fcb->Vcb, rollback, ROLLBACK_DELETE_EXTENT, &re);
     }
 }
 
@@ -2502,7 +2566,8 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
     
     TRACE("(%p, (%llx, %llx), %llx, %llx, %llx, %u, %p, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, c->offset, start_data, length, prealloc, data, changed_sector_list, rollback);
     
-    if (!find_address_in_chunk(Vcb, c, length, &address))
+    // try to put the extent straight after the last one we allocated for this file
+    if (!find_address_after_hint(Vcb, c, length, fcb->alloc_hint, &address) && !find_address_in_chunk(Vcb, c, length, &address))
         return FALSE;
     
 // #ifdef DEBUG_PARANOID
@@ -2564,6 +2629,7 @@ BOOL insert_extent_chunk(device_extension* Vcb, fcb* fcb, chunk* c, UINT64 start
     increase_chunk_usage(c, length);
     space_list_subtract(Vcb, c, FALSE, address, length, rollback);
     
+    fcb->alloc_hint = address + length;
     fcb->inode_item.st_blocks += decoded_size;
     
     fcb->extents_changed = TRUE;
@@ -2652,6 +2718,25 @@ static BOOL try_extend_data(device_extension* Vcb, fcb* fcb, UINT64 start_data,
     
     ExAcquireResourceExclusiveLite(&c->lock, TRUE);
     
+    if (c->space_bitmap_buf) {
+        UINT64 address, size;
+        
+        if (find_space_bitmap_run(Vcb, c, ed2->address + ed2->size, &address, &size) && address == ed2->address + ed2->size) {
+            UINT64 newlen = min(min(size, length), MAX_EXTENT_SIZE);
+            
+            success = insert_extent_chunk(Vcb, fcb, c, start_data, newlen, FALSE, data, changed_sector_list, Irp, rollback, BTRFS_COMPRESSION_NONE, newlen);
+            
+            if (success)
+                *written += newlen;
+            
+            return success;
+        }
+        
+        ExReleaseResourceLite(&c->lock);
+        
+        return FALSE;
+    }
+    
     le = c->space.Flink;
     while (le != &c->space) {
         s = CONTAINING_RECORD(le, space, list_entry);
@@ -2757,7 +2842,7 @@ end:
 
 NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT64 length, void* data, LIST_ENTRY* changed_sector_list, PIRP Irp, LIST_ENTRY* rollback) {
     LIST_ENTRY* le;
-    chunk* c;
+    chunk *c, *hintc;
     UINT64 flags, orig_length = length, written = 0;
     
     TRACE("(%p, (%llx, %llx), %llx, %llx, %p, %p)\n", Vcb, fcb->subvol->id, fcb->inode, start_data, length, data, changed_sector_list);
@@ -2785,9 +2870,22 @@ NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT6
         
         ExAcquireResourceSharedLite(&Vcb->chunk_lock, TRUE);
         
+        // Try the chunk where this file's last extent ended before any of the others.
+        
+        hintc = fcb->alloc_hint != 0 ? get_chunk_from_address(Vcb, fcb->alloc_hint) : NULL;
+        c = hintc;
+        
         le = Vcb->chunks.Flink;
-        while (le != &Vcb->chunks) {
-            c = CONTAINING_RECORD(le, chunk, list_entry);
+        while (c || le != &Vcb->chunks) {
+            if (!c) {
+                c = CONTAINING_RECORD(le, chunk, list_entry);
+                le = le->Flink;
+                
+                if (c == hintc) {
+                    c = NULL;
+                    continue;
+                }
+            }
             
             if (!c->readonly && !c->reloc) {
                 ExAcquireResourceExclusiveLite(&c->lock, TRUE);
@@ -2809,8 +2907,8 @@ NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT6
                 } else
                     ExReleaseResourceLite(&c->lock);
             }
-
-            le = le->Flink;
+            
+            c = NULL;
         }
         
         ExReleaseResourceLite(&fcb->Vcb->chunk_lock);
@@ -2857,7 +2955,346 @@ NTSTATUS insert_extent(device_extension* Vcb, fcb* fcb, UINT64 start_data, UINT6
 void commit_checksum_changes(device_extension* Vcb, LIST_ENTRY* changed_sector_list) {
     while (!IsListEmpty(changed_sector_list)) {
         LIST_ENTRY* le = RemoveHeadList(changed_sector_list);
+        changed_sector* sc = (changed_sector*)le;
+        
         InsertTailList(&Vcb->sector_checksums, le);
+        InterlockedExchangeAdd(&Vcb->dirty_csum_count, sc->length);
+    }
+    
+    check_dirty_limits(Vcb);
+}
+
+static __inline void adjust_delalloc_size(fcb* fcb, LONGLONG delta) {
+    fcb->delalloc_size += delta;
+    InterlockedExchangeAdd64(&fcb->Vcb->delalloc_size, delta);
+}
+
+// Queued data has no space allocated until it's flushed, so we only queue more if what's free would
+// still cover everything queued. Otherwise it's written straight away, so that running out of space
+// is reported to whoever's writing, rather than found when we come to commit.
+static BOOL delalloc_space_available(device_extension* Vcb, UINT64 length) {
+    LONGLONG totalsize, freespace;
+    
+    calculate_total_space(Vcb, &totalsize, &freespace);
+    
+    return (UINT64)freespace * Vcb->superblock.sector_size >= (UINT64)Vcb->delalloc_size + length + DELALLOC_SPACE_MARGIN;
+}
+
+// Takes ownership of data on success. The new data takes precedence over anything
+// already queued for the same range.
+static NTSTATUS add_delalloc_range(fcb* fcb, UINT64 start, UINT64 length, UINT8* data) {
+    LIST_ENTRY* le;
+    delalloc_range *dr, *first = NULL;
+    UINT64 end = start + length, newstart, newend;
+    UINT8* buf;
+    ULONG alloc;
+    
+    le = fcb->delalloc.Flink;
+    while (le != &fcb->delalloc) {
+        dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (dr->start + dr->length >= start) {
+            first = dr;
+            break;
+        }
+        
+        le = le->Flink;
+    }
+    
+    if (!first || first->start > end) {
+        dr = ExAllocatePoolWithTag(PagedPool, sizeof(delalloc_range), ALLOC_TAG);
+        if (!dr) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        dr->start = start;
+        dr->length = length;
+        dr->alloc = length;
+        dr->data = data;
+        
+        if (first)
+            InsertHeadList(first->list_entry.Blink, &dr->list_entry);
+        else
+            InsertTailList(&fcb->delalloc, &dr->list_entry);
+        
+        adjust_delalloc_size(fcb, length);
+        
+        return STATUS_SUCCESS;
+    }
+    
+    // Ranges never overlap, so everything from first up to the last range starting
+    // before end joins up with the new data into one contiguous run.
+    
+    newstart = min(start, first->start);
+    newend = end;
+    
+    le = &first->list_entry;
+    while (le != &fcb->delalloc) {
+        dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (dr->start > end)
+            break;
+        
+        newend = max(newend, dr->start + dr->length);
+        
+        le = le->Flink;
+    }
+    
+    if (newstart == first->start && newend - newstart <= first->alloc) {
+        buf = first->data;
+        alloc = first->alloc;
+    } else {
+        alloc = newend - newstart;
+        
+        // grow geometrically, so that appending small records doesn't keep copying the run
+        if (newstart == first->start && alloc < first->alloc * 2 && first->alloc * 2 <= DELALLOC_FCB_LIMIT)
+            alloc = first->alloc * 2;
+        
+        buf = ExAllocatePoolWithTag(PagedPool, alloc, ALLOC_TAG);
+        if (!buf) {
+            ERR("out of memory\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        RtlCopyMemory(buf + first->start - newstart, first->data, first->length);
+    }
+    
+    le = first->list_entry.Flink;
+    while (le != &fcb->delalloc) {
+        LIST_ENTRY* le2 = le->Flink;
+        
+        dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (dr->start > end)
+            break;
+        
+        RtlCopyMemory(buf + dr->start - newstart, dr->data, dr->length);
+        
+        adjust_delalloc_size(fcb, -(LONGLONG)dr->length);
+        
+        RemoveEntryList(&dr->list_entry);
+        ExFreePool(dr->data);
+        ExFreePool(dr);
+        
+        le = le2;
+    }
+    
+    RtlCopyMemory(buf + start - newstart, data, length);
+    ExFreePool(data);
+    
+    if (buf != first->data)
+        ExFreePool(first->data);
+    
+    adjust_delalloc_size(fcb, (LONGLONG)(newend - newstart) - (LONGLONG)first->length);
+    
+    first->start = newstart;
+    first->length = newend - newstart;
+    first->alloc = alloc;
+    first->data = buf;
+    
+    return STATUS_SUCCESS;
+}
+
+void free_fcb_delalloc(fcb* fcb) {
+    while (!IsListEmpty(&fcb->delalloc)) {
+        LIST_ENTRY* le = RemoveHeadList(&fcb->delalloc);
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        adjust_delalloc_size(fcb, -(LONGLONG)dr->length);
+        
+        ExFreePool(dr->data);
+        ExFreePool(dr);
+    }
+}
+
+// Allocates and writes out everything queued for this fcb. We detach the list first,
+// so that the excise_extents calls made by do_write_file don't try to trim it. Each range
+// gets its own rollback list, so that if a write fails we can undo just that range - it
+// and everything after it are then put back on the queue, to be tried again next time.
+NTSTATUS flush_fcb_delalloc(fcb* fcb, PIRP Irp, LIST_ENTRY* rollback) {
+    NTSTATUS Status = STATUS_SUCCESS;
+    LIST_ENTRY delalloc, changed_sector_list, range_rollback, range_csums;
+    BOOL nocsum = fcb->inode_item.flags & BTRFS_INODE_NODATASUM;
+    UINT64 end_data;
+    
+    if (IsListEmpty(&fcb->delalloc))
+        return STATUS_SUCCESS;
+    
+    TRACE("(%p (%llx, %llx), %llx bytes)\n", fcb, fcb->subvol->id, fcb->inode, fcb->delalloc_size);
+    
+    delalloc.Flink = fcb->delalloc.Flink;
+    delalloc.Blink = fcb->delalloc.Blink;
+    delalloc.Flink->Blink = &delalloc;
+    delalloc.Blink->Flink = &delalloc;
+    InitializeListHead(&fcb->delalloc);
+    
+    InterlockedExchangeAdd64(&fcb->Vcb->delalloc_size, -(LONGLONG)fcb->delalloc_size);
+    fcb->delalloc_size = 0;
+    
+    if (!nocsum)
+        InitializeListHead(&changed_sector_list);
+    
+    end_data = sector_align(fcb->inode_item.st_size, fcb->Vcb->superblock.sector_size);
+    
+    while (!IsListEmpty(&delalloc)) {
+        LIST_ENTRY* le = RemoveHeadList(&delalloc);
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (!fcb->deleted && dr->start < end_data) {
+            InitializeListHead(&range_rollback);
+            
+            if (!nocsum)
+                InitializeListHead(&range_csums);
+            
+            Status = do_write_file(fcb, dr->start, min(dr->start + dr->length, end_data), dr->data, nocsum ? NULL : &range_csums, Irp, &range_rollback);
+            if (!NT_SUCCESS(Status)) {
+                ERR("do_write_file returned %08x\n", Status);
+                
+                do_rollback(fcb->Vcb, &range_rollback);
+                
+                if (!nocsum) {
+                    while (!IsListEmpty(&range_csums)) {
+                        changed_sector* sc = (changed_sector*)RemoveHeadList(&range_csums);
+                        
+                        if (sc->checksums)
+                            ExFreePool(sc->checksums);
+                        
+                        ExFreePool(sc);
+                    }
+                }
+                
+                InsertHeadList(&delalloc, &dr->list_entry);
+                
+                while (!IsListEmpty(&delalloc)) {
+                    dr = CONTAINING_RECORD(RemoveHeadList(&delalloc), delalloc_range, list_entry);
+                    
+                    InsertTailList(&fcb->delalloc, &dr->list_entry);
+                    adjust_delalloc_size(fcb, dr->length);
+                }
+                
+                break;
+            }
+            
+            while (!IsListEmpty(&range_rollback)) {
+                InsertTailList(rollback, RemoveHeadList(&range_rollback));
+            }
+            
+            if (!nocsum) {
+                while (!IsListEmpty(&range_csums)) {
+                    InsertTailList(&changed_sector_list, RemoveHeadList(&range_csums));
+                }
+            }
+        }
+        
+        ExFreePool(dr->data);
+        ExFreePool(dr);
+    }
+    
+    if (!nocsum) {
+        ExAcquireResourceExclusiveLite(&fcb->Vcb->checksum_lock, TRUE);
+        commit_checksum_changes(fcb->Vcb, &changed_sector_list);
+        ExReleaseResourceLite(&fcb->Vcb->checksum_lock);
+    }
+    
+    fcb->delalloc_status = Status;
+    
+    return Status;
+}
+
+// Drops any queued data between start and end, as it's about to be replaced or removed.
+static NTSTATUS trim_delalloc(fcb* fcb, UINT64 start, UINT64 end, PIRP Irp, LIST_ENTRY* rollback) {
+    LIST_ENTRY* le;
+    
+    if (IsListEmpty(&fcb->delalloc))
+        return STATUS_SUCCESS;
+    
+    // We can only split runs on sector boundaries - if we've been asked for anything
+    // else, just write everything out now.
+    if (start % fcb->Vcb->superblock.sector_size != 0 || end % fcb->Vcb->superblock.sector_size != 0)
+        return flush_fcb_delalloc(fcb, Irp, rollback);
+    
+    le = fcb->delalloc.Flink;
+    while (le != &fcb->delalloc) {
+        LIST_ENTRY* le2 = le->Flink;
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        UINT64 dr_end = dr->start + dr->length;
+        
+        if (dr->start >= end)
+            break;
+        
+        if (dr_end > start) {
+            if (start <= dr->start && end >= dr_end) {
+                adjust_delalloc_size(fcb, -(LONGLONG)dr->length);
+                
+                RemoveEntryList(&dr->list_entry);
+                ExFreePool(dr->data);
+                ExFreePool(dr);
+            } else if (start <= dr->start) {
+                UINT64 cut = end - dr->start;
+                
+                RtlMoveMemory(dr->data, dr->data + cut, dr->length - cut);
+                dr->start = end;
+                dr->length -= cut;
+                
+                adjust_delalloc_size(fcb, -(LONGLONG)cut);
+            } else if (end >= dr_end) {
+                adjust_delalloc_size(fcb, -(LONGLONG)(dr_end - start));
+                
+                dr->length = start - dr->start;
+            } else {
+                delalloc_range* dr2;
+                
+                dr2 = ExAllocatePoolWithTag(PagedPool, sizeof(delalloc_range), ALLOC_TAG);
+                if (!dr2) {
+                    ERR("out of memory\n");
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                
+                dr2->start = end;
+                dr2->length = dr2->alloc = dr_end - end;
+                dr2->data = ExAllocatePoolWithTag(PagedPool, dr2->alloc, ALLOC_TAG);
+                if (!dr2->data) {
+                    ERR("out of memory\n");
+                    ExFreePool(dr2);
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                
+                RtlCopyMemory(dr2->data, dr->data + end - dr->start, dr2->length);
+                InsertHeadList(&dr->list_entry, &dr2->list_entry);
+                
+                dr->length = start - dr->start;
+                
+                adjust_delalloc_size(fcb, -(LONGLONG)(end - start));
+                
+                break;
+            }
+        }
+        
+        le = le2;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+void read_delalloc(fcb* fcb, UINT8* data, UINT64 start, UINT64 length) {
+    LIST_ENTRY* le;
+    
+    le = fcb->delalloc.Flink;
+    while (le != &fcb->delalloc) {
+        delalloc_range* dr = CONTAINING_RECORD(le, delalloc_range, list_entry);
+        
+        if (dr->start >= start + length)
+            break;
+        
+        if (dr->start + dr->length > start) {
+            UINT64 s = max(start, dr->start);
+            UINT64 e = min(start + length, dr->start + dr->length);
+            
+            RtlCopyMemory(data + s - start, dr->data + s - dr->start, e - s);
+        }
+        
+        le = le->Flink;
     }
 }
 
@@ -3538,6 +3975,12 @@ NTSTATUS do_write_file(fcb* fcb, UINT64 start, UINT64 end_data, void* data, LIST
     
     last_cow_start = 0;
     
+    Status = trim_delalloc(fcb, start, end_data, Irp, rollback);
+    if (!NT_SUCCESS(Status)) {
+        ERR("trim_delalloc returned %08x\n", Status);
+        return Status;
+    }
+    
     le = fcb->extents.Flink;
     while (le != &fcb->extents) {
         extent* ext = CONTAINING_RECORD(le, extent, list_entry);
@@ -4078,15 +4521,40 @@ NTSTATUS write_file2(device_extension* Vcb, PIRP Irp, LARGE_INTEGER offset, void
             
             ExFreePool(data);
         } else {
-            Status = do_write_file(fcb, start_data, end_data, data, nocsum ? NULL : &changed_sector_list, Irp, rollback);
+            // Writes from the lazy writer are queued up and only given an address when we flush
+            // (or when too much is queued), so we get big contiguous extents rather than whatever
+            // sized pieces the cache manager hands us.
+            if (paging_io && !pagefile && !(fcb->inode_item.flags & BTRFS_INODE_NODATACOW) && delalloc_space_available(Vcb, end_data - start_data)) {
+                Status = add_delalloc_range(fcb, start_data, end_data - start_data, data);
+                
+                if (NT_SUCCESS(Status)) {
+                    if (fcb->delalloc_size >= DELALLOC_FCB_LIMIT || Vcb->delalloc_size >= DELALLOC_VCB_LIMIT) {
+                        Status = flush_fcb_delalloc(fcb, Irp, rollback);
+                        if (!NT_SUCCESS(Status)) {
+                            ERR("flush_fcb_delalloc returned %08x\n", Status);
+                            
+                            // what couldn't be written is still queued, so make sure the next commit tries again
+                            mark_fcb_dirty(fcb);
+                            goto end;
+                        }
+                    }
+                    
+                    data = NULL;
+                } else
+                    WARN("add_delalloc_range returned %08x, writing directly\n", Status);
+            }
             
-            if (!NT_SUCCESS(Status)) {
-                ERR("do_write_file returned %08x\n", Status);
+            if (data) {
+                Status = do_write_file(fcb, start_data, end_data, data, nocsum ? NULL : &changed_sector_list, Irp, rollback);
+                
+                if (!NT_SUCCESS(Status)) {
+                    ERR("do_write_file returned %08x\n", Status);
+                    ExFreePool(data);
+                    goto end;
+                }
+                
                 ExFreePool(data);
-                goto end;
             }
-            
-            ExFreePool(data);
         }
     }
     
@@ -4336,6 +4804,10 @@ NTSTATUS STDCALL drv_write(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp) {
     
 //     ERR("recursive = %s\n", Irp != IoGetTopLevelIrp() ? "TRUE" : "FALSE");
     
+    // Don't hold up paging I/O or recursive requests - the caller might have locks the commit needs.
+    if (top_level && !(Irp->Flags & IRP_PAGING_IO))
+        throttle_writes(Vcb);
+    
     try {
         if (IrpSp->MinorFunction & IRP_MN_COMPLETE) {
             CcMdlWriteComplete(IrpSp->FileObject, &IrpSp->Parameters.Write.ByteOffset, Irp->MdlAddress);